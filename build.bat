@@ -28,7 +28,7 @@ set LINK_ONLY=0
 set SOURCE_DIRECTORIES=src example
 set INCLUDE_DIRECTORIES=include example
 set LIBRARY_DIRECTORIES=
-set LIBRARY_NAMES=gdi32 Advapi32
+set LIBRARY_NAMES=gdi32 Advapi32 Psapi ws2_32 Cabinet
 
 
 :: Additional Compiler Flags And Configuration Settings
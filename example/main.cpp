@@ -9,9 +9,13 @@
 #include <thread>
 #include <queue>
 #include <mutex>
+#include <charconv>
+#include <iomanip>
+#include <algorithm>
 
 #include "commctrl.h"
 #include <tlhelp32.h>
+#include <psapi.h>
 
 #include "libwinservice_csd.h"
 #include "clock.h"
@@ -20,8 +24,14 @@ std::string service_name = "libwinservice_example";
 std::string service_displayname = "Example Service";
 std::string service_description = "This is an example service registered via the example from the libwinservice library.";
 
+// How long the SCM waits for the service to drain before a system shutdown, in milliseconds
+DWORD service_preshutdown_timeout = 10000;
+
 std::string service_mailbox = service_name + "_service";
 std::string process_mailbox = service_name + "_process";
+std::string swarm_mailbox = service_name + "_swarm";
+std::string trace_mailbox = service_name + "_trace";
+std::string trace_child_mailbox = service_name + "_trace_child";
 
 bool debug_service = false;
 
@@ -72,6 +82,22 @@ HANDLE GetProcessHandle(DWORD pid) {
     return OpenProcess(PROCESS_ALL_ACCESS, FALSE, pid);
 }
 
+// private memory committed by a process
+size_t GetProcessPrivateBytes(HANDLE process) {
+    PROCESS_MEMORY_COUNTERS_EX pmc {};
+    if(!GetProcessMemoryInfo(process, (PROCESS_MEMORY_COUNTERS*)&pmc, sizeof(pmc))) return 0;
+    return pmc.PrivateUsage;
+}
+
+// kernel + user CPU time consumed by a process
+double GetProcessCpuSeconds(HANDLE process) {
+    FILETIME creation, exit, kernel, user;
+    if(!GetProcessTimes(process, &creation, &exit, &kernel, &user)) return 0;
+
+    auto ticks = [](const FILETIME& t){ return (ULONGLONG(t.dwHighDateTime) << 32) | t.dwLowDateTime; };
+    return double(ticks(kernel) + ticks(user)) / 10000000.0; // 100ns intervals
+}
+
 
 std::mutex mtx_message;
 std::atomic_bool showingMessage = false;
@@ -197,6 +223,7 @@ void CustomMessage(std::string msg, std::string caption = "") {
 
 HANDLE childProcess = NULL;
 DWORD childPID = 0;
+std::string tracePath; // the service's trace file, the child traces into it as well
 
 void SpawnProcess() {
     if(childProcess != NULL) return; // do not spawn another process
@@ -207,9 +234,10 @@ void SpawnProcess() {
         if (GetModuleFileName(NULL, (LPSTR)szPath, ARRAYSIZE(szPath)) == 0) return;
         cmd.assign(szPath);
     }
-    cmd += " child " + std::to_string(GetCurrentProcessId());
+    cmd += " child";
 
     if(debug_service) cmd += " debug";
+    if(!tracePath.empty()) cmd += " trace \"" + tracePath + "\"";
 
     HANDLE token {};
 
@@ -289,37 +317,25 @@ bool CheckProcess() {
 
 // This is the child process runtime
 void ChildProcess(std::vector<std::string>& args) {
-    if(args.size() < 2) return;
-    
     std::stringstream nil;
-    if(args.size() < 3 || args.at(2) != "debug"){
+    if(std::find(args.begin(), args.end(), "debug") == args.end()){
         FreeConsole();
         std::cout.rdbuf(nil.rdbuf());
     }
 
-    DWORD pid = 0;
-    try {
-        std::cout << "Parent PID: " << args.at(1) << "\n";
-        pid = std::stoul(args.at(1));
-    } catch(...) {
-        std::cout << "Invalid Parent Process ID\n";
-        return;
-    }
-
-    process_mailbox += std::to_string(GetCurrentProcessId()); // my pid
-    service_mailbox += args.at(1); // service pid passed into program
+    auto trace = std::find(args.begin(), args.end(), "trace");
+    if(trace != args.end() && ++trace != args.end()) CTracer::Default().Start(*trace, "child");
 
+    Clock startup;
     IPCController ipc; // incoming process / outgoing service direction
-    ipc.InitializeInbox(process_mailbox);
-    Sleep(200); // wait for IPC to register
-    ipc.InitializeOutbox(service_mailbox);
-    Sleep(1000); // wait for IPC to register
+    ipc.PublishInbox(process_mailbox);  // the service finds us by name
+    ipc.ConnectOutbox(service_mailbox); // and we find the service the same way
 
-    if(!ipc.IsValid() || !ipc.IsValidOutbox()){
+    if(!ipc.WaitForPeer(5000)){ // wait for the service to answer our handshake
         std::cout << "IPC failed to initialize: " << ipc.LastError() << "\n";
         return;
     } else {
-        std::cout << "IPC registered\n";
+        std::cout << "IPC registered in " << startup.getMilliseconds() << "ms\n";
     }
 
     // { // authorize IPC
@@ -337,22 +353,15 @@ void ChildProcess(std::vector<std::string>& args) {
     // }
 
     bool running = true;
+    std::vector<std::string_view> parts; // views into msg, reused between messages
+    std::string msg;
     while(running){
         if(GetAsyncKeyState(VK_F7) & 0x8000){
             CustomMessage("F7 Key Pressed");
             Sleep(100);
         }
-        std::vector<std::string> parts;
-        std::string msg;
         if(ipc.Receive(msg)){
-            std::string* next = &parts.emplace_back();
-            for(char c : msg){
-                if(c == ';'){
-                    next = &parts.emplace_back();
-                    continue;
-                }
-                (*next) += c;
-            }
+            SplitFields(msg, ';', parts);
 
             std::cout << "parts: " << parts.size() << "\n";
 
@@ -363,7 +372,7 @@ void ChildProcess(std::vector<std::string>& args) {
             if(parts[0] == "exit"){
                 running = false;
             } else {
-                CustomMessage(parts[0]);
+                CustomMessage(std::string(parts[0]));
             }
             for(int i=1; i < parts.size(); ++i){
                 std::cout << "Data[" << i << "]: " << parts[i] << "\n";
@@ -371,8 +380,160 @@ void ChildProcess(std::vector<std::string>& args) {
         }
         Sleep(3);
     }
+    CTracer::Default().Stop();
+}
+
+// numeric command line option following its name, e.g. "children 100"
+double GetOption(const std::vector<std::string>& args, const std::string& name, double fallback) {
+    auto it = std::find(args.begin(), args.end(), name);
+    if(it == args.end() || ++it == args.end()) return fallback;
+    return std::atof(it->c_str());
 }
 
+// Settings the service reloads on a parameter change (sc control libwinservice_example paramchange)
+struct ExampleConfig {
+    DWORD restartDelay = 2000;              // milliseconds before a child that exited is started again
+    std::string greeting = "Service Started"; // first message sent to the child
+};
+
+// Read the settings from the service's Parameters key; missing values keep their defaults
+std::shared_ptr<const ExampleConfig> LoadExampleConfig() {
+    auto config = std::make_shared<ExampleConfig>();
+    std::string key = "SYSTEM\\CurrentControlSet\\Services\\" + service_name + "\\Parameters";
+
+    DWORD value, size = sizeof(value);
+    if(RegGetValue(HKEY_LOCAL_MACHINE, key.c_str(), "RestartDelay", RRF_RT_REG_DWORD, NULL, &value, &size) == ERROR_SUCCESS){
+        config->restartDelay = value;
+    }
+    char text[256];
+    size = sizeof(text);
+    if(RegGetValue(HKEY_LOCAL_MACHINE, key.c_str(), "Greeting", RRF_RT_REG_SZ, NULL, text, &size) == ERROR_SUCCESS){
+        config->greeting = text;
+    }
+    return config;
+}
+
+// Forwards whole lines written to a stream to a logger, for code that still prints to std::cout
+class LoggerStreamBuf : public std::streambuf {
+    CLogger& logger;
+public:
+    LoggerStreamBuf(CLogger& logger): logger(logger) {}
+
+protected:
+    static std::string& Line() {
+        thread_local std::string line;
+        return line;
+    }
+
+    int overflow(int c) override {
+        if(c == traits_type::eof()) return 0;
+        if(c != '\n'){
+            Line() += (char)c;
+        } else if(!Line().empty()){
+            logger.Info("{}", Line());
+            Line().clear();
+        }
+        return c;
+    }
+
+    std::streamsize xsputn(const char* s, std::streamsize n) override {
+        for(std::streamsize i = 0; i < n; ++i) overflow((unsigned char)s[i]);
+        return n;
+    }
+};
+
+// message size of the n-th message of a swarm mix
+size_t SwarmMessageSize(const std::string& mix, size_t n) {
+    if(mix == "small") return 64;
+    if(mix == "large") return 4096;
+
+    // mixed: mostly small, every 10th medium, every 100th large
+    if(n % 100 == 0) return 4096;
+    if(n % 10 == 0) return 424;
+    return 64;
+}
+
+// Synthetic swarm client: sends time stamped messages to the swarm service until its parent exits
+void SwarmChildProcess(std::vector<std::string>& args) {
+    auto at = std::find(args.begin(), args.end(), "swarm_child");
+    if(args.end() - at < 4) return; // swarm_child <parent pid> <msg/s> <mix>
+
+    double rate = std::atof(at[2].c_str());
+    std::string mix = at[3];
+
+    HANDLE parent = OpenProcess(SYNCHRONIZE, FALSE, std::stoul(at[1]));
+    if(parent == NULL) return;
+
+    IPCController ipc;
+    ipc.ConnectOutbox(swarm_mailbox);
+
+    if(ipc.WaitForPeer(30000)){
+        auto start = std::chrono::steady_clock::now();
+        size_t sent = 0;
+        std::string msg;
+
+        while(WaitForSingleObject(parent, 1) == WAIT_TIMEOUT){ // also paces the loop at about 1ms
+            auto now = std::chrono::steady_clock::now();
+            size_t due = size_t(std::chrono::duration<double>(now - start).count() * rate);
+
+            for(; sent < due; ++sent){
+                msg = std::to_string(now.time_since_epoch().count()) + ";" + std::to_string(sent) + ";";
+                msg.resize(std::max(msg.size(), SwarmMessageSize(mix, sent)), '.');
+                ipc.Send(msg);
+            }
+        }
+    }
+    CloseHandle(parent);
+}
+
+// Echo client of debug_trace: answers every message until told to exit or its parent exits
+void TraceChildProcess(std::vector<std::string>& args) {
+    auto at = std::find(args.begin(), args.end(), "trace_child");
+    if(args.end() - at < 3) return; // trace_child <parent pid> <trace file>
+
+    HANDLE parent = OpenProcess(SYNCHRONIZE, FALSE, std::stoul(at[1]));
+    if(parent == NULL) return;
+
+    CTracer& tracer = CTracer::Default();
+    tracer.Start(at[2], "trace_child");
+    tracer.NameThread("echo");
+
+    IPCController ipc;
+    ipc.PublishInbox(trace_child_mailbox);
+    ipc.ConnectOutbox(trace_mailbox);
+
+    std::string msg;
+    while(WaitForSingleObject(parent, 0) == WAIT_TIMEOUT){
+        if(!ipc.WaitReceive(msg, 100)) continue;
+        if(msg == "exit") break;
+
+        CTraceSpan span("echo", "example");
+        ipc.Send(msg);
+    }
+    tracer.Stop();
+    CloseHandle(parent);
+}
+
+// Service with a typical startup: load a cache, read the configuration, open
+// the IPC endpoints once configured and spawn children once IPC is up.
+// Run serially in OnStart, or declared as a startup graph.
+class StartupBenchService : public CServiceBase {
+    bool parallel;
+public:
+    StartupBenchService(const char* name, bool parallel) : CServiceBase(name), parallel(parallel) {}
+protected:
+    void OnStart(DWORD dwArgc, PWSTR* pszArgv) override {
+        if(!parallel){
+            Sleep(300); Sleep(100); Sleep(150); Sleep(200);
+            return;
+        }
+        AddStartupTask("load cache", [](){ Sleep(300); }, {}, 300);
+        size_t config = AddStartupTask("read config", [](){ Sleep(100); }, {}, 100);
+        size_t ipc = AddStartupTask("open ipc", [](){ Sleep(150); }, { config }, 150);
+        AddStartupTask("spawn children", [](){ Sleep(200); }, { ipc }, 200);
+    }
+};
+
 int main(int argc, char *argv[]) {
     std::vector<std::string> args; for(int i=1; i < argc; ++i) args.emplace_back(argv[i]);
 
@@ -383,7 +544,9 @@ int main(int argc, char *argv[]) {
                     service_name.c_str(),               // Name of service
                     service_displayname.c_str(),        // Name to display
                     service_description.c_str(),        // Description
-                    SERVICE_AUTO_START, SERVICE_ERROR_NORMAL
+                    SERVICE_AUTO_START, SERVICE_ERROR_NORMAL,
+                    "", NULL, NULL, SERVICE_WIN32_OWN_PROCESS,
+                    service_preshutdown_timeout
                 )){
                     std::cout << "Starting Service" << std::endl;
                     StartService(service_name.c_str());
@@ -404,15 +567,17 @@ int main(int argc, char *argv[]) {
             }
         },
         { "debug_ipc", [&](){
-                service_mailbox += std::to_string(GetCurrentProcessId());
-
                 std::cout << "Debugging IPC... Spawn process...\n";
+                Clock startup;
                 SpawnProcess();
 
-                process_mailbox += std::to_string(childPID);
-
                 std::cout << "Setting up IPC as service...\n";
-                IPCController ipc(service_mailbox, process_mailbox);
+                IPCController ipc;
+                if(std::find(args.begin(), args.end(), "capture") != args.end()){
+                    if(ipc.StartCapture("debug_ipc.lwscap")) std::cout << "Capturing to debug_ipc.lwscap\n";
+                }
+                ipc.PublishInbox(service_mailbox);
+                ipc.ConnectOutbox(process_mailbox);
 
                 std::cout << "IPC Details:\n"
                           << " inbox: " << service_mailbox << "\n"
@@ -425,7 +590,13 @@ int main(int argc, char *argv[]) {
                 }
 
                 std::cout << "Wait for process launch...\n";
-                Sleep(1500);
+                if(ipc.WaitForPeer(5000)){
+                    std::cout << "Child connected " << startup.getMilliseconds() << "ms after spawn\n";
+                    std::cout << "Negotiated protocol v" << int(ipc.PeerVersion()) << ", "
+                              << (ipc.Codec() == IPC_CODEC_COMPRESSED ? "compressed" : "plain") << " codec\n";
+                } else {
+                    std::cout << "Child did not connect: " << ipc.LastError() << "\n";
+                }
 
                 std::cout << "Sending Messages...\n";
                 for(int i=0; i < 3; ++i){
@@ -465,6 +636,1216 @@ int main(int argc, char *argv[]) {
                 std::cout << "Exiting...\n";
             }
         },
+        { "debug_reactor", [&](){
+                // debug_reactor [seconds S] - idle cost of controllers sharing the reactor vs one polling thread each
+                double seconds = std::max(GetOption(args, "seconds", 10), 1.0);
+                std::cout << "Measuring idle IPC cost per controller...\n";
+                for(size_t count : {1, 100, 1000}){
+                    double cpu[2];
+                    size_t memory[2];
+                    for(bool shared : { false, true }){
+                        size_t memStart = GetProcessPrivateBytes(GetCurrentProcess());
+                        {
+                            // The baseline gives each controller a reactor of its own: a thread waking
+                            // every 25ms, as each controller ran its own polling thread before
+                            std::vector<std::unique_ptr<IPCReactor>> reactors;
+                            std::vector<std::unique_ptr<IPCController>> controllers;
+                            for(size_t i=0; i < count; ++i){
+                                IPCReactor* reactor = &IPCReactor::Default();
+                                if(!shared) reactor = reactors.emplace_back(std::make_unique<IPCReactor>()).get();
+                                controllers.emplace_back(std::make_unique<IPCController>(*reactor))
+                                    ->InitializeInbox(service_name + "_reactor" + std::to_string(GetCurrentProcessId()) + "_" + std::to_string(i));
+                            }
+                            memory[shared] = GetProcessPrivateBytes(GetCurrentProcess()) - memStart;
+
+                            double cpuStart = GetProcessCpuSeconds(GetCurrentProcess());
+                            Sleep(DWORD(seconds * 1000)); // idle with all controllers registered
+                            cpu[shared] = GetProcessCpuSeconds(GetCurrentProcess()) - cpuStart;
+                        }
+
+                        std::cout << count << (shared ? " controllers on the shared reactor:\n" : " controllers with a thread each:\n")
+                                  << " memory: " << memory[shared] / 1024 << " KiB (" << memory[shared] / count << " bytes each)\n"
+                                  << " idle cpu: " << cpu[shared] * 100.0 / seconds << "% of a core ("
+                                  << cpu[shared] * 1000000.0 / seconds / count << " us/s each)\n";
+                    }
+                    std::cout << " saving: " << std::fixed << std::setprecision(1)
+                              << (cpu[0] > 0 ? (1 - cpu[1] / cpu[0]) * 100 : 0) << "% of the idle cpu, "
+                              << (memory[0] > memory[1] ? (memory[0] - memory[1]) / 1024 : 0) << " KiB of memory\n";
+                    std::cout.unsetf(std::ios::floatfield);
+                }
+            }
+        },
+        { "debug_ipc_bench", [&](){
+                bool tcp = std::find(args.begin(), args.end(), "tcp") != args.end();
+                std::string mailbox = tcp ? "tcp://127.0.0.1:47100" : service_name + "_bench" + std::to_string(GetCurrentProcessId());
+                IPCController ipc(mailbox, mailbox); // loopback through a single endpoint
+
+                std::cout << "Benchmarking " << (tcp ? "tcp" : "mailslot") << " transport...\n";
+
+                if(!ipc.IsValidInbox()){ // a tcp outbox is still connecting, WaitForPeer below covers it
+                    std::cout << "IPC failed to initialize: " << ipc.LastError() << "\n";
+                    return;
+                }
+
+                // CRC32C throughput on its own, then the transport with and without it
+                {
+                    std::string block(4096, 'X');
+                    const size_t count = 250000;
+                    uint32_t crc = 0;
+                    Clock timer;
+                    for(size_t i=0; i < count; ++i) crc = Crc32c(block.data(), block.size(), crc);
+                    std::cout << "crc32c: " << double(block.size()) * count / timer.getSeconds() / 1e9 << " GB/s (" << crc << ")\n";
+                }
+
+                if(!ipc.WaitForPeer(1000)){ // loopback data is only framed once our own HELLO has arrived
+                    std::cout << "IPC handshake failed: " << ipc.LastError() << "\n";
+                    return;
+                }
+                std::cout << "codec: " << (ipc.Codec() == IPC_CODEC_COMPRESSED ? "compressed" : "plain") << "\n";
+
+                for(bool checksum : {false, true})
+                for(size_t size : {64, 424, 4096}){
+                    const size_t count = 100000;
+                    std::string payload(size, 'X'), msg;
+                    ipc.SetChecksum(checksum);
+
+                    size_t calls = ipc.Stats().read_calls + ipc.Stats().write_calls;
+                    size_t wakeups = ipc.Stats().wakeups;
+                    Clock timer;
+
+                    size_t received = 0;
+                    for(size_t i=0; i < count; ++i){
+                        ipc.Send(payload);
+                        while(ipc.Receive(msg)) ++received;
+                    }
+                    while(received < count && timer.getSeconds() < 30){
+                        if(ipc.Receive(msg)) ++received; else Sleep(0);
+                    }
+
+                    double seconds = timer.getSeconds();
+                    calls = ipc.Stats().read_calls + ipc.Stats().write_calls - calls;
+                    wakeups = ipc.Stats().wakeups - wakeups;
+
+                    std::cout << size << " byte messages" << (checksum ? " with crc32c" : "") << ": " << received << "/" << count << " in " << seconds << "s\n"
+                              << " " << received / seconds << " msg/s, " << received * size / seconds / 1048576.0 << " MiB/s\n"
+                              << " " << double(calls) / count << " syscalls/msg, " << double(count) / std::max<size_t>(wakeups, 1) << " msg/wakeup\n";
+                }
+                std::cout << "checksum errors: " << ipc.Stats().checksum_errors << "\n";
+            }
+        },
+        { "debug_ipc_latency", [&](){
+                bool tcp = std::find(args.begin(), args.end(), "tcp") != args.end();
+                std::string mailbox = service_name + "_latency" + std::to_string(GetCurrentProcessId());
+                std::string address_a = tcp ? "tcp://127.0.0.1:47101" : mailbox + "_a";
+                std::string address_b = tcp ? "tcp://127.0.0.1:47102" : mailbox + "_b";
+
+                std::cout << "Measuring " << (tcp ? "tcp" : "mailslot") << " round trips...\n";
+
+                auto measure = [&](IPCReactor& reactor, DWORD spin){
+                    IPCController ping(address_a, address_b, reactor);
+                    IPCController pong(address_b, address_a, reactor);
+                    ping.SetSpinBudget(spin);
+                    pong.SetSpinBudget(spin);
+
+                    std::atomic_bool echoing = true;
+                    std::thread echo([&](){
+                        std::string msg;
+                        while(echoing){
+                            if(pong.WaitReceive(msg, 100)) pong.Send(msg);
+                        }
+                    });
+
+                    const size_t count = 2000;
+                    std::vector<double> rtt;
+                    std::string msg;
+                    for(size_t i=0; i < count; ++i){
+                        auto start = std::chrono::steady_clock::now();
+                        ping.Send("ping");
+                        if(!ping.WaitReceive(msg, 1000)) continue;
+                        rtt.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+                    }
+                    echoing = false;
+                    echo.join();
+
+                    std::sort(rtt.begin(), rtt.end());
+                    auto pct = [&](double p){ return rtt.empty() ? 0.0 : rtt[size_t(p * (rtt.size() - 1))]; };
+                    size_t hits = ping.Stats().spin_hits + pong.Stats().spin_hits;
+                    size_t spins = hits + ping.Stats().spin_misses + pong.Stats().spin_misses;
+
+                    std::cout << " round trips: " << rtt.size() << "/" << count
+                              << "  p50 " << pct(0.5) << "us  p99 " << pct(0.99) << "us  max " << pct(1.0) << "us\n"
+                              << " receiver spin hit rate: " << (spins ? 100.0 * hits / spins : 0.0) << "%\n"
+                              << " reactor spin hit rate: " << (reactor.SpinHits() + reactor.SpinMisses() ? 100.0 * reactor.SpinHits() / (reactor.SpinHits() + reactor.SpinMisses()) : 0.0) << "%\n";
+                };
+
+                std::cout << "Blocking reactor:\n";
+                {
+                    IPCReactor reactor;
+                    measure(reactor, 0);
+                }
+
+                std::cout << "Busy-poll reactor (1ms spin budget, pinned to cpu 1):\n";
+                {
+                    IPCReactor reactor(25, 1000, DWORD_PTR(1) << 1);
+                    measure(reactor, 1000);
+                }
+            }
+        },
+        { "debug_ipc_ratelimit", [&](){
+                IPCThrottleAction action = IPC_THROTTLE_DROP;
+                if(std::find(args.begin(), args.end(), "defer") != args.end()) action = IPC_THROTTLE_DEFER;
+                if(std::find(args.begin(), args.end(), "flag") != args.end()) action = IPC_THROTTLE_FLAG;
+
+                std::string mailbox = service_name + "_ratelimit" + std::to_string(GetCurrentProcessId());
+
+                std::cout << "Measuring a quiet client's latency next to a noisy one...\n";
+
+                auto measure = [&](const IPCRateLimit& limit){
+                    IPCController service, noisy, quiet;
+                    service.SetRateLimit(limit);
+                    service.InitializeInbox(mailbox);
+
+                    noisy.SetSenderId(1);
+                    quiet.SetSenderId(2);
+                    noisy.InitializeOutbox(mailbox);
+                    quiet.InitializeOutbox(mailbox);
+
+                    std::atomic_bool running = true;
+                    std::thread flood([&](){
+                        std::string payload(64, 'N');
+                        while(running){
+                            for(int i=0; i < 100; ++i) noisy.Send(payload); // ~100k msg/s
+                            Sleep(1);
+                        }
+                    });
+                    std::thread steady([&](){
+                        while(running){ // 200 msg/s stamped with the send time
+                            quiet.Send(std::to_string(std::chrono::steady_clock::now().time_since_epoch().count()));
+                            Sleep(5);
+                        }
+                    });
+
+                    // The service spends 20us on every message, far less than the flood needs.
+                    std::vector<double> latency;
+                    size_t noisy_received = 0;
+                    std::string msg;
+                    IPCMessageInfo info;
+                    Clock timer;
+                    while(timer.getSeconds() < 3){
+                        if(!service.Receive(msg, info)){
+                            Sleep(0);
+                            continue;
+                        }
+                        auto work = std::chrono::steady_clock::now() + std::chrono::microseconds(20);
+                        while(std::chrono::steady_clock::now() < work) YieldProcessor();
+
+                        if(info.sender == 2){
+                            auto sent = std::chrono::steady_clock::time_point(std::chrono::steady_clock::duration(std::stoll(msg)));
+                            latency.push_back(std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - sent).count());
+                        } else {
+                            ++noisy_received;
+                        }
+                    }
+                    running = false;
+                    flood.join();
+                    steady.join();
+
+                    std::sort(latency.begin(), latency.end());
+                    auto pct = [&](double p){ return latency.empty() ? 0.0 : latency[size_t(p * (latency.size() - 1))]; };
+                    const IPCStats& stats = service.Stats();
+
+                    std::cout << " quiet messages: " << latency.size()
+                              << "  p50 " << pct(0.5) << "ms  p99 " << pct(0.99) << "ms  max " << pct(1.0) << "ms\n"
+                              << " noisy messages handled: " << noisy_received
+                              << "  dropped " << stats.throttled_dropped << "  deferred " << stats.throttled_deferred
+                              << "  flagged " << stats.throttled_flagged << "\n";
+                };
+
+                std::cout << "Unlimited:\n";
+                measure({});
+
+                IPCRateLimit limit;
+                limit.messages_per_second = 1000;
+                limit.bytes_per_second = 1024 * 1024;
+                limit.action = action;
+                std::cout << "Limited to 1000 msg/s per sender ("
+                          << (action == IPC_THROTTLE_DROP ? "drop" : action == IPC_THROTTLE_DEFER ? "defer" : "flag") << "):\n";
+                measure(limit);
+            }
+        },
+        { "debug_tokenize", [&](){
+                std::cout << "Comparing the field splitter against the per-character loop...\n";
+
+                for(size_t size : {64, 424, 4096}){
+                    std::string msg;
+                    for(size_t i=0; msg.size() < size; ++i){ // fields of 4 to 19 characters
+                        if(i) msg += ';';
+                        msg += std::string(4 + (i * 7) % 16, char('a' + i % 26));
+                    }
+                    msg.resize(size);
+
+                    const size_t count = 4000000 / size * 64;
+                    size_t fields = 0;
+
+                    Clock timer;
+                    for(size_t n=0; n < count; ++n){
+                        std::vector<std::string> parts;
+                        std::string* next = &parts.emplace_back();
+                        for(char c : msg){
+                            if(c == ';'){
+                                next = &parts.emplace_back();
+                                continue;
+                            }
+                            (*next) += c;
+                        }
+                        fields += parts.size();
+                    }
+                    double loop = timer.getSeconds();
+
+                    std::vector<std::string_view> views;
+                    timer.restart();
+                    for(size_t n=0; n < count; ++n){
+                        fields -= SplitFields(msg, ';', views);
+                    }
+                    double split = timer.getSeconds();
+
+                    double gigabytes = double(size) * count / 1e9;
+                    std::cout << size << " byte messages (" << views.size() << " fields)" << (fields ? " MISMATCH" : "") << ":\n"
+                              << " character loop: " << gigabytes / loop << " GB/s\n"
+                              << " SplitFields:    " << gigabytes / split << " GB/s (" << loop / split << "x)\n";
+                }
+            }
+        },
+        { "debug_ipc_replay", [&](){
+                // debug_ipc_replay <capture file> <inbox address> [speed, 0 = as fast as possible] [incoming]
+                auto at = std::find(args.begin(), args.end(), "debug_ipc_replay");
+                if(args.end() - at < 3){
+                    std::cout << "usage: debug_ipc_replay <capture file> <inbox address> [speed] [incoming]\n";
+                    return;
+                }
+                std::string path = at[1], address = at[2];
+                double speed = args.end() - at > 3 ? std::atof(at[3].c_str()) : 1.0;
+                IPCCaptureDirection direction = std::find(args.begin(), args.end(), "incoming") != args.end() ?
+                                                IPC_CAPTURE_INCOMING : IPC_CAPTURE_OUTGOING;
+
+                std::cout << "Replaying " << path << " to " << address << " at "
+                          << (speed > 0 ? std::to_string(speed) + "x" : std::string("full")) << " speed...\n";
+
+                IPCStats stats;
+                Clock timer;
+                bool success = ReplayCapture(path, address, speed, direction, stats);
+                double seconds = timer.getSeconds();
+
+                std::cout << (success ? "Replayed " : "Replay stopped after ") << stats.messages_sent << " messages, "
+                          << stats.bytes_sent << " bytes in " << seconds << "s ("
+                          << stats.messages_sent / std::max(seconds, 1e-9) << " msg/s)\n";
+                if(!success) std::cout << "error: " << GetLastError() << "\n";
+            }
+        },
+        { "debug_swarm", [&](){
+                // debug_swarm [children N] [rate msg/s per child] [mix small|large|mixed] [minutes M] [interval seconds]
+                size_t children = std::min<size_t>(size_t(GetOption(args, "children", 10)), 1000);
+                double rate = GetOption(args, "rate", 100);
+                double minutes = GetOption(args, "minutes", 1);
+                double interval = GetOption(args, "interval", 10);
+                std::string mix = "mixed";
+                for(const char* name : {"small", "large"}) if(std::find(args.begin(), args.end(), name) != args.end()) mix = name;
+
+                IPCController service;
+                if(!service.PublishInbox(swarm_mailbox)){
+                    std::cout << "IPC failed to initialize: " << service.LastError() << "\n";
+                    return;
+                }
+
+                std::string path(MAX_PATH, '\0');
+                path.resize(GetModuleFileName(NULL, path.data(), (DWORD)path.size()));
+
+                std::cout << "Spawning " << children << " children sending " << rate << " msg/s each (" << mix << " mix) for "
+                          << minutes << " minutes...\n";
+
+                std::vector<HANDLE> swarm;
+                for(size_t i=0; i < children; ++i){
+                    std::string cmd = "\"" + path + "\" swarm_child " + std::to_string(GetCurrentProcessId()) + " " +
+                                      std::to_string(rate) + " " + mix;
+                    STARTUPINFO si {};
+                    PROCESS_INFORMATION pi {};
+                    si.cb = sizeof(si);
+                    if(!CreateProcess(NULL, cmd.data(), NULL, NULL, FALSE, CREATE_NO_WINDOW, NULL, NULL, &si, &pi)){
+                        std::cout << " child " << i << " failed to start: " << GetLastError() << "\n";
+                        continue;
+                    }
+                    CloseHandle(pi.hThread);
+                    swarm.push_back(pi.hProcess);
+                }
+
+                std::ofstream csv("debug_swarm.csv");
+                csv << "seconds,children,msg_per_s,mib_per_s,p50_us,p99_us,p999_us,max_us,"
+                       "service_kib,service_handles,children_kib,children_handles,ipc_errors,dropped,checksum_errors,decode_errors,malformed\n";
+
+                size_t memStart = GetProcessPrivateBytes(GetCurrentProcess());
+                size_t messages = 0, bytes = 0, malformed = 0;
+                std::vector<double> latency;
+                std::vector<std::string_view> fields;
+                std::string msg;
+                Clock total, window;
+
+                auto report = [&](){
+                    double seconds = window.getSeconds();
+                    std::sort(latency.begin(), latency.end());
+                    auto pct = [&](double p){ return latency.empty() ? 0.0 : latency[size_t(p * (latency.size() - 1))]; };
+
+                    size_t alive = 0, childBytes = 0, childHandles = 0;
+                    for(HANDLE child : swarm){
+                        DWORD code = 0, handles = 0;
+                        if(GetExitCodeProcess(child, &code) && code == STILL_ACTIVE) ++alive;
+                        if(GetProcessHandleCount(child, &handles)) childHandles += handles;
+                        childBytes += GetProcessPrivateBytes(child);
+                    }
+                    DWORD handles = 0;
+                    GetProcessHandleCount(GetCurrentProcess(), &handles);
+                    long long memGrowth = (long long)GetProcessPrivateBytes(GetCurrentProcess()) - (long long)memStart;
+                    const IPCStats& stats = service.Stats();
+
+                    std::cout << int(total.getSeconds()) << "s  children " << alive << "/" << swarm.size()
+                              << "  " << int(messages / seconds) << " msg/s  " << bytes / seconds / 1048576.0 << " MiB/s"
+                              << "  latency p50 " << pct(0.5) << "us p99 " << pct(0.99) << "us p99.9 " << pct(0.999) << "us max " << pct(1.0) << "us\n"
+                              << "      service memory " << memGrowth / 1024 << " KiB growth, " << handles << " handles"
+                              << "  children " << childBytes / 1024 / std::max<size_t>(alive, 1) << " KiB, " << childHandles / std::max<size_t>(alive, 1) << " handles each"
+                              << "  errors " << service.ErrorCount() << " ipc, " << stats.checksum_errors + stats.decode_errors << " frame, " << malformed << " malformed\n";
+
+                    csv << total.getSeconds() << "," << alive << "," << messages / seconds << "," << bytes / seconds / 1048576.0 << ","
+                        << pct(0.5) << "," << pct(0.99) << "," << pct(0.999) << "," << pct(1.0) << ","
+                        << memGrowth / 1024 << "," << handles << "," << childBytes / 1024 << "," << childHandles << ","
+                        << service.ErrorCount() << "," << stats.throttled_dropped << "," << stats.checksum_errors << ","
+                        << stats.decode_errors << "," << malformed << std::endl;
+
+                    messages = bytes = 0;
+                    latency.clear();
+                    window.restart();
+                };
+
+                while(total.getSeconds() < minutes * 60){
+                    if(service.WaitReceive(msg, 100)){
+                        auto received = std::chrono::steady_clock::now().time_since_epoch().count();
+                        long long stamp = 0;
+
+                        if(SplitFields(msg, ';', fields) < 3 ||
+                           std::from_chars(fields[0].data(), fields[0].data() + fields[0].size(), stamp).ec != std::errc()){
+                            ++malformed;
+                        } else {
+                            latency.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::duration(received - stamp)).count());
+                        }
+                        ++messages;
+                        bytes += msg.size();
+                    }
+                    if(window.getSeconds() >= interval) report();
+                }
+                report();
+
+                for(HANDLE child : swarm){
+                    TerminateProcess(child, 0);
+                    CloseHandle(child);
+                }
+                std::cout << "Results written to debug_swarm.csv\n";
+            }
+        },
+        { "debug_scm", [&](){
+                // debug_scm [rounds N] - pause, continue and stop the service under an in-process SCM
+                size_t rounds = std::max<size_t>(size_t(GetOption(args, "rounds", 10)), 1);
+                std::map<DWORD, std::vector<double>> latency; // ms from injecting a control to the state it leads to
+                std::map<DWORD, std::vector<double>> handler; // ms until the control handler returned
+                const std::vector<std::pair<DWORD, DWORD>> steps {
+                    { SERVICE_CONTROL_PAUSE, SERVICE_PAUSED },
+                    { SERVICE_CONTROL_CONTINUE, SERVICE_RUNNING },
+                    { SERVICE_CONTROL_STOP, SERVICE_STOPPED },
+                };
+                auto ms = [](std::chrono::steady_clock::duration d){ return std::chrono::duration<double, std::milli>(d).count(); };
+
+                for(size_t round=0; round < rounds; ++round){
+                    CFakeServiceDispatcher scm;
+                    ServiceControlWrapper service(service_name.c_str());
+                    DWORD error = 0;
+                    auto started = std::chrono::steady_clock::now();
+                    std::thread dispatcher([&](){ CServiceBase::Run(service, error, scm); });
+
+                    if(!scm.WaitForDispatcher(5000) || !scm.WaitForState(service_name, SERVICE_RUNNING, 5000)){
+                        std::cout << "Service did not start\n";
+                        scm.Control(service_name, SERVICE_CONTROL_STOP);
+                        dispatcher.join();
+                        return;
+                    }
+                    latency[0].push_back(ms(std::chrono::steady_clock::now() - started));
+
+                    for(auto [control, state] : steps){
+                        auto issued = std::chrono::steady_clock::now();
+                        DWORD result = scm.Control(service_name, control);
+                        handler[control].push_back(ms(std::chrono::steady_clock::now() - issued));
+                        if(result != NO_ERROR){
+                            std::cout << "Control " << control << " failed: " << result << "\n";
+                            continue;
+                        }
+                        if(!scm.WaitForState(service_name, state, 10000)){
+                            std::cout << "Service did not reach state " << state << "\n";
+                            continue;
+                        }
+                        for(const CServiceTransition& t : scm.Transitions()){
+                            if(t.time >= issued && t.status.dwCurrentState == state){
+                                latency[control].push_back(ms(t.time - issued));
+                                break;
+                            }
+                        }
+                    }
+                    dispatcher.join();
+
+                    if(round == 0){
+                        std::cout << "Transitions of the first round:\n";
+                        for(const CServiceTransition& t : scm.Transitions()){
+                            std::cout << " " << std::fixed << std::setprecision(3) << ms(t.time - started) << "ms"
+                                      << " state " << t.status.dwCurrentState
+                                      << " checkpoint " << t.status.dwCheckPoint
+                                      << " wait hint " << t.status.dwWaitHint << "\n";
+                        }
+                    }
+                }
+
+                auto report = [](const char* title, std::map<DWORD, std::vector<double>>& table){
+                    std::cout << title;
+                    for(auto& [control, samples] : table){
+                        if(samples.empty()) continue;
+                        std::sort(samples.begin(), samples.end());
+                        const char* name = control == 0 ? "start" :
+                                           control == SERVICE_CONTROL_PAUSE ? "pause" :
+                                           control == SERVICE_CONTROL_CONTINUE ? "continue" : "stop";
+                        std::cout << " " << std::setw(8) << name << std::fixed << std::setprecision(3)
+                                  << " p50 " << samples[samples.size() / 2]
+                                  << " p99 " << samples[std::min(samples.size() - 1, samples.size() * 99 / 100)]
+                                  << " max " << samples.back() << "\n";
+                    }
+                };
+                report(("Control handler return over " + std::to_string(rounds) + " rounds (ms):\n").c_str(), handler);
+                report(("Control to state change over " + std::to_string(rounds) + " rounds (ms):\n").c_str(), latency);
+
+                // Controls arriving while one is still running are merged: the
+                // stop supersedes the queued pause and continue.
+                CFakeServiceDispatcher scm;
+                ServiceControlWrapper service(service_name.c_str());
+                DWORD error = 0;
+                std::thread dispatcher([&](){ CServiceBase::Run(service, error, scm); });
+                if(scm.WaitForDispatcher(5000) && scm.WaitForState(service_name, SERVICE_RUNNING, 5000)){
+                    for(DWORD control : { SERVICE_CONTROL_PAUSE, SERVICE_CONTROL_CONTINUE, SERVICE_CONTROL_PAUSE, SERVICE_CONTROL_STOP }){
+                        scm.Control(service_name, control);
+                    }
+                } else {
+                    scm.Control(service_name, SERVICE_CONTROL_STOP);
+                }
+                dispatcher.join();
+
+                std::cout << "Burst of pause, continue, pause, stop reported:";
+                for(const CServiceTransition& t : scm.Transitions()) std::cout << " " << t.status.dwCurrentState;
+                std::cout << "\n";
+            }
+        },
+        { "debug_startup", [&](){
+                // debug_startup [rounds N] - time from dispatch to SERVICE_RUNNING, serial OnStart vs startup graph
+                size_t rounds = std::max<size_t>(size_t(GetOption(args, "rounds", 5)), 1);
+                auto ms = [](std::chrono::steady_clock::duration d){ return std::chrono::duration<double, std::milli>(d).count(); };
+
+                for(bool parallel : { false, true }){
+                    std::vector<double> samples;
+                    std::vector<CServiceTransition> first;
+
+                    for(size_t round=0; round < rounds; ++round){
+                        CFakeServiceDispatcher scm;
+                        StartupBenchService service(service_name.c_str(), parallel);
+                        DWORD error = 0;
+                        auto started = std::chrono::steady_clock::now();
+                        std::thread dispatcher([&](){ CServiceBase::Run(service, error, scm); });
+
+                        if(scm.WaitForState(service_name, SERVICE_RUNNING, 10000)){
+                            for(const CServiceTransition& t : scm.Transitions()){
+                                if(t.status.dwCurrentState == SERVICE_RUNNING){
+                                    samples.push_back(ms(t.time - started));
+                                    break;
+                                }
+                            }
+                        } else {
+                            std::cout << "Service did not start\n";
+                        }
+                        scm.WaitForDispatcher(5000);
+                        scm.Control(service_name, SERVICE_CONTROL_STOP);
+                        dispatcher.join();
+
+                        if(round == 0){
+                            first = scm.Transitions();
+                            for(CServiceTransition& t : first) t.time = std::chrono::steady_clock::time_point(t.time - started);
+                        }
+                    }
+                    if(samples.empty()) continue;
+
+                    std::sort(samples.begin(), samples.end());
+                    std::cout << (parallel ? "Startup graph" : "Serial OnStart") << " over " << rounds << " rounds (ms):"
+                              << std::fixed << std::setprecision(3)
+                              << " min " << samples.front()
+                              << " p50 " << samples[samples.size() / 2]
+                              << " max " << samples.back() << "\n";
+                    for(const CServiceTransition& t : first){
+                        if(t.status.dwCurrentState != SERVICE_START_PENDING && t.status.dwCurrentState != SERVICE_RUNNING) continue;
+                        std::cout << " " << std::setw(9) << ms(t.time.time_since_epoch()) << "ms"
+                                  << " state " << t.status.dwCurrentState
+                                  << " checkpoint " << t.status.dwCheckPoint
+                                  << " wait hint " << t.status.dwWaitHint << "\n";
+                    }
+                }
+            }
+        },
+        { "debug_eventlog", [&](){
+                // debug_eventlog [messages N] [file] - per message event source vs batched writer, then an error storm
+                size_t messages = std::max<size_t>(size_t(GetOption(args, "messages", 10000)), 1);
+                bool file = std::find(args.begin(), args.end(), "file") != args.end();
+                auto backend = [&]() -> std::unique_ptr<CEventLogBackend> {
+                    if(file) return std::make_unique<CFileEventLogBackend>("debug_eventlog.log");
+                    return std::make_unique<CWindowsEventLogBackend>();
+                };
+                std::cout << "Logging " << messages << " messages to " << (file ? "debug_eventlog.log" : "the Application event log") << "\n";
+
+                // What WriteEventLogEntry used to do: open the source, write one entry, close it
+                Clock direct;
+                for(size_t i=0; i < messages; ++i){
+                    auto log = backend();
+                    if(!log->Open(service_name)){
+                        std::cout << "Could not open the backend: " << GetLastError() << "\n";
+                        return;
+                    }
+                    CEventLogEntry entry { EVENTLOG_INFORMATION_TYPE, {}, "Direct message " + std::to_string(i) };
+                    GetLocalTime(&entry.time);
+                    log->Write({ entry });
+                    log->Close();
+                }
+                double directMs = direct.getMilliseconds();
+
+                CEventLog log;
+                if(!log.Open(service_name, backend())){
+                    std::cout << "Could not open the backend: " << GetLastError() << "\n";
+                    return;
+                }
+                Clock batched;
+                for(size_t i=0; i < messages; ++i){
+                    log.Write(EVENTLOG_INFORMATION_TYPE, "Batched message " + std::to_string(i));
+                    if(i % (EVENTLOG_RING_SIZE / 2) == 0) Sleep(1); // let the writer keep up instead of measuring drops
+                }
+                double queuedMs = batched.getMilliseconds();
+                log.Close();
+                double batchedMs = batched.getMilliseconds();
+                const CEventLogStats& stats = log.Stats();
+
+                std::cout << std::fixed << std::setprecision(3)
+                          << " direct:  " << directMs << "ms, " << directMs * 1000 / messages << "us per message\n"
+                          << " batched: " << queuedMs * 1000 / messages << "us per message for the caller, "
+                          << batchedMs << "ms until written, " << stats.batches << " batches, "
+                          << stats.dropped << " dropped\n";
+
+                // The same error over and over from a tight loop
+                CEventLog storm;
+                storm.Open(service_name, backend());
+                Clock stormClock;
+                while(stormClock.getMilliseconds() < 2500){
+                    storm.Write(EVENTLOG_ERROR_TYPE, "IPC error 2: the system cannot find the file specified");
+                }
+                storm.Close();
+                std::cout << " storm:   " << storm.Stats().suppressed << " repeats suppressed, "
+                          << storm.Stats().logged << " entries written\n";
+            }
+        },
+        { "debug_logger", [&](){
+                // debug_logger [lines N] [threads T] - cout redirected to a file and flushed per line vs CLogger
+                size_t lines = std::max<size_t>(size_t(GetOption(args, "lines", 1000000)), 1);
+                size_t threads = std::max<size_t>(size_t(GetOption(args, "threads", 4)), 1);
+                std::cout << "Logging " << lines << " lines from " << threads << " threads\n";
+
+                auto percentile = [](std::vector<double>& ns, double p){
+                    std::sort(ns.begin(), ns.end());
+                    return ns.empty() ? 0.0 : ns[size_t(p * (ns.size() - 1))];
+                };
+                auto report = [&](const char* name, double ms, std::vector<double>& ns){
+                    std::cout << std::fixed << std::setprecision(0) << " " << name << lines / ms * 1000 << " lines/s, caller p50 "
+                              << percentile(ns, 0.5) << "ns p99 " << percentile(ns, 0.99) << "ns\n";
+                };
+                // Every thread times every 64th line and merges its samples in at the end
+                auto run = [&](std::function<void(size_t, size_t)> line){
+                    std::vector<double> ns;
+                    std::mutex mtx;
+                    std::vector<std::thread> workers;
+                    for(size_t t=0; t < threads; ++t){
+                        workers.emplace_back([&, t](){
+                            std::vector<double> samples;
+                            for(size_t i=t; i < lines; i += threads){
+                                auto start = std::chrono::steady_clock::now();
+                                line(t, i);
+                                if(i % 64 < threads) samples.push_back(std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count());
+                            }
+                            std::scoped_lock lock(mtx);
+                            ns.insert(ns.end(), samples.begin(), samples.end());
+                        });
+                    }
+                    for(std::thread& worker : workers) worker.join();
+                    return ns;
+                };
+
+                // What the service used to do: cout into the log file, flushed after each line
+                {
+                    std::ofstream file("debug_logger_cout.log", std::ios::trunc | std::ios::out);
+                    std::streambuf* orig_cout = std::cout.rdbuf(file.rdbuf());
+                    Clock clock;
+                    std::vector<double> ns = run([](size_t t, size_t i){
+                        std::cout << "line " << i << " from thread " << t << " took " << i * 0.25 << "ms\n";
+                        std::cout.flush();
+                    });
+                    double ms = clock.getMilliseconds();
+                    std::cout.rdbuf(orig_cout);
+                    report("cout:   ", ms, ns);
+                }
+
+                CLogger logger;
+                if(!logger.Open("debug_logger.log")){
+                    std::cout << "Could not open debug_logger.log: " << GetLastError() << "\n";
+                    return;
+                }
+                Clock clock;
+                std::vector<double> ns = run([&](size_t t, size_t i){
+                    logger.Info("line {} from thread {} took {}ms", i, t, i * 0.25);
+                });
+                double callerMs = clock.getMilliseconds();
+                logger.Close();
+                double ms = clock.getMilliseconds();
+                const CLoggerStats& stats = logger.Stats();
+
+                report("logger: ", ms, ns);
+                std::cout << std::setprecision(1) << "         " << callerMs << "ms for the callers, " << ms << "ms until written, "
+                          << stats.writes << " writes, " << stats.rotations << " rotations, " << stats.dropped << " dropped\n";
+            }
+        },
+        { "debug_flight", [&](){
+                // debug_flight [events N] - cost of a flight recorder event, then a service run dumped on stop
+                size_t events = std::max<size_t>(size_t(GetOption(args, "events", 1000000)), 1);
+                CFlightRecorder& recorder = CFlightRecorder::Default();
+                uint16_t source = recorder.Source("debug_flight");
+
+                for(size_t threads : { 1, 4 }){
+                    std::vector<std::thread> workers;
+                    Clock clock;
+                    for(size_t t=0; t < threads; ++t){
+                        workers.emplace_back([&](){
+                            for(size_t i=0; i < events; ++i) recorder.Record(FLIGHT_MARK, source, (uint32_t)i);
+                        });
+                    }
+                    for(std::thread& worker : workers) worker.join();
+                    std::cout << std::fixed << std::setprecision(1) << " " << threads << " thread" << (threads > 1 ? "s: " : ":  ")
+                              << clock.getMilliseconds() * 1e6 / events << "ns per event on each thread\n";
+                }
+
+                // A short service life under the in-process SCM, dumped by control code and on stop
+                CFakeServiceDispatcher scm;
+                ServiceControlWrapper service(service_name.c_str());
+                service.EnableFlightDump("debug_flight.dump", 200);
+                DWORD error = 0;
+                std::thread dispatcher([&](){ CServiceBase::Run(service, error, scm); });
+                if(!scm.WaitForDispatcher(5000) || !scm.WaitForState(service_name, SERVICE_RUNNING, 5000)){
+                    std::cout << "Service did not start\n";
+                }
+                const DWORD controls[] = { SERVICE_CONTROL_PAUSE, SERVICE_CONTROL_CONTINUE, 200, SERVICE_CONTROL_STOP };
+                for(DWORD control : controls){
+                    scm.Control(service_name, control);
+                    Sleep(50);
+                }
+                dispatcher.join();
+
+                std::cout << recorder.Recorded() << " events recorded, the last " << FLIGHT_RECORDER_SIZE
+                          << " are in debug_flight.dump, decode it with tools/flight_decode\n";
+            }
+        },
+        { "debug_trace", [&](){
+                // debug_trace [messages N] - one timeline of a service, its child and the messages between them
+                size_t messages = std::max<size_t>(size_t(GetOption(args, "messages", 100)), 1);
+                std::string path = std::filesystem::absolute("debug_trace.json").string();
+                DeleteFile(path.c_str()); // both processes append to it
+
+                CTracer& tracer = CTracer::Default();
+                if(!tracer.Start(path, "debug_trace")){
+                    std::cout << "Could not open " << path << ": " << GetLastError() << "\n";
+                    return;
+                }
+                tracer.NameThread("main");
+
+                IPCController ipc;
+                HANDLE child = NULL;
+                CFakeServiceDispatcher scm;
+                ServiceControlWrapper service(service_name.c_str(), {
+                    { "start", [&](){
+                            ipc.PublishInbox(trace_mailbox);
+
+                            std::string exe(MAX_PATH, '\0');
+                            exe.resize(GetModuleFileName(NULL, exe.data(), (DWORD)exe.size()));
+                            std::string cmd = "\"" + exe + "\" trace_child " + std::to_string(GetCurrentProcessId()) + " \"" + path + "\"";
+                            STARTUPINFO si {};
+                            PROCESS_INFORMATION pi {};
+                            si.cb = sizeof(si);
+                            if(!CreateProcess(NULL, cmd.data(), NULL, NULL, FALSE, CREATE_NO_WINDOW, NULL, NULL, &si, &pi)){
+                                std::cout << "Child failed to start: " << GetLastError() << "\n";
+                                return;
+                            }
+                            CloseHandle(pi.hThread);
+                            child = pi.hProcess;
+
+                            ipc.ConnectOutbox(trace_child_mailbox);
+                            if(!ipc.WaitForPeer(5000)) std::cout << "Child did not connect\n";
+                        }
+                    },
+                });
+
+                DWORD error = 0;
+                std::thread dispatcher([&](){ CServiceBase::Run(service, error, scm); });
+                if(!scm.WaitForDispatcher(5000) || !scm.WaitForState(service_name, SERVICE_RUNNING, 10000) || child == NULL){
+                    std::cout << "Service did not start\n";
+                }
+
+                std::vector<double> latency;
+                std::string msg;
+                for(size_t i=0; i < messages && child != NULL; ++i){
+                    CTraceSpan span("round trip", "example");
+                    Clock clock;
+                    ipc.Send("ping;" + std::to_string(i));
+                    if(!ipc.WaitReceive(msg, 1000)){
+                        std::cout << "No answer to message " << i << "\n";
+                        break;
+                    }
+                    latency.push_back(clock.getMilliseconds() * 1000);
+                }
+
+                scm.Control(service_name, SERVICE_CONTROL_PAUSE);
+                scm.Control(service_name, SERVICE_CONTROL_CONTINUE);
+                scm.Control(service_name, SERVICE_CONTROL_STOP);
+                dispatcher.join();
+
+                if(child != NULL){
+                    ipc.Send("exit");
+                    WaitForSingleObject(child, 5000);
+                    CloseHandle(child);
+                }
+                tracer.Stop();
+
+                std::sort(latency.begin(), latency.end());
+                if(!latency.empty()){
+                    std::cout << std::fixed << std::setprecision(1) << latency.size() << " round trips, p50 "
+                              << latency[latency.size() / 2] << "us, max " << latency.back() << "us\n";
+                }
+                std::cout << "Open " << path << " in ui.perfetto.dev or chrome://tracing\n";
+            }
+        },
+        { "debug_metrics", [&](){
+                // debug_metrics [ops N] [threads T] - cost of metric updates, alone and while being scraped
+                size_t ops = std::max<size_t>(size_t(GetOption(args, "ops", 10000000)), 1);
+                size_t threads = std::clamp<size_t>(size_t(GetOption(args, "threads", 4)), 1, 64);
+                CMetrics& metrics = CMetrics::Default();
+                CMetricCounter& counter = metrics.Counter("debug_metrics_ops_total", "Updates made by debug_metrics");
+                CMetricGauge& gauge = metrics.Gauge("debug_metrics_depth", "Gauge moved by debug_metrics");
+                CMetricHistogram& histogram = metrics.Histogram("debug_metrics_seconds", "Values observed by debug_metrics");
+
+                auto run = [&](const char* name, auto update){
+                    for(bool scraping : { false, true }){
+                        std::atomic_bool done {false};
+                        size_t scrapes = 0;
+                        double scrapeMs = 0;
+                        std::thread scraper;
+                        if(scraping){
+                            scraper = std::thread([&](){
+                                std::string text;
+                                while(!done){
+                                    Clock clock;
+                                    text.clear();
+                                    metrics.Format(text);
+                                    scrapeMs += clock.getMilliseconds();
+                                    scrapes++;
+                                }
+                            });
+                        }
+
+                        std::vector<std::thread> workers;
+                        Clock clock;
+                        for(size_t t=0; t < threads; ++t){
+                            workers.emplace_back([&, t](){
+                                for(size_t i=t; i < ops; i += threads) update(i);
+                            });
+                        }
+                        for(std::thread& worker : workers) worker.join();
+                        double ms = clock.getMilliseconds();
+                        done = true;
+                        if(scraper.joinable()) scraper.join();
+
+                        std::cout << std::fixed << std::setprecision(1) << " " << name << (scraping ? " while scraped: " : ":               ")
+                                  << ms * 1e6 / ops * threads << "ns per update on each of " << threads << " threads";
+                        if(scraping) std::cout << ", " << scrapes << " scrapes of " << scrapeMs / std::max<size_t>(scrapes, 1) << "ms";
+                        std::cout << "\n";
+                    }
+                };
+                run("counter.Add      ", [&](size_t){ counter.Add(); });
+                run("gauge.Add/Sub    ", [&](size_t i){ if(i & 1) gauge.Sub(); else gauge.Add(); });
+                run("histogram.Observe", [&](size_t i){ histogram.Observe((i & 1023) * 1e-5); });
+
+                if(metrics.WriteFile("debug_metrics.prom")) std::cout << "Scrape written to debug_metrics.prom\n";
+            }
+        },
+        { "debug_config", [&](){
+                // debug_config [reads N] [threads T] - cost of reading a reloadable config, and of a reload through PARAMCHANGE
+                size_t reads = std::max<size_t>(size_t(GetOption(args, "reads", 10000000)), 1);
+                size_t threads = std::clamp<size_t>(size_t(GetOption(args, "threads", 4)), 1, 64);
+                CServiceConfig<ExampleConfig> config(LoadExampleConfig, LoadExampleConfig());
+
+                const size_t reloads = 1000;
+                Clock reloadClock;
+                for(size_t i=0; i < reloads; ++i) config.Reload();
+                double reloadUs = reloadClock.getMilliseconds() * 1e3 / reloads;
+                auto prepared = std::make_shared<const ExampleConfig>();
+                Clock storeClock;
+                for(size_t i=0; i < reloads; ++i) config.Store(prepared);
+                std::cout << std::fixed << std::setprecision(2) << " Reload from the registry: " << reloadUs
+                          << "us, Store of a built config: " << storeClock.getMilliseconds() * 1e3 / reloads << "us\n";
+
+                // Readers against a writer swapping the config every millisecond
+                ExampleConfig plain;
+                std::mutex lock;
+                std::shared_ptr<const ExampleConfig> guarded = config.Load();
+                auto run = [&](const char* name, auto read){
+                    for(bool writing : { false, true }){
+                        std::atomic_bool done {false};
+                        size_t swaps = 0;
+                        std::thread writer;
+                        if(writing){
+                            writer = std::thread([&](){
+                                while(!done){
+                                    auto next = std::make_shared<const ExampleConfig>();
+                                    config.Store(next);
+                                    {
+                                        std::scoped_lock guard(lock);
+                                        guarded = next;
+                                    }
+                                    swaps++;
+                                    Sleep(1);
+                                }
+                            });
+                        }
+
+                        std::atomic<size_t> sink {0};
+                        std::vector<std::thread> workers;
+                        Clock clock;
+                        for(size_t t=0; t < threads; ++t){
+                            workers.emplace_back([&](){
+                                size_t sum = 0;
+                                for(size_t i=0; i < reads; ++i) sum += read();
+                                sink += sum;
+                            });
+                        }
+                        for(std::thread& worker : workers) worker.join();
+                        double ms = clock.getMilliseconds();
+                        done = true;
+                        if(writer.joinable()) writer.join();
+
+                        std::cout << std::fixed << std::setprecision(2) << " " << name << (writing ? " with reloads: " : ":              ")
+                                  << ms * 1e6 / reads << "ns per read on each of " << threads << " threads";
+                        if(writing) std::cout << ", " << swaps << " swaps";
+                        std::cout << "\n";
+                    }
+                };
+                run("plain struct     ", [&](){ return (size_t)plain.restartDelay; });
+                run("config.Get       ", [&](){ return (size_t)config.Get().restartDelay; });
+                run("mutex + copy     ", [&](){
+                    std::shared_ptr<const ExampleConfig> copy;
+                    {
+                        std::scoped_lock guard(lock);
+                        copy = guarded;
+                    }
+                    return (size_t)copy->restartDelay;
+                });
+
+                // PARAMCHANGE through the in-process SCM until a reader sees the new version
+                CFakeServiceDispatcher scm;
+                ServiceControlWrapper service(service_name.c_str(), {
+                        { "paramchange", [&](){ config.Reload(); } },
+                    },
+                    SERVICE_ACCEPT_PAUSE_CONTINUE | SERVICE_ACCEPT_STOP | SERVICE_ACCEPT_PARAMCHANGE
+                );
+                std::atomic_size_t userControls {0};
+                service.SetControlHandler(201, [&](DWORD, LPVOID) -> DWORD { userControls++; return NO_ERROR; });
+
+                DWORD error = 0;
+                std::thread dispatcher([&](){ CServiceBase::Run(service, error, scm); });
+                if(!scm.WaitForDispatcher(5000) || !scm.WaitForState(service_name, SERVICE_RUNNING, 5000)){
+                    std::cout << "Service did not start\n";
+                    scm.Control(service_name, SERVICE_CONTROL_STOP);
+                    dispatcher.join();
+                    return;
+                }
+
+                std::vector<double> visible, handled;
+                for(size_t round=0; round < 200; ++round){
+                    uint64_t version = config.Version();
+                    Clock clock;
+                    if(scm.Control(service_name, SERVICE_CONTROL_PARAMCHANGE) != NO_ERROR) break;
+                    handled.push_back(clock.getMilliseconds() * 1e3);
+                    while(config.Version() == version) std::this_thread::yield();
+                    visible.push_back(clock.getMilliseconds() * 1e3);
+                }
+                Clock userClock;
+                DWORD userResult = scm.Control(service_name, 201);
+                double userUs = userClock.getMilliseconds() * 1e3;
+                DWORD unknownResult = scm.Control(service_name, 202);
+
+                scm.Control(service_name, SERVICE_CONTROL_STOP);
+                dispatcher.join();
+
+                if(!visible.empty()){
+                    std::sort(visible.begin(), visible.end());
+                    std::sort(handled.begin(), handled.end());
+                    std::cout << std::fixed << std::setprecision(1) << " PARAMCHANGE over " << visible.size() << " rounds: handler returned p50 "
+                              << handled[handled.size() / 2] << "us, new config visible p50 " << visible[visible.size() / 2]
+                              << "us, max " << visible.back() << "us\n";
+                }
+                std::cout << " Control 201 returned " << userResult << " in " << userUs << "us (" << userControls
+                          << " handled), unregistered 202 returned " << unknownResult << "\n";
+            }
+        },
+        { "debug_preshutdown", [&](){
+                // debug_preshutdown [budget ms] [timeout ms] - drain steps under a fake system shutdown, then one that overruns
+                DWORD budget = DWORD(GetOption(args, "budget", 500));
+                DWORD timeout = DWORD(GetOption(args, "timeout", 1000));
+                auto ms = [](std::chrono::steady_clock::duration d){ return std::chrono::duration<double, std::milli>(d).count(); };
+
+                for(bool overrun : { false, true }){
+                    // Shared with the steps, since an abandoned one outlives this round
+                    struct Record {
+                        std::mutex lock;
+                        std::vector<std::pair<std::string, double>> finished; // step and ms since the preshutdown
+                        std::chrono::steady_clock::time_point issued;
+                    };
+                    auto record = std::make_shared<Record>();
+                    auto step = [record, ms](const char* name, DWORD duration, bool hang){
+                        return [record, ms, name, duration, hang](const CShutdownDrain::Deadline& deadline){
+                            // A hung step ignores its deadline; it is left running on the thread pool
+                            Sleep(hang ? duration : std::min(duration, deadline.Remaining()));
+                            std::scoped_lock guard(record->lock);
+                            record->finished.emplace_back(name, ms(std::chrono::steady_clock::now() - record->issued));
+                        };
+                    };
+
+                    CFakeServiceDispatcher scm;
+                    ServiceControlWrapper service(service_name.c_str(), {},
+                        SERVICE_ACCEPT_STOP | SERVICE_ACCEPT_SHUTDOWN | SERVICE_ACCEPT_PRESHUTDOWN);
+                    service.SetPreshutdownBudget(budget);
+                    service.SetHeartbeat(budget / 5);
+                    service.AddShutdownStep("checkpoint", step("checkpoint", 20, false), SHUTDOWN_CHECKPOINT);
+                    service.AddShutdownStep("flush ipc", step("flush ipc", 50, false), SHUTDOWN_FLUSH);
+                    service.AddShutdownStep("child", step("child", overrun ? budget * 4 : budget / 5, overrun), SHUTDOWN_CHILDREN);
+
+                    DWORD error = 0;
+                    std::thread dispatcher([&](){ CServiceBase::Run(service, error, scm); });
+                    if(!scm.WaitForDispatcher(5000) || !scm.WaitForState(service_name, SERVICE_RUNNING, 5000)){
+                        std::cout << "Service did not start\n";
+                        scm.Control(service_name, SERVICE_CONTROL_STOP);
+                        dispatcher.join();
+                        return;
+                    }
+
+                    scm.ClearTransitions();
+                    auto issued = record->issued = std::chrono::steady_clock::now();
+                    bool stopped = scm.Shutdown(timeout);
+                    double returned = ms(std::chrono::steady_clock::now() - issued);
+                    dispatcher.join();
+
+                    std::cout << (overrun ? "Child step hanging" : "Every step in time") << ", budget " << budget << "ms, preshutdown timeout "
+                              << timeout << "ms: " << (stopped ? "stopped in time" : "NOT stopped in time")
+                              << ", Shutdown returned after " << std::fixed << std::setprecision(1) << returned << "ms\n";
+                    for(const CServiceTransition& t : scm.Transitions()){
+                        std::cout << " " << std::setw(7) << ms(t.time - issued) << "ms state " << t.status.dwCurrentState
+                                  << " checkpoint " << t.status.dwCheckPoint << " wait hint " << t.status.dwWaitHint << "\n";
+                    }
+                    std::scoped_lock guard(record->lock);
+                    std::cout << " Steps finished:";
+                    for(auto& [name, at] : record->finished) std::cout << " " << name << " at " << at << "ms";
+                    std::cout << "\n";
+                }
+            }
+        },
+        { "debug_idle", [&](){
+                // debug_idle [seconds S] [period ms] [slack ms] - wakeups and CPU of an idle worker, 5ms polling vs an update timer and triggers
+                double seconds = std::max(GetOption(args, "seconds", 3), 0.5);
+                DWORD period = DWORD(GetOption(args, "period", 1000));
+                DWORD slack = DWORD(GetOption(args, "slack", 250));
+                const size_t arrivals = 200;
+                auto ms = [](std::chrono::steady_clock::duration d){ return std::chrono::duration<double, std::milli>(d).count(); };
+
+                for(bool polling : { true, false }){
+                    // Work arrives by stamping the time; the update callback picks it up
+                    std::mutex lock;
+                    std::condition_variable picked;
+                    std::chrono::steady_clock::time_point arrived {};
+                    std::vector<double> latency;
+                    std::atomic_uint64_t updates {0};
+
+                    CFakeServiceDispatcher scm;
+                    ServiceControlWrapper service(service_name.c_str(), {
+                        { "update", [&](){
+                                updates++;
+                                std::scoped_lock guard(lock);
+                                if(arrived == std::chrono::steady_clock::time_point{}) return;
+                                latency.push_back(ms(std::chrono::steady_clock::now() - arrived));
+                                arrived = {};
+                                picked.notify_all();
+                            }
+                        },
+                    });
+                    if(polling) service.SetUpdateTimer(5);
+                    else service.SetUpdateTimer(period, slack);
+
+                    DWORD error = 0;
+                    std::thread dispatcher([&](){ CServiceBase::Run(service, error, scm); });
+                    if(!scm.WaitForDispatcher(5000) || !scm.WaitForState(service_name, SERVICE_RUNNING, 5000)){
+                        std::cout << "Service did not start\n";
+                        scm.Control(service_name, SERVICE_CONTROL_STOP);
+                        dispatcher.join();
+                        return;
+                    }
+
+                    auto idle = [&](const char* state){
+                        CEventLoop::Stats before = service.EventLoop().GetStats();
+                        uint64_t calls = updates;
+                        double cpu = GetProcessCpuSeconds(GetCurrentProcess());
+                        Sleep(DWORD(seconds * 1000));
+                        double used = GetProcessCpuSeconds(GetCurrentProcess()) - cpu;
+                        CEventLoop::Stats after = service.EventLoop().GetStats();
+                        std::cout << "  " << std::setw(7) << state << std::fixed << std::setprecision(1)
+                                  << ": " << (after.wakeups - before.wakeups) / seconds << " wakeups/s, "
+                                  << (updates - calls) / seconds << " updates/s, CPU " << std::setprecision(3)
+                                  << used * 100 / seconds << "% of a core\n";
+                    };
+
+                    if(polling) std::cout << "Update every 5ms, as the worker used to poll:\n";
+                    else std::cout << "Update timer every " << period << "ms with " << slack << "ms slack, triggered when work arrives:\n";
+                    idle("running");
+
+                    // Polling notices work on its next update; otherwise the arrival triggers one
+                    for(size_t i=0; i < arrivals; ++i){
+                        std::unique_lock guard(lock);
+                        arrived = std::chrono::steady_clock::now();
+                        if(!polling) service.TriggerUpdate();
+                        picked.wait_for(guard, std::chrono::milliseconds(period * 2 + 100), [&](){ return arrived == std::chrono::steady_clock::time_point{}; });
+                        arrived = {};
+                        guard.unlock();
+                        Sleep(1 + i % 7); // spread arrivals over the polling period
+                    }
+                    {
+                        std::scoped_lock guard(lock);
+                        std::sort(latency.begin(), latency.end());
+                        if(!latency.empty()){
+                            std::cout << "  arrival to update over " << latency.size() << " arrivals (ms): " << std::fixed << std::setprecision(3)
+                                      << "p50 " << latency[latency.size() / 2]
+                                      << " p99 " << latency[std::min(latency.size() - 1, latency.size() * 99 / 100)]
+                                      << " max " << latency.back() << "\n";
+                        }
+                    }
+
+                    if(scm.Control(service_name, SERVICE_CONTROL_PAUSE) == NO_ERROR && scm.WaitForState(service_name, SERVICE_PAUSED, 5000)){
+                        idle("paused");
+                    }
+                    scm.Control(service_name, SERVICE_CONTROL_STOP);
+                    dispatcher.join();
+                }
+            }
+        },
+        { "debug_pause", [&](){
+                // debug_pause [rounds N] - pause and continue acknowledgement under an in-process SCM, idle, busy and stuck
+                size_t rounds = std::max<size_t>(size_t(GetOption(args, "rounds", 200)), 1);
+                auto us = [](std::chrono::steady_clock::duration d){ return std::chrono::duration<double, std::micro>(d).count(); };
+                auto percentiles = [](std::vector<double>& samples){
+                    std::sort(samples.begin(), samples.end());
+                    std::stringstream text;
+                    text << std::fixed << std::setprecision(1) << "p50 " << samples[samples.size() / 2]
+                         << " p99 " << samples[std::min(samples.size() - 1, samples.size() * 99 / 100)] << " max " << samples.back();
+                    return text.str();
+                };
+
+                // The update callback sleeps for busy ms when triggered, as a worker in the middle of its work
+                std::atomic<DWORD> busy {0};
+                CFakeServiceDispatcher scm;
+                ServiceControlWrapper service(service_name.c_str(), {
+                    { "update", [&](){ if(DWORD ms = busy.exchange(0)) Sleep(ms); } },
+                });
+                service.SetUpdateTimer(0);
+
+                DWORD error = 0;
+                std::thread dispatcher([&](){ CServiceBase::Run(service, error, scm); });
+                if(!scm.WaitForDispatcher(5000) || !scm.WaitForState(service_name, SERVICE_RUNNING, 5000)){
+                    std::cout << "Service did not start\n";
+                    scm.Control(service_name, SERVICE_CONTROL_STOP);
+                    dispatcher.join();
+                    return;
+                }
+
+                // Control issued to the state it leads to, and the CPU the process spent meanwhile
+                auto control = [&](DWORD code, DWORD state, double& cpu) -> double {
+                    scm.ClearTransitions();
+                    double start = GetProcessCpuSeconds(GetCurrentProcess());
+                    auto issued = std::chrono::steady_clock::now();
+                    scm.Control(service_name, code);
+                    scm.WaitForState(service_name, state, 10000);
+                    cpu = GetProcessCpuSeconds(GetCurrentProcess()) - start;
+                    for(const CServiceTransition& t : scm.Transitions()){
+                        if(t.status.dwCurrentState == state) return us(t.time - issued);
+                    }
+                    return -1;
+                };
+
+                std::vector<double> paused, resumed;
+                double cpu, cpuTotal = 0;
+                for(size_t i=0; i < rounds; ++i){
+                    paused.push_back(control(SERVICE_CONTROL_PAUSE, SERVICE_PAUSED, cpu));
+                    cpuTotal += cpu;
+                    resumed.push_back(control(SERVICE_CONTROL_CONTINUE, SERVICE_RUNNING, cpu));
+                    cpuTotal += cpu;
+                }
+                std::cout << "Idle worker over " << rounds << " rounds (us):\n"
+                          << "  pause    " << percentiles(paused) << "\n"
+                          << "  continue " << percentiles(resumed) << "\n"
+                          << "  CPU " << std::fixed << std::setprecision(3) << cpuTotal * 1000 / (rounds * 2) << "ms per control\n";
+
+                // A pause waits for the update in progress, without spinning
+                busy = 300;
+                service.TriggerUpdate();
+                Sleep(50);
+                double waited = control(SERVICE_CONTROL_PAUSE, SERVICE_PAUSED, cpu);
+                std::cout << "Worker busy for 300ms: paused after " << std::setprecision(1) << waited / 1000
+                          << "ms using " << std::setprecision(3) << cpu * 1000 << "ms of CPU\n";
+                control(SERVICE_CONTROL_CONTINUE, SERVICE_RUNNING, cpu);
+
+                // A worker stuck past the timeout fails the pause; it is still running once it gets free
+                service.SetPauseTimeout(500);
+                busy = 1500;
+                service.TriggerUpdate();
+                Sleep(50);
+                scm.ClearTransitions();
+                auto issued = std::chrono::steady_clock::now();
+                scm.Control(service_name, SERVICE_CONTROL_PAUSE);
+                scm.WaitForState(service_name, SERVICE_PAUSE_PENDING, 5000);
+                scm.WaitForState(service_name, SERVICE_RUNNING, 5000);
+                double failed = us(std::chrono::steady_clock::now() - issued) / 1000;
+                Sleep(1600);
+                std::cout << "Worker stuck for 1500ms, timeout 500ms: pause given up after "
+                          << std::setprecision(1) << failed << "ms, reported states:";
+                for(const CServiceTransition& t : scm.Transitions()) std::cout << " " << t.status.dwCurrentState;
+                std::cout << ", worker " << (service.EventLoop().Held() ? "paused" : "running") << " once free\n";
+
+                scm.Control(service_name, SERVICE_CONTROL_STOP);
+                dispatcher.join();
+            }
+        },
         { "debug_samem", [&](){
                 std::cout << "Debug Security Attributes memory leak...\n";
                 Sleep(3000);
@@ -487,6 +1868,14 @@ int main(int argc, char *argv[]) {
                 ChildProcess(args);
             }
         },
+        { "swarm_child", [&](){
+                SwarmChildProcess(args);
+            }
+        },
+        { "trace_child", [&](){
+                TraceChildProcess(args);
+            }
+        },
     };
 
     if(args.size()){
@@ -507,51 +1896,82 @@ int main(int argc, char *argv[]) {
 
         IPCController ipc;
 
+        std::string path(getenv("SystemDrive"));
+        path += "\\example_service.log";
+
+        CLogger logger;
+        logger.Open(path);
+
+        // Control code 200 (sc control libwinservice_example 200) dumps the flight recorder
+        std::string dumpPath(getenv("SystemDrive"));
+        dumpPath += "\\example_service.flight";
+
+        // Metrics are written to example_service.prom every 10 seconds, for a
+        // textfile collector, and served on the loopback port in LIBWINSERVICE_METRICS_PORT
+        std::string metricsPath(getenv("SystemDrive"));
+        metricsPath += "\\example_service.prom";
+        CMetrics& metrics = CMetrics::Default();
+        CMetricCounter& childRestarts = metrics.Counter("example_child_restarts_total", "Child processes started again after exiting");
+        metrics.StartFileExport(metricsPath, 10000);
+        if(const char* port = getenv("LIBWINSERVICE_METRICS_PORT")) metrics.StartServer((unsigned short)std::atoi(port));
+
+        // Set LIBWINSERVICE_TRACE to a file to trace the service and its child into one timeline
+        if(const char* trace = getenv("LIBWINSERVICE_TRACE")){
+            tracePath = trace;
+            if(!CTracer::Default().Start(tracePath, service_name)) tracePath.clear();
+        }
+
+        // Settings from the Parameters key, reloaded without a restart on a parameter change
+        CServiceConfig<ExampleConfig> config(LoadExampleConfig, LoadExampleConfig());
+
+        // Set once the system is about to shut down, so the child is not started again
+        std::atomic_bool draining {false};
+
+        // SpawnProcess and friends still print to cout; their lines go to the log as well
+        LoggerStreamBuf logStream(logger);
+        std::streambuf* orig_cout = std::cout.rdbuf(&logStream);
+
         ServiceControlWrapper service(service_name.c_str(),
             {
                   { "start", [&](){
-                        PrintTime();
-                        std::cout << "Service started\n";
-                        service_mailbox += std::to_string(GetCurrentProcessId());
-
-                        while(!ipc.InitializeInbox(service_mailbox)){
-                            std::cout << "IPC Failed to initialize! Retrying...\n";
+                        logger.Info("Service started");
+                        while(!ipc.PublishInbox(service_mailbox)){
+                            logger.Warning("IPC Failed to initialize! Retrying...");
                             Sleep(3000);
                         }
 
                         SpawnProcess();
-                        Sleep(500);
                         if(CheckProcess()){
-                            ipc.InitializeOutbox(process_mailbox + std::to_string(childPID));
-                            Sleep(300);
+                            // the reactor keeps looking the child up until it has published its inbox
+                            ipc.ConnectOutbox(process_mailbox);
+                            if(!ipc.WaitForPeer(5000)) logger.Warning("Child process did not connect");
                         }
-                        ipc.Send("Service Started");
+                        ipc.Send(config.Get().greeting);
                     }
-                },{ "update", [&](){
-                        if(!CheckProcess()){
+                },{ "update", [&](){ // every second, and whenever a message arrives
+                        if(!draining && !CheckProcess()){
                             childProcess = NULL;
                             childPID = 0;
-                            Sleep(2000); // deep sleep
+                            Sleep(config.Get().restartDelay); // deep sleep
 
                             SpawnProcess();
-                            Sleep(1000);
+                            childRestarts.Add();
                             if(CheckProcess()){
-                                ipc.InitializeOutbox(process_mailbox + std::to_string(childPID));
+                                ipc.WaitForPeer(5000); // the outbox follows the restarted child by name
                             }
                         }
                         std::string msg;
-                        if(ipc.Receive(msg)){
-                            std::cout << "message: " << msg << "\n";
+                        while(ipc.Receive(msg)){
+                            logger.Info("message: {}", msg);
                         }
-
-                        std::cout.flush(); // flush data
                     }
                 },{ "stopped", [&](){
-                        ipc.Send("Service Stopped");
-                        Sleep(1500);
+                        if(!draining){ // the child has already been told to exit
+                            ipc.Send("Service Stopped");
+                            ipc.Flush(1500);
+                        }
 
-                        PrintTime();
-                        std::cout << "Service stopping...\n";
+                        logger.Info("Service stopping...");
 
                         ipc.Reset();
                         CloseProcess();
@@ -563,24 +1983,61 @@ int main(int argc, char *argv[]) {
                         ipc.Send("Service Resumed");
                     }
                 },{ "shutdown", [&](){
+                        draining = true;
                         ipc.Send("System Shutdown Detected");
                     }
+                },{ "paramchange", [&](){
+                        if(config.Reload()) logger.Info("Configuration reloaded, restart delay {}ms", config.Get().restartDelay);
+                        else logger.Warning("Configuration reload failed: {}", GetLastError());
+                    }
                 },
             },
-            SERVICE_ACCEPT_PAUSE_CONTINUE | SERVICE_ACCEPT_STOP | SERVICE_ACCEPT_SHUTDOWN
+            SERVICE_ACCEPT_PAUSE_CONTINUE | SERVICE_ACCEPT_STOP | SERVICE_ACCEPT_SHUTDOWN |
+            SERVICE_ACCEPT_PARAMCHANGE | SERVICE_ACCEPT_PRESHUTDOWN
         );
-
-        std::streambuf* orig_cout = std::cout.rdbuf();
-        std::string path(getenv("SystemDrive"));
-        path += "\\example_service.log";
-
-        std::ofstream log(path, std::ios::app | std::ios::out);
-        std::cout.rdbuf(log.rdbuf());
+        service.EnableFlightDump(dumpPath, 200);
+
+        // The worker sleeps until a message arrives, checking on the child
+        // once a second; the check may run late to share a wakeup
+        service.SetUpdateTimer(1000, 250);
+        ipc.SetReceiveNotify([&](){ service.TriggerUpdate(); });
+
+        // Before a system shutdown: deliver what is queued, let the child exit,
+        // stop the worker (declared by the wrapper) and save state, leaving the
+        // SCM two seconds of its timeout to spare
+        service.SetPreshutdownBudget(service_preshutdown_timeout - 2000);
+        service.AddShutdownStep("flush ipc", [&](const CShutdownDrain::Deadline& deadline){
+            if(!ipc.Flush(deadline.Remaining())) throw DWORD(ERROR_TIMEOUT);
+        }, SHUTDOWN_FLUSH);
+        service.AddShutdownStep("child", [&](const CShutdownDrain::Deadline& deadline){
+            if(!CheckProcess()) return;
+            ipc.Send("exit");
+            ipc.Flush(deadline.Remaining());
+            if(WaitForSingleObject(childProcess, deadline.Remaining()) != WAIT_OBJECT_0){
+                CloseProcess();
+                throw DWORD(ERROR_TIMEOUT);
+            }
+        }, SHUTDOWN_CHILDREN);
+        service.AddShutdownStep("checkpoint", [&](const CShutdownDrain::Deadline&){
+            metrics.WriteFile(metricsPath);
+            logger.Flush();
+        }, SHUTDOWN_CHECKPOINT);
+
+        // Control code 201 logs what the service is running with
+        service.SetControlHandler(201, [&](DWORD, LPVOID) -> DWORD {
+            logger.Info("Child pid {}, restart delay {}ms, greeting \"{}\"", childPID, config.Get().restartDelay, config.Get().greeting);
+            return NO_ERROR;
+        });
 
         DWORD errorCode;
-        if (!CServiceBase::Run(service, errorCode)){
-            std::cout.rdbuf(orig_cout); // put cout back
-
+        bool ran = CServiceBase::Run(service, errorCode);
+        ipc.SetReceiveNotify(nullptr); // the reactor outlives the service
+        std::cout.rdbuf(orig_cout); // put cout back
+        logger.Close();
+        CTracer::Default().Stop();
+        metrics.StopExport();
+
+        if (!ran){
             std::cout << "Parameters:\n"
                       << " install  to install the service.\n"
                       << " remove   to remove the service.\n"
@@ -3,9 +3,10 @@
 
 ServiceControlWrapper::ServiceControlWrapper(const char* pszServiceName, const ServiceCallbackList& callbacks, DWORD dwControl) : CServiceBase(pszServiceName, dwControl)
 {
-    m_fStopping = false;
     m_fPaused = false;
-    m_fSignal = false;
+    m_pauseRequests = 0;
+    m_pauseAcknowledged = 0;
+    m_fWorking = false;
 
     // Link the callback functions to their respective titles from the past callback list
     //  This will automatically default initialize missing callbacks to valid empty functions
@@ -15,9 +16,14 @@ ServiceControlWrapper::ServiceControlWrapper(const char* pszServiceName, const S
     RegisterCallback(callbacks, "paused", callback_paused);
     RegisterCallback(callbacks, "continue", callback_continue);
     RegisterCallback(callbacks, "shutdown", callback_shutdown);
+    RegisterCallback(callbacks, "paramchange", callback_paramchange);
 
-    pauseTimeout = 2000; // 2000ms paused delay
-    updateTimeout = 5; // 5ms service update delay
+    updatePeriod = 5; // 5ms service update period
+    updateSlack = 0;
+    pauseTimeout = 4000; // the wait hint CServiceBase reports while pausing
+
+    // Updates asked for by the timer and by TriggerUpdate are merged into one call
+    m_updateEvent = m_loop.AddEvent([this](){ callback_update(); });
 
     // Create a manual-reset event that is not signaled at first to indicate
     // the stopped signal of the service.
@@ -26,11 +32,29 @@ ServiceControlWrapper::ServiceControlWrapper(const char* pszServiceName, const S
     {
         throw GetLastError();
     }
+
+    // Before a system shutdown the worker is stopped as one of the drain
+    // steps, waiting no longer than the drain's deadline.
+    AddShutdownStep("worker", [this](const CShutdownDrain::Deadline& deadline)
+    {
+        m_loop.Quit();
+        if (WaitForSingleObject(m_hStoppedEvent, deadline.Remaining()) != WAIT_OBJECT_0)
+        {
+            throw DWORD(ERROR_TIMEOUT);
+        }
+    }, SHUTDOWN_WAIT);
 }
 
 
 ServiceControlWrapper::~ServiceControlWrapper(void)
 {
+    // A drain that ran out of time may have left the worker running
+    m_loop.Quit();
+    if (m_fWorking)
+    {
+        WaitForSingleObject(m_hStoppedEvent, INFINITE);
+    }
+
     if (m_hStoppedEvent)
     {
         CloseHandle(m_hStoppedEvent);
@@ -44,24 +68,59 @@ void ServiceControlWrapper::OnStart(DWORD dwArgc, PWSTR* lpszArgv)
     // Log a service start message to the Application log.
     WriteEventLogEntry("Example Service Starting...", EVENTLOG_INFORMATION_TYPE);
 
-    // Queue the main service function for execution in a worker thread.
-    CThreadPool::QueueUserWorkItem(&ServiceControlWrapper::ServiceWorkerThread, this);
+    // Queue the main service function for execution in a worker thread. The
+    // worker clears m_fWorking once it has signalled the stopped event.
+    m_fWorking = true;
+    try
+    {
+        CThreadPool::QueueUserWorkItem(&ServiceControlWrapper::ServiceWorkerThread, this);
+    }
+    catch (...)
+    {
+        // No worker will signal the stopped event, so nothing must wait for it
+        m_fWorking = false;
+        throw;
+    }
+}
+
+
+// Update every period, up to slack late, or only when triggered
+void ServiceControlWrapper::SetUpdateTimer(DWORD period, DWORD slack)
+{
+    updatePeriod = period;
+    updateSlack = slack;
 }
 
 
-// This is the service thread - continue looping until the service is stopped
+// Run the update callback on the worker as soon as it is free
+void ServiceControlWrapper::TriggerUpdate()
+{
+    m_loop.Trigger(m_updateEvent);
+}
+
+
+// This is the service thread - it sleeps until an update is due or a control arrives, until the service is stopped
 void ServiceControlWrapper::ServiceWorkerThread(void)
 {
     callback_start();
-    while (!m_fStopping){ // Periodically check if the service is stopping.
-        Sleep(updateTimeout); // Sleep for the update idle interval
-        callback_update(); // Execute the service callback
-        CheckForPause();   // Pause the worker thread if the system requested a pause
+
+    uint64_t timer = 0;
+    if (updatePeriod)
+    {
+        timer = m_loop.AddTimer(updatePeriod, updateSlack, [this](){ m_loop.Trigger(m_updateEvent); });
+    }
+    m_loop.Run(); // returns once OnStop quits the loop
+    if (timer)
+    {
+        m_loop.RemoveTimer(timer);
     }
+
     callback_stopped();
 
-    // Signal the stopped event.
+    // Signal the stopped event. The destructor may run as soon as
+    // m_fWorking is cleared, so that is the last use of this object.
     SetEvent(m_hStoppedEvent);
+    m_fWorking = false;
 }
 
 // Attempt to stop the service by sending a stop signal and waiting for the service to terminate
@@ -72,7 +131,7 @@ void ServiceControlWrapper::OnStop()
 
     // Indicate that the service is stopping and wait for the finish of the
     // main service function (ServiceWorkerThread).
-    m_fStopping = true;
+    m_loop.Quit();
     if (WaitForSingleObject(m_hStoppedEvent, INFINITE) != WAIT_OBJECT_0)
     {
         throw GetLastError();
@@ -83,30 +142,42 @@ void ServiceControlWrapper::OnStop()
 // Attempt to pause the running service by sending a pause signal
 void ServiceControlWrapper::OnPause()
 {
-    std::clock_t timeout = std::clock();
-    m_fPaused = TRUE;
-    while(!m_fSignal){
-        if((std::clock() - timeout) / CLOCKS_PER_SEC > 4){
-            m_fPaused = false;
-            throw DWORD(ERROR_TIMEOUT);
-        }
-    }
-    m_fSignal = false;
+    RequestPause(true);
 }
 
 
 // Attempt to continue the paused service by sending a continue signal
 void ServiceControlWrapper::OnContinue()
 {
-    std::clock_t timeout = std::clock();
-    m_fPaused = false;
-    while(!m_fSignal){
-        if((std::clock() - timeout) / CLOCKS_PER_SEC > 4){
-            m_fPaused = true;
-            throw DWORD(ERROR_TIMEOUT);
-        }
+    RequestPause(false);
+}
+
+
+// Time the worker has to acknowledge a pause or continue before the request fails
+void ServiceControlWrapper::SetPauseTimeout(DWORD timeout)
+{
+    pauseTimeout = timeout;
+}
+
+
+// Hand a pause or continue to the worker and block until it has acknowledged
+// it, or throw ERROR_TIMEOUT once pauseTimeout has passed on the wall clock
+void ServiceControlWrapper::RequestPause(bool pause)
+{
+    std::unique_lock lock(m_pauseLock);
+    m_fPaused = pause;
+    uint64_t request = ++m_pauseRequests;
+    m_loop.Post([this](){ CheckForPause(); });
+
+    if (!m_pauseChanged.wait_for(lock, std::chrono::milliseconds(pauseTimeout), [&](){ return m_pauseAcknowledged >= request; }))
+    {
+        // Take the request back; should the worker get to it late, it is
+        // put back the way the service is still reported to be
+        m_fPaused = !pause;
+        ++m_pauseRequests;
+        m_loop.Post([this](){ CheckForPause(); });
+        throw DWORD(ERROR_TIMEOUT);
     }
-    m_fSignal = false;
 }
 
 
@@ -118,24 +189,52 @@ void ServiceControlWrapper::OnShutdown()
 }
 
 
-// Check the service for a pause signal - hold and block while service is paused
+// OS is about to shut down - the drain steps, stopping the worker among them, run next
+void ServiceControlWrapper::OnPreshutdown()
+{
+    callback_shutdown();
+}
+
+
+// The service's parameters changed - reload configuration without stopping
+void ServiceControlWrapper::OnParamChange()
+{
+    callback_paramchange();
+}
+
+
+// Posted to the worker by a pause or continue - updates are held while the service is paused
 void ServiceControlWrapper::CheckForPause()
 {
-    //When service is paused
-    if(m_fPaused){
-        if(!m_fSignal){
-            m_fSignal = true;   // tell service control manager that the thread has been paused
+    bool paused;
+    uint64_t request;
+    {
+        std::scoped_lock lock(m_pauseLock);
+        paused = m_fPaused;
+        request = m_pauseRequests;
+    }
+
+    if(paused != m_loop.Held()){ // else no change, or a request that timed out was taken back
+        m_loop.Hold(paused);
+        if(paused){
+            AcknowledgePause(request);  // tell service control manager that the thread has been paused
             callback_paused();
+            return;
         }
-        while(m_fPaused){   // wait until the service is un-paused
-            Sleep(pauseTimeout);
-            if(m_fStopping) return;  //if we are stopping when paused, return from the pause state
-        }
-        if(!m_fSignal){
-            callback_continue();
-            m_fSignal = true;   //tell service control manager that the thread has continued
-        }
+        callback_continue();
+    }
+    AcknowledgePause(request);  //tell service control manager that the thread has continued
+}
+
+
+// Release the control thread waiting in RequestPause
+void ServiceControlWrapper::AcknowledgePause(uint64_t request)
+{
+    {
+        std::scoped_lock lock(m_pauseLock);
+        m_pauseAcknowledged = std::max(m_pauseAcknowledged, request);
     }
+    m_pauseChanged.notify_all();
 }
 
 // Internal method for registering the callbacks for the service on initialization
@@ -4,6 +4,8 @@
 #include <functional>
 #include <map>
 #include <string>
+#include <mutex>
+#include <condition_variable>
 
 using ServiceCallback = std::function<void()>;
 using ServiceCallbackList = std::map<std::string, ServiceCallback>;
@@ -15,6 +17,17 @@ public:
     ServiceControlWrapper(const char* pszServiceName, const ServiceCallbackList& callbacks = {}, DWORD dwControl = SERVICE_ACCEPT_PAUSE_CONTINUE | SERVICE_ACCEPT_STOP);
     virtual ~ServiceControlWrapper(void);
 
+    // Call the update callback every period milliseconds, up to slack late so
+    // the wakeup can be shared; a period of 0 updates only on TriggerUpdate.
+    // Takes effect when the service starts.
+    void SetUpdateTimer(DWORD period, DWORD slack = 0);
+    // Call the update callback as soon as the worker is free, e.g. when a message arrives
+    void TriggerUpdate();
+    // Milliseconds the worker has to acknowledge a pause or continue
+    void SetPauseTimeout(DWORD timeout);
+    // The worker's loop, for further timers and events of its own
+    CEventLoop& EventLoop() { return m_loop; }
+
 protected:
 
     virtual void OnStart(DWORD dwArgc, PWSTR* pszArgv);
@@ -22,20 +35,33 @@ protected:
     virtual void OnShutdown();
     virtual void OnPause();
     virtual void OnContinue();
+    virtual void OnParamChange();
+    virtual void OnPreshutdown();
 
     void ServiceWorkerThread(void);
 
-    DWORD pauseTimeout, updateTimeout; // time to wait each pause cycle / update cycle
+    DWORD updatePeriod, updateSlack; // update timer period and how late it may fire, in ms
+    DWORD pauseTimeout; // time for the worker to acknowledge a pause or continue, in ms
 
 private:
 
+    void RequestPause(bool pause);
     void CheckForPause();
-    std::atomic<bool> m_fStopping, m_fPaused, m_fSignal;
+    void AcknowledgePause(uint64_t request);
+
+    std::mutex m_pauseLock;
+    std::condition_variable m_pauseChanged;
+    bool m_fPaused;                                 // state asked for by the SCM, guarded by m_pauseLock
+    uint64_t m_pauseRequests, m_pauseAcknowledged;  // guarded by m_pauseLock
+    std::atomic<bool> m_fWorking;
     HANDLE m_hStoppedEvent;
+    CEventLoop m_loop;
+    uint64_t m_updateEvent;
 
     ServiceCallback callback_update, callback_stopped,
                     callback_paused, callback_continue,
-                    callback_shutdown, callback_start;
+                    callback_shutdown, callback_start,
+                    callback_paramchange;
 
     bool RegisterCallback(const ServiceCallbackList& list, const std::string& name, ServiceCallback& dest_function);
 };
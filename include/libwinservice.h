@@ -10,9 +10,28 @@
 #include <ctime>
 #include <atomic>
 #include <assert.h>
+#include <winsock2.h> // must precede windows.h
+#include <ws2tcpip.h>
 #include <windows.h>
 
+#include "libwinservice_trace.h"
+#include "libwinservice_metrics.h"
 #include "libwinservice_threadpool.h"
+#include "libwinservice_dispatcher.h"
+#include "libwinservice_startup.h"
+#include "libwinservice_shutdown.h"
+#include "libwinservice_eventloop.h"
+#include "libwinservice_eventlog.h"
+#include "libwinservice_logger.h"
+#include "libwinservice_recorder.h"
+#include "libwinservice_config.h"
 #include "libwinservice_base.h"
 #include "libwinservice_install.h"
-#include "libwinservice_ipc.h"
\ No newline at end of file
+#include "libwinservice_reactor.h"
+#include "libwinservice_crc.h"
+#include "libwinservice_transport.h"
+#include "libwinservice_codec.h"
+#include "libwinservice_registry.h"
+#include "libwinservice_capture.h"
+#include "libwinservice_ipc.h"
+#include "libwinservice_tokenizer.h"
\ No newline at end of file
@@ -1,5 +1,14 @@
 #pragma once
 
+#include <vector>
+#include <deque>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <map>
+
 class CServiceBase
 {
 public:
@@ -8,7 +17,16 @@ public:
     // (SCM). After you call Run(ServiceBase), the SCM issues a Start command,
     // which results in a call to the OnStart method in the service. This
     // method blocks until the service has stopped.
-    static BOOL Run(CServiceBase &service, DWORD&);
+    static BOOL Run(CServiceBase &service, DWORD&,
+        CServiceDispatcher &dispatcher = CServiceDispatcher::Default());
+
+    // Register several services hosted by this process in one dispatcher
+    // table, so they share the process, its thread pools and IPC reactor.
+    // Each service gets its own status handle and control handler context.
+    // This method blocks until every service has stopped. A dispatcher other
+    // than the SCM, e.g. a CFakeServiceDispatcher, runs the services in-process.
+    static BOOL Run(const std::vector<CServiceBase*> &services, DWORD&,
+        CServiceDispatcher &dispatcher = CServiceDispatcher::Default());
 
     // Service object constructor.
     CServiceBase(const char* pszServiceName, DWORD dwControlsAccepted = SERVICE_ACCEPT_STOP);
@@ -19,8 +37,42 @@ public:
     // Stop the service.
     void Stop();
 
-    // Set Logging Mode
-    void EnableLogging(bool enabled);
+    // Set Logging Mode. Entries go to the Application event log unless
+    // another backend is given, and are written by a background thread.
+    void EnableLogging(bool enabled, std::unique_ptr<CEventLogBackend> backend = nullptr);
+
+    // Counters of the event log writer
+    const CEventLogStats& EventLogStats() const { return m_eventLog.Stats(); }
+
+    // Dump the flight recorder to this file when the service stops, when the
+    // process crashes, and on a user-defined control code from 128 to 255
+    // (sc control <service> <code>) if one is given.
+    void EnableFlightDump(const std::string &path, DWORD dwControl = 0);
+
+    // Re-report a pending state at this interval, in milliseconds, while
+    // OnStart, OnStop, OnPause or OnContinue runs, so the SCM does not take a
+    // long operation for a hung service. 0 disables the heartbeat.
+    void SetHeartbeat(DWORD dwInterval);
+
+    // Drain the service within this budget, in milliseconds, when it
+    // accepts SERVICE_ACCEPT_PRESHUTDOWN and the system is shutting down.
+    // Keep it within the preshutdown timeout the service is installed with.
+    void SetPreshutdownBudget(DWORD dwBudget);
+
+    // Declare a step of the preshutdown drain, such as flushing IPC or
+    // waiting for a child process. The steps run in priority order on the
+    // thread pool and are handed the deadline of the budget; a step still
+    // running when it passes is abandoned and the rest are skipped.
+    void AddShutdownStep(const std::string& name, CShutdownDrain::Step step,
+        int priority = SHUTDOWN_CHECKPOINT);
+
+    // Run a handler when the service receives a user-defined control code
+    // from 128 to 255 (sc control <service> <code>). The handler runs on the
+    // dispatcher thread and its result is returned to the sender, so it must
+    // be quick; queue longer work on the thread pool. An empty handler
+    // removes the code. Throws ERROR_INVALID_PARAMETER for other codes.
+    using ControlHandler = std::function<DWORD(DWORD dwEventType, LPVOID lpEventData)>;
+    void SetControlHandler(DWORD dwControl, ControlHandler handler);
 
 protected:
 
@@ -50,6 +102,23 @@ protected:
     // system shutting down.
     virtual void OnShutdown();
 
+    // When implemented in a derived class, executes when the system is about
+    // to shut down and the service accepts SERVICE_ACCEPT_PRESHUTDOWN, before
+    // the shutdown steps run. It may declare more of them.
+    virtual void OnPreshutdown();
+
+    // When implemented in a derived class, executes on the thread pool when
+    // the SCM sends SERVICE_CONTROL_PARAMCHANGE because the service's startup
+    // parameters changed, e.g. to reload a CServiceConfig. The service keeps
+    // running; accept the control with SERVICE_ACCEPT_PARAMCHANGE.
+    virtual void OnParamChange();
+
+    // Declare a startup task from OnStart. The tasks run on the thread pool
+    // once OnStart returns, in parallel where their dependencies allow, and
+    // the service reports SERVICE_RUNNING as soon as the last one completes.
+    size_t AddStartupTask(const std::string& name, CStartupGraph::Task task,
+        const std::vector<size_t>& after = {}, DWORD dwEstimate = 1000);
+
     // Set the service status and report the status to the SCM.
     void SetServiceStatus(DWORD dwCurrentState,
         DWORD dwWin32ExitCode = NO_ERROR,
@@ -69,8 +138,32 @@ private:
     static void WINAPI ServiceMain(DWORD dwArgc, char **lpszArgv);
 
     // The function is called by the SCM whenever a control code is sent to
-    // the service.
-    static void WINAPI ServiceCtrlHandler(DWORD dwCtrl);
+    // the service. The context is the CServiceBase the control is for.
+    static DWORD WINAPI ServiceCtrlHandler(DWORD dwCtrl, DWORD dwEventType,
+        LPVOID lpEventData, LPVOID lpContext);
+
+    // Find a hosted service by the name the SCM starts it with.
+    static CServiceBase *FindService(const char* pszServiceName);
+
+    // Queue a control for the lifecycle thread, merging it with the controls
+    // already queued. The flow links it to its span on the lifecycle thread
+    // while tracing.
+    void QueueControl(DWORD dwCtrl, uint64_t flow = 0);
+
+    // Start the service, then run queued controls until it has stopped.
+    void LifecycleThread();
+
+    // Report pending states again while an operation is in progress.
+    void HeartbeatThread();
+
+    // Report m_status to the control manager. Requires m_statusLock.
+    void ReportStatus();
+
+    // Dump the flight recorder for the dump control code, on the thread pool.
+    void DumpFlightRecorder();
+
+    // Run OnParamChange for the parameter change control, on the thread pool.
+    void ParamChange();
 
     // Start the service.
     void Start(DWORD dwArgc, PWSTR *pszArgv);
@@ -84,8 +177,11 @@ private:
     // Execute when the system is shutting down.
     void Shutdown();
 
-    // The singleton service instance.
-    static CServiceBase *s_service;
+    // Drain the service before the system shuts down, then stop it.
+    void Preshutdown();
+
+    // The service instances hosted by this process.
+    static std::vector<CServiceBase*> s_services;
 
     // The name of the service
     const char* m_name;
@@ -93,9 +189,69 @@ private:
     // Service logging is enabled or disabled
     bool service_log;
 
+    // Asynchronous writer behind WriteEventLogEntry
+    CEventLog m_eventLog;
+
+    // The source of this service's events in the flight recorder
+    uint16_t m_flightSource;
+
+    // Dump the flight recorder on stop
+    bool m_dumpOnStop;
+
+    // Handlers of user-defined control codes
+    std::mutex m_handlerLock;
+    std::map<DWORD, ControlHandler> m_handlers;
+
+    // A parameter change is queued and has not started yet, so another one
+    // can be dropped; OnParamChange calls never overlap
+    std::atomic_bool m_paramChangePending;
+    std::mutex m_paramChangeLock;
+
+    // Metrics of this service, labelled with its name
+    CMetricGauge *m_stateMetric;
+    CMetricCounter *m_transitionMetrics[SERVICE_PAUSED + 1]; // by state reported
+    CMetricHistogram *m_controlMetric;
+
     // The status of the service
     SERVICE_STATUS m_status;
 
     // The service status handle
     SERVICE_STATUS_HANDLE m_statusHandle;
+
+    // The next checkpoint reported while an operation is pending
+    DWORD m_checkPoint;
+
+    // The control manager the service reports to
+    CServiceDispatcher *m_dispatcher;
+
+    // The arguments the service was started with
+    std::vector<std::string> m_args;
+
+    // Guards m_status, which the lifecycle and heartbeat threads both report
+    std::mutex m_statusLock;
+    std::condition_variable m_statusChanged;
+
+    // Controls received by ServiceCtrlHandler, run by the lifecycle thread
+    std::mutex m_controlLock;
+    std::condition_variable m_controlQueued;
+    struct QueuedControl
+    {
+        DWORD dwCtrl;
+        uint64_t flow;
+        std::chrono::steady_clock::time_point received;
+    };
+    std::deque<QueuedControl> m_controls;
+    bool m_stopped;
+
+    // Tasks declared by OnStart
+    CStartupGraph m_startup;
+
+    // Steps run before the system shuts down, and their budget in milliseconds
+    CShutdownDrain m_drain;
+    DWORD m_preshutdownBudget;
+
+    // Interval between pending state reports, in milliseconds
+    DWORD m_heartbeat;
+
+    std::thread m_lifecycleThread, m_heartbeatThread;
 };
@@ -0,0 +1,92 @@
+#pragma once
+#include "libwinservice.h"
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+// Capture files start with this magic, followed by one record per message
+#define IPC_CAPTURE_MAGIC "LWSCAP1"
+constexpr size_t IPC_CAPTURE_FLUSH = 64 * 1024; // buffered bytes that trigger a write
+
+enum IPCCaptureDirection : uint8_t {
+    IPC_CAPTURE_INCOMING = 1,
+    IPC_CAPTURE_OUTGOING = 2,
+};
+
+#pragma pack(push, 1)
+struct IPCCaptureRecord {
+    uint64_t timestamp;     // microseconds since the capture started
+    uint8_t direction;      // IPCCaptureDirection
+    uint8_t reserved[3];
+    uint32_t length;        // bytes of message data that follow
+};
+#pragma pack(pop)
+
+//
+//   CLASS: IPCCapture
+//
+//   PURPOSE: Records the messages an IPCController moves, exactly as they
+//   cross the transport, with a timestamp and direction each. Records are
+//   appended to a memory buffer that is written out once it reaches
+//   IPC_CAPTURE_FLUSH, so leaving a capture on costs a copy per message and
+//   an occasional buffered write on the reactor thread.
+//
+class IPCCapture {
+    HANDLE file;
+    std::mutex mtx_capture;
+    std::atomic_bool capturing;
+    std::string buffer;
+    std::chrono::steady_clock::time_point started;
+public:
+    IPCCapture();
+    virtual ~IPCCapture();
+
+    bool Open(const std::string& path);
+    void Close();
+    bool IsOpen() const { return capturing; }
+
+    void Record(IPCCaptureDirection direction, const std::string& data);
+
+private:
+    bool Flush();
+};
+
+//
+//   CLASS: IPCCaptureReader
+//
+//   PURPOSE: Reads the records of a capture file in order.
+//
+class IPCCaptureReader {
+    HANDLE file;
+    std::vector<char> buffer;
+    size_t offset, filled;
+public:
+    IPCCaptureReader();
+    virtual ~IPCCaptureReader();
+
+    bool Open(const std::string& path);
+    void Close();
+
+    // False at the end of the file, or with GetLastError set if the file is damaged
+    bool Next(IPCCaptureRecord& record, std::string& data);
+
+private:
+    bool Fill(size_t size);
+};
+
+//
+//   FUNCTION: ReplayCapture(const std::string&, const std::string&, double, IPCCaptureDirection, IPCStats&)
+//
+//   PURPOSE: Send the data messages of one direction of a capture to an inbox
+//   address. A speed of 1 keeps the original timing, 10 plays it ten times as
+//   fast and 0 sends as fast as the transport allows. Control frames are left
+//   out so the target does not try to handshake with the captured peer, while
+//   data frames keep their original sender ids. Returns once every message
+//   has been handed to the system, false if the target stopped taking them.
+//
+bool ReplayCapture(const std::string& path, const std::string& address, double speed,
+                   IPCCaptureDirection direction, IPCStats& stats);
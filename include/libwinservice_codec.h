@@ -0,0 +1,28 @@
+#pragma once
+#include "libwinservice.h"
+
+#include <compressapi.h>
+#include <string>
+#include <string_view>
+
+constexpr size_t IPC_COMPRESS_THRESHOLD = 1024; // smaller messages are never worth compressing
+
+//
+//   CLASS: IPCCompressor
+//
+//   PURPOSE: XPRESS Huffman compression through the Windows Compression API,
+//   used for the compressed IPC codec. The handles are created on first use
+//   and are not thread safe, so each controller owns one and only uses it
+//   from the reactor thread. Compress fails when the result would not be
+//   smaller than the input, in which case the message is sent as it is.
+//
+class IPCCompressor {
+    COMPRESSOR_HANDLE compressor;
+    DECOMPRESSOR_HANDLE decompressor;
+public:
+    IPCCompressor();
+    virtual ~IPCCompressor();
+
+    bool Compress(std::string_view data, std::string& out);
+    bool Decompress(std::string_view data, std::string& out);
+};
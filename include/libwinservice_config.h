@@ -0,0 +1,95 @@
+#pragma once
+#include "libwinservice.h"
+
+#include <memory>
+#include <atomic>
+#include <functional>
+#include <cstdint>
+
+// Versions are unique across every CServiceConfig and never 0, so a thread's
+// cached snapshot can never be mistaken for another configuration's.
+inline std::atomic_uint64_t g_configVersions {0};
+
+//
+//   CLASS: CServiceConfig
+//
+//   PURPOSE: Configuration that is replaced while the service runs, e.g.
+//   when the SCM sends SERVICE_CONTROL_PARAMCHANGE. A reload builds a new
+//   immutable T and swaps it in whole; readers never see a half-updated
+//   configuration and never wait for a reload.
+//
+//   Each thread keeps the snapshot it last read together with its version.
+//   Get compares that version with the current one, one atomic load, and
+//   only touches the shared pointer after a reload. The reference it returns
+//   stays valid until the same thread calls Get again; hold the pointer from
+//   Load to keep a snapshot longer. A thread keeps its last snapshot alive
+//   until it reads again, and the cache is shared by the configurations of
+//   one type, so alternating between two of them refreshes it every time.
+//
+template<typename T>
+class CServiceConfig {
+public:
+    using Loader = std::function<std::shared_ptr<const T>()>;
+
+    CServiceConfig(Loader loader = nullptr, std::shared_ptr<const T> initial = std::make_shared<const T>()):
+        loader(loader)
+    {
+        Store(initial);
+    }
+
+    // The current configuration, cached per thread until the next reload
+    const T& Get() const {
+        // The version and pointer are plain data so the fast path needs no
+        // thread_local initialization check; the reference lives apart.
+        struct Cache {
+            uint64_t version;
+            const T* value;
+        };
+        static thread_local Cache cache;
+        static thread_local std::shared_ptr<const T> held;
+
+        uint64_t current = version.load(std::memory_order_acquire);
+        if(cache.version != current){
+            held = snapshot.load(std::memory_order_acquire); // at least as new as current
+            cache.value = held.get();
+            cache.version = current;
+        }
+        return *cache.value;
+    }
+
+    std::shared_ptr<const T> Load() const { return snapshot.load(std::memory_order_acquire); }
+    uint64_t Version() const { return version.load(std::memory_order_acquire); }
+
+    // Swap in a new configuration. Readers pick it up on their next Get.
+    void Store(std::shared_ptr<const T> value) {
+        snapshot.store(std::move(value), std::memory_order_release);
+        version.store(++g_configVersions, std::memory_order_release);
+    }
+
+    // Build a new configuration with the loader and swap it in. A loader that
+    // throws or returns nothing leaves the current configuration in place.
+    bool Reload() {
+        if(!loader){
+            SetLastError(ERROR_INVALID_FUNCTION);
+            return false;
+        }
+        std::shared_ptr<const T> value;
+        try {
+            value = loader();
+        } catch(DWORD error) {
+            SetLastError(error);
+            return false;
+        }
+        if(!value){
+            SetLastError(ERROR_INVALID_DATA);
+            return false;
+        }
+        Store(std::move(value));
+        return true;
+    }
+
+private:
+    Loader loader;
+    std::atomic<std::shared_ptr<const T>> snapshot;
+    std::atomic_uint64_t version;
+};
@@ -0,0 +1,15 @@
+#pragma once
+#include "libwinservice.h"
+
+#include <cstdint>
+#include <cstddef>
+
+//
+//   FUNCTION: Crc32c(const void*, size_t, uint32_t)
+//
+//   PURPOSE: CRC-32C (Castagnoli) of a buffer. Pass a previous result as crc
+//   to continue a checksum over several buffers. Uses the SSE4.2 crc32
+//   instruction when the processor has it, the ARMv8 CRC instructions when
+//   built for them, and a slicing-by-8 table otherwise.
+//
+uint32_t Crc32c(const void* data, size_t size, uint32_t crc = 0);
@@ -0,0 +1,105 @@
+#pragma once
+#include "libwinservice.h"
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+//
+//   CLASS: CServiceDispatcher
+//
+//   PURPOSE: The calls CServiceBase makes to the Service Control Manager:
+//   starting the control dispatcher, registering a control handler and
+//   reporting status. Default() forwards them to the real SCM; a
+//   CFakeServiceDispatcher passed to CServiceBase::Run stands in for it.
+//
+class CServiceDispatcher {
+public:
+    virtual ~CServiceDispatcher() = default;
+
+    virtual BOOL StartDispatcher(const SERVICE_TABLE_ENTRY* serviceTable) = 0;
+    virtual SERVICE_STATUS_HANDLE RegisterHandler(const char* pszServiceName, LPHANDLER_FUNCTION_EX handler, LPVOID context) = 0;
+    virtual BOOL SetStatus(SERVICE_STATUS_HANDLE statusHandle, SERVICE_STATUS* status) = 0;
+
+    // The Win32 Service Control Manager
+    static CServiceDispatcher& Default();
+};
+
+// A status reported through a CFakeServiceDispatcher
+struct CServiceTransition {
+    std::chrono::steady_clock::time_point time;
+    std::string service;
+    SERVICE_STATUS status;
+};
+
+//
+//   CLASS: CFakeServiceDispatcher
+//
+//   PURPOSE: An in-process Service Control Manager for driving services
+//   without installing them. StartDispatcher starts every service in the
+//   table on a thread of its own, as the SCM does, then runs injected
+//   controls on the calling thread until every service has reported
+//   SERVICE_STOPPED. Every status report is recorded with a timestamp.
+//
+//   Control blocks until the handler returns, like ControlService, and
+//   returns the handler's result. Injecting a control into a service that
+//   has not registered its handler yet fails with ERROR_SERVICE_NOT_ACTIVE.
+//   Shutdown plays the notifications of a system shutdown, preshutdown
+//   timeout included.
+//
+class CFakeServiceDispatcher : public CServiceDispatcher {
+    struct Service {
+        std::string name;
+        LPHANDLER_FUNCTION_EX handler;
+        LPVOID context;
+        DWORD state;
+        DWORD accepted;     // controls accepted in the last status reported
+    };
+    struct PendingControl {
+        size_t service;
+        DWORD control;
+        DWORD result;
+        bool done;
+    };
+
+    std::mutex mtx_dispatcher;
+    std::condition_variable cv_dispatcher;
+    std::vector<Service> services;
+    std::deque<PendingControl*> controls;
+    std::vector<CServiceTransition> transitions;
+    bool dispatching;
+
+public:
+    CFakeServiceDispatcher();
+    virtual ~CFakeServiceDispatcher() = default;
+
+    BOOL StartDispatcher(const SERVICE_TABLE_ENTRY* serviceTable) override;
+    SERVICE_STATUS_HANDLE RegisterHandler(const char* pszServiceName, LPHANDLER_FUNCTION_EX handler, LPVOID context) override;
+    BOOL SetStatus(SERVICE_STATUS_HANDLE statusHandle, SERVICE_STATUS* status) override;
+
+    // Send a control code to a service and return its handler's result
+    DWORD Control(const std::string& service, DWORD control);
+
+    // Notify the services as the SCM does when the system shuts down: send
+    // SERVICE_CONTROL_PRESHUTDOWN to every running service that accepts it
+    // and wait up to the preshutdown timeout for them to stop, then send
+    // SERVICE_CONTROL_SHUTDOWN to the ones still running that accept it.
+    // Returns false if a service sent the preshutdown did not stop in time.
+    bool Shutdown(DWORD preshutdownTimeout);
+
+    // Wait until a service reports a state, false on timeout
+    bool WaitForState(const std::string& service, DWORD state, DWORD timeout = INFINITE);
+    // Wait until the dispatcher is running and every service has registered its handler
+    bool WaitForDispatcher(DWORD timeout = INFINITE);
+
+    DWORD State(const std::string& service);
+    std::vector<CServiceTransition> Transitions();
+    void ClearTransitions();
+
+private:
+    Service* FindService(const std::string& name); // requires mtx_dispatcher
+};
@@ -0,0 +1,124 @@
+#pragma once
+#include "libwinservice.h"
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <chrono>
+
+constexpr size_t EVENTLOG_RING_SIZE = 1024;       // entries queued before new ones are dropped, a power of two
+constexpr DWORD EVENTLOG_FLUSH_INTERVAL = 100;    // milliseconds the writer waits for more entries
+constexpr DWORD EVENTLOG_SUPPRESS_WINDOW = 1000;  // milliseconds a repeated message stays suppressed
+
+struct CEventLogEntry {
+    WORD type;              // EVENTLOG_ERROR_TYPE, EVENTLOG_INFORMATION_TYPE, ...
+    SYSTEMTIME time;        // local time the entry was logged
+    std::string message;
+};
+
+//
+//   CLASS: CEventLogBackend
+//
+//   PURPOSE: Where a CEventLog writes its entries. Write receives a whole
+//   batch at a time and is only ever called from the writer thread.
+//
+class CEventLogBackend {
+public:
+    virtual ~CEventLogBackend() = default;
+
+    virtual bool Open(const std::string& source) = 0;
+    virtual void Close() = 0;
+    virtual bool Write(const std::vector<CEventLogEntry>& batch) = 0;
+};
+
+// The Application event log, with the event source registered once
+class CWindowsEventLogBackend : public CEventLogBackend {
+    HANDLE source;
+    std::string name;
+public:
+    CWindowsEventLogBackend();
+    virtual ~CWindowsEventLogBackend();
+
+    bool Open(const std::string& source) override;
+    void Close() override;
+    bool Write(const std::vector<CEventLogEntry>& batch) override;
+};
+
+// A text file, one line per entry and one write per batch
+class CFileEventLogBackend : public CEventLogBackend {
+    HANDLE file;
+    std::string path, name, buffer;
+public:
+    CFileEventLogBackend(const std::string& path);
+    virtual ~CFileEventLogBackend();
+
+    bool Open(const std::string& source) override;
+    void Close() override;
+    bool Write(const std::vector<CEventLogEntry>& batch) override;
+};
+
+struct CEventLogStats {
+    std::atomic_size_t logged {0},      // entries handed to the backend
+                       batches {0},     // backend writes
+                       suppressed {0},  // repeats of the previous message that were counted instead
+                       dropped {0};     // entries lost because the ring was full
+};
+
+//
+//   CLASS: CEventLog
+//
+//   PURPOSE: Asynchronous event log writer. Write copies the entry into a
+//   bounded lock-free ring and returns, so logging from the control handler
+//   or a worker never waits on the event log. A writer thread drains the
+//   ring in batches every EVENTLOG_FLUSH_INTERVAL, or as soon as it is half
+//   full, and hands each batch to the backend.
+//
+//   A message identical to the one before it is not queued again. The
+//   repeats are counted, and a "repeated n times" entry is written when a
+//   different message arrives or the suppression window runs out, so an
+//   error storm costs one entry per window instead of one per occurrence.
+//
+class CEventLog {
+    struct Slot {
+        std::atomic_size_t sequence;
+        CEventLogEntry entry;
+        DWORD repeats;          // repeats of the message before this one
+    };
+
+    std::unique_ptr<Slot[]> ring;
+    std::atomic_size_t ring_head;   // next slot to fill, shared by every producer
+    size_t ring_tail;               // next slot to drain, writer thread only
+
+    std::unique_ptr<CEventLogBackend> backend;
+    std::thread writer_thread;
+    std::atomic_bool writer_running;
+    HANDLE wake_event;
+
+    std::atomic_size_t last_hash;   // hash of the last queued message, 0 once its window ran out
+    std::atomic_size_t repeats;     // suppressed repeats of it
+    WORD last_type;
+    ULONGLONG window_end;           // writer thread only
+
+    CEventLogStats stats;
+public:
+    CEventLog();
+    virtual ~CEventLog();
+
+    // Start writing to a backend, the Windows event log under this source by default
+    bool Open(const std::string& source, std::unique_ptr<CEventLogBackend> backend = nullptr);
+    // Write out everything queued and stop the writer
+    void Close();
+    bool IsOpen() const { return writer_running; }
+
+    // Queue an entry, false if the log is closed or the ring is full
+    bool Write(WORD type, const std::string& message);
+
+    const CEventLogStats& Stats() const { return stats; }
+
+private:
+    bool Push(CEventLogEntry& entry, DWORD repeated);
+    void WriterHandle();
+    void Drain(std::vector<CEventLogEntry>& batch);
+};
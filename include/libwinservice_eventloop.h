@@ -0,0 +1,88 @@
+#pragma once
+#include "libwinservice.h"
+
+#include <memory>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <map>
+#include <deque>
+#include <chrono>
+#include <cstdint>
+
+//
+//   CLASS: CEventLoop
+//
+//   PURPOSE: Runs a worker thread's work as it becomes due instead of polling.
+//   Run blocks until a handler is posted, an event is triggered or a timer is
+//   due, runs what is ready on the calling thread, and returns after Quit.
+//
+//   A timer may fire up to its slack late. The loop sleeps until the latest
+//   moment every timer allows and then runs each timer that is due, so
+//   timers with slack share wakeups, with each other and with events. A
+//   timer that falls behind fires once and skips the periods it missed.
+//
+//   Triggers of an event that arrive before its handler runs are merged
+//   into one run. While the loop is held, timers and events are kept for
+//   later and only posted handlers run, so a paused worker does not wake.
+//
+//   Handlers are called without the loop's lock held and may add, remove,
+//   trigger and post. An exception from a handler leaves Run.
+//
+class CEventLoop {
+public:
+    using Handler = std::function<void()>;
+
+    struct Stats {
+        uint64_t wakeups = 0;   // times Run woke from waiting
+        uint64_t timers = 0;    // timer handlers run
+        uint64_t events = 0;    // event handlers run
+        uint64_t posts = 0;     // posted handlers run
+    };
+
+    // Run handler every period milliseconds, the first time one period from now.
+    // Returns the id to remove it with.
+    uint64_t AddTimer(DWORD period, DWORD slack, Handler handler);
+    bool RemoveTimer(uint64_t id);
+
+    // Declare a handler to run after Trigger. Returns the id to trigger it by.
+    uint64_t AddEvent(Handler handler);
+    bool RemoveEvent(uint64_t id);
+    void Trigger(uint64_t id);
+
+    // Run handler once on the loop, even while it is held
+    void Post(Handler handler);
+
+    // Run handlers until Quit. A Quit before Run makes it return at once.
+    void Run();
+    // Make Run return once the handlers it is running return; posted handlers not yet run are dropped.
+    void Quit();
+    bool Quitting() const;
+
+    // Hold timers and events back, e.g. while a service is paused
+    void Hold(bool held);
+    bool Held() const;
+
+    Stats GetStats() const;
+
+private:
+    struct Timer {
+        std::chrono::milliseconds period, slack;
+        std::chrono::steady_clock::time_point due;
+        std::shared_ptr<const Handler> handler;
+    };
+
+    struct Event {
+        std::shared_ptr<const Handler> handler;
+        bool pending = false;
+    };
+
+    mutable std::mutex m_lock;
+    std::condition_variable m_wake;
+    std::map<uint64_t, Timer> m_timers;
+    std::map<uint64_t, Event> m_events;
+    std::deque<Handler> m_posted;
+    uint64_t m_lastId = 0;
+    bool m_quit = false, m_held = false;
+    Stats m_stats;
+};
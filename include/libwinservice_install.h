@@ -17,6 +17,11 @@
 //     must start before this service.
 //   * pszAccount - the name of the account under which the service runs.
 //   * pszPassword - the password to the account name.
+//   * dwServiceType - SERVICE_WIN32_OWN_PROCESS, or SERVICE_WIN32_SHARE_PROCESS
+//     for a service hosted alongside others by CServiceBase::Run.
+//   * dwPreshutdownTimeout - how long the SCM waits for a service accepting
+//     SERVICE_ACCEPT_PRESHUTDOWN to stop before the system shuts down, in
+//     milliseconds, or 0 for the system default.
 //
 //   NOTE: If the function fails to install the service, it prints the error
 //   in the standard output stream for users to diagnose the problem.
@@ -29,7 +34,9 @@ bool InstallService(const char* pszServiceName,
                     DWORD dwErrorControl = SERVICE_ERROR_NORMAL,
                     const char* pszDependencies = "",
                     const char* pszAccount = NULL,
-                    const char* pszPassword = NULL);
+                    const char* pszPassword = NULL,
+                    DWORD dwServiceType = SERVICE_WIN32_OWN_PROCESS,
+                    DWORD dwPreshutdownTimeout = 0);
 
 //
 //   FUNCTION: ServiceInstalled
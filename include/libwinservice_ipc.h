@@ -3,57 +3,249 @@
 
 #include <string>
 #include <queue>
+#include <deque>
+#include <vector>
 #include <atomic>
-#include <thread>
 #include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <memory>
 #include <sstream>
+#include <cstdint>
+#include <unordered_map>
+#include <functional>
 
-#define IPC_MAILSLOT_HEADER "\\\\.\\mailslot\\"
-constexpr size_t BUFSIZE = 4096; // incoming cache size
+// Control frames exchanged between IPCControllers start with this header.
+// The leading NUL keeps them distinct from plain text messages.
+#define IPC_FRAME_MAGIC "\0LWS"
+constexpr uint8_t IPC_FRAME_VERSION = 1;
+constexpr uint8_t IPC_PROTOCOL_VERSION = 2; // 1: frames without capabilities, 2: CAPS and codecs
+constexpr uint8_t IPC_PROTOCOL_PLAIN = 0;   // a peer that sent plain text without greeting: it does not frame
+constexpr ULONGLONG IPC_RETRY_MIN = 20, IPC_RETRY_MAX = 2000; // ms between attempts to open an outbox
+
+enum IPCFrameType : uint8_t {
+    IPC_FRAME_DATA = 0,     // user message carrying the sender's identity
+    IPC_FRAME_HELLO = 1,    // outbox connected - the receiver answers with READY
+    IPC_FRAME_READY = 2,    // answer to HELLO, never answered itself
+    IPC_FRAME_BYE = 3,      // outbox closing
+    IPC_FRAME_CAPS = 4,     // IPCCapabilities, sent right after HELLO and READY
+};
+
+enum IPCFrameFlags : uint16_t {
+    IPC_FRAME_CRC = 1,      // a CRC32C of the header and payload follows the header
+    IPC_FRAME_COMPRESSED = 2, // the payload is XPRESS Huffman compressed
+};
+
+#pragma pack(push, 1)
+struct IPCFrameHeader {
+    char magic[4];
+    uint8_t version;
+    uint8_t type;
+    uint16_t flags;
+    uint32_t sender;        // sender id, the process id unless set otherwise
+    uint32_t sequence;      // per-controller frame counter
+};
+
+// Capability bits exchanged in IPC_FRAME_CAPS
+enum IPCCodec : uint16_t {
+    IPC_CODEC_PLAIN = 1,
+    IPC_CODEC_COMPRESSED = 2,
+    IPC_CODEC_BINARY = 4,           // reserved for a binary schema codec
+};
+
+enum IPCTransportKind : uint16_t {
+    IPC_TRANSPORT_MAILSLOT = 1,
+    IPC_TRANSPORT_TCP = 2,
+    IPC_TRANSPORT_PIPE = 4,         // reserved
+    IPC_TRANSPORT_SHARED_MEMORY = 8,// reserved
+};
+
+struct IPCCapabilities {
+    uint8_t version;        // highest protocol version understood
+    uint8_t reserved;
+    uint16_t codecs;        // IPCCodec bits
+    uint16_t transports;    // IPCTransportKind bits
+};
+#pragma pack(pop)
+
+// What the inbox does with messages from a sender that is over its rate
+enum IPCThrottleAction {
+    IPC_THROTTLE_DROP,      // discard the message
+    IPC_THROTTLE_DEFER,     // hold it back until the sender's bucket refills
+    IPC_THROTTLE_FLAG,      // deliver it, marked as throttled
+};
+
+// Per-sender token bucket limits applied to the inbox. A rate of 0 is unlimited.
+struct IPCRateLimit {
+    double messages_per_second = 0;
+    double bytes_per_second = 0;
+    double burst_seconds = 1.0;         // bucket depth, in seconds worth of the rate
+    IPCThrottleAction action = IPC_THROTTLE_DROP;
+    size_t max_deferred = 1024;         // per sender, deferred messages beyond this are dropped
+};
+
+struct IPCMessageInfo {
+    uint32_t sender = 0;    // 0 for plain messages from peers that do not frame their data
+    bool throttled = false; // the sender was over its rate (IPC_THROTTLE_FLAG)
+    uint32_t sequence = 0;  // frame sequence number, with the sender it identifies the message
+};
+
+struct IPCMessage {
+    std::string data;
+    IPCMessageInfo info;
+};
 
 class IPCController {
-    std::string mailslot_in_str, mailslot_out_str;
-    HANDLE mailslot_in, mailslot_out;
+    std::string inbox_address, outbox_address;
+    std::unique_ptr<IPCInboxTransport> inbox;
+    std::unique_ptr<IPCOutboxTransport> outbox;
 
     SECURITY_ATTRIBUTES ipc_sa;
 
-    std::atomic_bool ipc_valid, ipc_valid_inbox, ipc_valid_outbox, ipc_running,
+    std::atomic_bool ipc_valid, ipc_valid_inbox, ipc_valid_outbox,
                      ipc_inbox_enabled, ipc_outbox_enabled;
     int last_error;
     size_t error_count;
     
-    std::thread ipc_thread;
+    IPCReactor* ipc_reactor;
+    ULONGLONG retry_inbox, retry_outbox; // tick count after which a failed transport may be reopened
+    ULONGLONG retry_backoff;             // ms until the next outbox attempt, doubled for unreachable remote peers
+    std::mutex mtx_inbox, mtx_outbox; // guard the transports
     std::mutex mtx_outgoing_messages, mtx_incoming_messages;
 
-    std::queue<std::string> outgoing_messages, incoming_messages;
+    std::deque<std::string> outgoing_messages, outgoing_batch; // queued by Send / being written by the reactor
+    std::deque<std::string> outgoing_taken;                    // taken from the queue, waiting to be encoded
+    size_t outgoing_unwritten;                                 // taken but not written yet, guarded by mtx_outgoing_messages
+    size_t outgoing_control;                                   // greeting frames leading the batch, not counted as messages; guarded by mtx_outbox
+    std::condition_variable cv_outgoing_messages;              // the reactor wrote what it had taken
+    std::vector<std::string> incoming_batch;                   // reaped by the reactor, reused between passes
+    std::queue<IPCMessage> incoming_messages;
+    std::atomic_size_t incoming_pending;             // incoming queue size, readable without the lock
+    std::condition_variable cv_incoming_messages;
+    std::mutex mtx_receive_notify;
+    std::function<void()> receive_notify;            // guarded by mtx_receive_notify
+    std::chrono::microseconds spin_budget;
+
+    struct SenderBucket {
+        double messages, bytes;                         // available tokens
+        std::chrono::steady_clock::time_point refilled;
+        std::deque<IPCMessage> deferred;
+    };
+    IPCRateLimit rate_limit;                            // guarded by mtx_incoming_messages, like the buckets
+    std::unordered_map<uint32_t, SenderBucket> sender_buckets;
+    std::atomic_size_t deferred_pending;                // messages held back across all buckets
+    uint32_t sender_id;
+    std::atomic_bool ipc_checksum;                      // checksum outgoing frames
+
+    // Negotiated once per connection from the peer's CAPS frame, read per message
+    std::atomic<uint16_t> local_codecs, peer_transports;
+    std::atomic_uint8_t peer_version;
+    std::atomic<IPCCodec> send_codec;
+    IPCCompressor compressor;                           // reactor thread only
+    std::string codec_buffer;
+
+    std::mutex mtx_peer;
+    std::condition_variable cv_peer;
+    std::string peer_address;                   // inbox address announced by the peer
+    std::atomic_bool peer_ready, peer_greeted;  // peer announced itself / peer is waiting for our READY
+    std::atomic_uint32_t frame_sequence;
+
+    std::string inbox_name, outbox_name;    // logical endpoint names resolved through the IPCRegistry
+    DWORD inbox_lease;
+    ULONGLONG renew_inbox;                  // tick count at which the inbox lease is renewed
+
+    IPCStats ipc_stats;
+    IPCCapture ipc_capture;
+    std::atomic_uint16_t flight_source;     // names this controller's events in the flight recorder
 public:
-    IPCController();
-    IPCController(const std::string& id_inbox, const std::string& id_outbox);
+    IPCController(IPCReactor& reactor = IPCReactor::Default());
+    IPCController(const std::string& id_inbox, const std::string& id_outbox, IPCReactor& reactor = IPCReactor::Default());
     virtual ~IPCController();
 
     bool Initialize(const std::string& id_inbox, const std::string& id_outbox);
     bool InitializeInbox(const std::string& id_inbox = "");
+    // A tcp:// outbox connects in the background: false with WSAEWOULDBLOCK
+    // until it has, the reactor finishing it. Wait with WaitForPeer.
     bool InitializeOutbox(const std::string& id_outbox = "");
 
+    // Publish the inbox under a logical name, creating it at a unique address if needed.
+    // The lease is renewed by the reactor until the inbox is disabled.
+    bool PublishInbox(const std::string& name, DWORD lease = IPC_REGISTRY_LEASE);
+    // Connect the outbox to a published name, following the endpoint if it moves or restarts.
+    bool ConnectOutbox(const std::string& name);
+
     bool IsValid() const { return ipc_valid; }
     bool IsValidInbox() const { return ipc_valid_inbox; }
     bool IsValidOutbox() const { return ipc_valid_outbox; }
-    bool LastError() const { return last_error; }
-    bool ErrorCount() const { return error_count; }
+    int LastError() const { return last_error; }
+    size_t ErrorCount() const { return error_count; }
+    const IPCStats& Stats() const { return ipc_stats; }
+
+    bool IsPeerReady() const;               // both directions are connected to a listening peer
+    bool WaitForPeer(DWORD timeout = INFINITE);
+    std::string PeerAddress();
 
     bool Send(const std::string& data); // queue up a message to be sent
+    bool Flush(DWORD timeout = INFINITE); // wait until every queued message has been written to the outbox
     bool Receive(std::string& data);    // read 1 message from incoming queue
     bool Peek(std::string& data);       // peek at next message without dequeing
+    bool WaitReceive(std::string& data, DWORD timeout = INFINITE); // block until a message arrives
+    bool Receive(std::string& data, IPCMessageInfo& info); // as Receive, also reporting the sender
+
+    // Call notify on the reactor thread whenever messages become ready to
+    // Receive, e.g. to wake a worker instead of polling. It should be quick.
+    // It may Receive and create or destroy other controllers, but must not
+    // destroy this one. Once this returns the previous notify is no longer running.
+    void SetReceiveNotify(std::function<void()> notify);
+
+    // Limit the rate each sender may deliver to the inbox. Senders are told
+    // apart by the id in their data frames; plain messages share sender 0.
+    void SetRateLimit(const IPCRateLimit& limit);
+    // Identify this controller's messages by something other than the process id
+    void SetSenderId(uint32_t id) { sender_id = id; }
+    // Protect outgoing frames with a CRC32C. Checksummed frames are verified on
+    // receipt whatever this side's setting; corrupt ones are dropped and counted.
+    // Plain messages sent before the peer has greeted us carry no checksum.
+    void SetChecksum(bool enabled) { ipc_checksum = enabled; }
+
+    // Limit the codecs offered to peers (IPCCodec bits); plain is always offered.
+    void SetCodecs(uint16_t codecs) { local_codecs = codecs | IPC_CODEC_PLAIN; }
+    IPCCodec Codec() const { return send_codec; }          // codec used for outgoing data
+    uint8_t PeerVersion() const { return peer_version; }   // protocol version in use with the peer, IPC_PROTOCOL_PLAIN if it does not frame
+    uint16_t PeerTransports() const { return peer_transports; }
+
+    // Spin-poll for this many microseconds in WaitReceive before blocking
+    void SetSpinBudget(DWORD microseconds) { spin_budget = std::chrono::microseconds(microseconds); }
+
+    // Record every message moved in either direction to a capture file, see ReplayCapture
+    bool StartCapture(const std::string& path) { return ipc_capture.Open(path); }
+    void StopCapture() { ipc_capture.Close(); }
 
     void DisableInbox();
     void DisableOutbox();
     void Reset();
-    void ClearSend() { outgoing_messages = {}; }
-    void ClearReceive() { incoming_messages = {}; }
+    void ClearSend();
+    void ClearReceive();
 
 private:
+    friend class IPCReactor;
+
     void IPCReportError();
-    void IPCHandle();
+    bool IPCPoll(ULONGLONG tick); // service the transports once - called by the reactor thread
+    bool IPCOpenOutbox(IPCFrameType greeting);
+    bool IPCResolveOutbox(); // refresh the outbox address from the registry
+    void IPCCloseOutbox();
+    std::string IPCMakeFrame(IPCFrameType type, const std::string& payload = "", uint16_t flags = 0);
+    std::string IPCMakeCapabilities();
+    void IPCNegotiate(const IPCCapabilities* caps); // settle on a codec, NULL for a peer that sent none
+    std::string IPCEncode(std::string& data);       // turn a queued message into what goes on the wire
+    bool IPCHandleFrame(std::string& data, IPCMessageInfo& info); // consume a control frame, false for user messages
+    bool IPCAdmit(IPCMessage& message, std::chrono::steady_clock::time_point now); // apply the rate limit
+    bool IPCReleaseDeferred(std::chrono::steady_clock::time_point now);
+    bool IPCTakeTokens(SenderBucket& bucket, size_t bytes, std::chrono::steady_clock::time_point now);
+    void IPCNotifyPeer();
+    void IPCSetIncomingPending(size_t pending); // requires mtx_incoming_messages
+    void IPCNotifyReceive();
     bool IPCWriteData();
     bool IPCReadData();
 };
\ No newline at end of file
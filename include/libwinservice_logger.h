@@ -0,0 +1,209 @@
+#pragma once
+#include "libwinservice.h"
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+constexpr size_t LOG_BUFFER_SIZE = 256 * 1024;     // bytes buffered per logging thread, a power of two
+constexpr size_t LOG_MAX_STRING = 4096;            // longer string arguments are truncated
+constexpr DWORD LOG_FLUSH_INTERVAL = 50;           // milliseconds between flusher passes
+
+enum CLogLevel : uint8_t {
+    LOG_DEBUG,
+    LOG_INFO,
+    LOG_WARNING,
+    LOG_ERROR,
+};
+
+// When the log file is rotated. A limit of 0 never rotates on it.
+struct CLogRotation {
+    uint64_t max_bytes = 16 * 1024 * 1024;
+    DWORD max_seconds = 0;      // age of the current file
+    unsigned keep = 5;          // rotated files kept as path.1 (newest) to path.keep
+};
+
+struct CLoggerStats {
+    std::atomic_size_t logged {0},      // lines accepted from callers
+                       written {0},     // lines written to the file
+                       dropped {0},     // lines lost because a thread's buffer was full
+                       bytes {0},       // bytes written to the file
+                       writes {0},      // file writes, one per flusher pass with lines
+                       rotations {0};
+};
+
+//
+//   CLASS: CLogger
+//
+//   PURPOSE: Structured logger for service code on hot paths. Each thread
+//   appends binary records to a buffer of its own, holding the format
+//   string pointer, a timestamp and the raw arguments, so a call costs a
+//   few stores and no locks, formatting or system calls. A flusher thread
+//   collects the records of every thread every LOG_FLUSH_INTERVAL, or once
+//   a buffer is over half full, merges and formats
+//   them in time order and writes them to the file in one call, rotating
+//   the file by size and age.
+//
+//   Formats use {} for each argument and must outlive the logger, which a
+//   string literal does. Integers, floating point values, booleans and
+//   strings are supported; strings are copied. A thread whose buffer is full
+//   drops the line and counts it rather than wait for the flusher.
+//
+class CLogger {
+public:
+    CLogger();
+    virtual ~CLogger();
+
+    bool Open(const std::string& path, const CLogRotation& rotation = {});
+    void Close();                           // write out every line logged so far and close the file
+    void Flush();                           // block until every line logged so far is written
+    bool IsOpen() const { return logging; }
+
+    void SetLevel(CLogLevel level) { min_level = level; }
+    const CLoggerStats& Stats() const { return stats; }
+
+    template<typename... Args>
+    bool Log(CLogLevel level, const char* format, const Args&... args) {
+        if(level < min_level || !logging) return false;
+
+        size_t size = sizeof(Record) + (ArgSize(args) + ... + 0);
+        size = (size + 7) & ~size_t(7);
+
+        Buffer* buffer = ThreadBuffer();
+        char* data = Reserve(*buffer, size);
+        if(data == nullptr){
+            stats.dropped++;
+            return false;
+        }
+
+        Record* record = (Record*)data;
+        record->size = (uint32_t)size;
+        record->level = level;
+        record->argc = (uint8_t)sizeof...(args);
+        record->time = std::chrono::system_clock::now().time_since_epoch().count();
+        record->format = format;
+
+        char* out = data + sizeof(Record);
+        (EncodeArg(out, args), ...);
+
+        Commit(*buffer, size);
+        stats.logged++;
+        return true;
+    }
+
+    template<typename... Args> bool Debug(const char* format, const Args&... args) { return Log(LOG_DEBUG, format, args...); }
+    template<typename... Args> bool Info(const char* format, const Args&... args) { return Log(LOG_INFO, format, args...); }
+    template<typename... Args> bool Warning(const char* format, const Args&... args) { return Log(LOG_WARNING, format, args...); }
+    template<typename... Args> bool Error(const char* format, const Args&... args) { return Log(LOG_ERROR, format, args...); }
+
+private:
+    enum ArgType : uint8_t { ARG_INT, ARG_UINT, ARG_DOUBLE, ARG_BOOL, ARG_CHAR, ARG_STRING };
+
+    static constexpr uint32_t RECORD_PADDING = 0x80000000; // the rest of the buffer is unused, start over
+
+    struct Record {
+        uint32_t size;          // including this header and the arguments, a multiple of 8
+        uint8_t level;
+        uint8_t argc;
+        uint16_t reserved;
+        int64_t time;           // system_clock ticks
+        const char* format;
+    };
+
+    // Single producer, single consumer byte ring owned by one thread
+    struct Buffer {
+        std::unique_ptr<char[]> data { new char[LOG_BUFFER_SIZE] };
+        std::atomic_size_t head {0}, tail {0};  // bytes written by the thread / read by the flusher
+        std::atomic_bool retired {false};       // the thread has exited
+        std::string name;                       // thread id, as written in each line
+    };
+
+    std::atomic_bool logging;
+    std::atomic<CLogLevel> min_level;
+    uint64_t logger_id;                         // tells this logger's thread buffers apart from others'
+
+    std::mutex mtx_buffers;
+    std::vector<std::shared_ptr<Buffer>> buffers;
+
+    std::thread flusher_thread;
+    std::mutex mtx_flush;
+    std::condition_variable cv_flush;
+    uint64_t flush_requested, flush_completed;
+    std::atomic_bool flush_wake;                // a thread buffer is over half full
+
+    HANDLE file;
+    std::string file_path;
+    CLogRotation rotation;
+    uint64_t file_bytes;
+    std::chrono::steady_clock::time_point file_opened;
+    std::string output;                         // formatted lines, flusher thread only
+    size_t output_lines;
+    time_t format_second;                       // second of the cached date prefix
+    char format_date[24];
+
+    CLoggerStats stats;
+
+    Buffer* ThreadBuffer();
+    char* Reserve(Buffer& buffer, size_t size);
+    void Commit(Buffer& buffer, size_t size);
+
+    void FlusherHandle();
+    void Collect();                             // format every buffered record into the output
+    bool WriteOut();                            // write the output to the file
+    bool OpenFile(bool truncate);
+    void Rotate();
+    void Format(const Record& record, const char* args, const Buffer& buffer, std::string& text);
+
+    // Argument encoding: a type byte followed by the value, strings by their length and bytes
+    template<typename T>
+    static size_t ArgSize(const T& arg) {
+        if constexpr (std::is_convertible_v<const T&, std::string_view>) {
+            return 1 + sizeof(uint32_t) + std::min(std::string_view(arg).size(), LOG_MAX_STRING);
+        } else {
+            static_assert(std::is_arithmetic_v<T>, "CLogger arguments are numbers, booleans or strings");
+            return 1 + sizeof(uint64_t);
+        }
+    }
+
+    template<typename T>
+    static void EncodeArg(char*& out, const T& arg) {
+        if constexpr (std::is_convertible_v<const T&, std::string_view>) {
+            std::string_view text(arg);
+            uint32_t length = (uint32_t)std::min(text.size(), LOG_MAX_STRING);
+            *out++ = ARG_STRING;
+            memcpy(out, &length, sizeof(length));
+            memcpy(out + sizeof(length), text.data(), length);
+            out += sizeof(length) + length;
+        } else {
+            uint64_t value;
+            if constexpr (std::is_same_v<T, bool>) {
+                *out++ = ARG_BOOL;
+                value = arg;
+            } else if constexpr (std::is_same_v<T, char>) {
+                *out++ = ARG_CHAR;
+                value = (uint8_t)arg;
+            } else if constexpr (std::is_floating_point_v<T>) {
+                *out++ = ARG_DOUBLE;
+                double d = arg;
+                memcpy(&value, &d, sizeof(value));
+            } else if constexpr (std::is_signed_v<T>) {
+                *out++ = ARG_INT;
+                value = (uint64_t)(int64_t)arg;
+            } else {
+                *out++ = ARG_UINT;
+                value = (uint64_t)arg;
+            }
+            memcpy(out, &value, sizeof(value));
+            out += sizeof(value);
+        }
+    }
+};
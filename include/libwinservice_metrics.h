@@ -0,0 +1,156 @@
+#pragma once
+#include "libwinservice.h"
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <algorithm>
+#include <cstdint>
+
+// Histogram buckets for durations in seconds, from 50us to 10s
+inline const std::vector<double> METRICS_LATENCY_BUCKETS {
+    0.00005, 0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 10
+};
+
+enum CMetricType : uint8_t {
+    METRIC_COUNTER,
+    METRIC_GAUGE,
+    METRIC_HISTOGRAM,
+};
+
+//
+//   CLASS: CMetric
+//
+//   PURPOSE: A registered metric: its name, help text and labels, and the
+//   link to the metric registered before it. Metrics live as long as the
+//   registry, so components keep references to them. Each metric has a
+//   cache line of its own so updates to different metrics never contend.
+//
+class alignas(64) CMetric {
+    friend class CMetrics;
+    CMetricType type;
+    std::string name, help, labels;
+    CMetric* next = nullptr;
+public:
+    CMetric(CMetricType type): type(type) {}
+    virtual ~CMetric() = default;
+
+    const std::string& Name() const { return name; }
+    const std::string& Labels() const { return labels; }
+
+protected:
+    // Append the sample lines of this metric in the text exposition format
+    virtual void Format(std::string& out) const = 0;
+    void Sample(std::string& out, const char* suffix, const std::string& extra, double value) const;
+};
+
+// Monotonic count of events
+class CMetricCounter : public CMetric {
+    std::atomic_uint64_t value {0};
+public:
+    CMetricCounter(): CMetric(METRIC_COUNTER) {}
+
+    void Add(uint64_t n = 1) { value.fetch_add(n, std::memory_order_relaxed); }
+    uint64_t Value() const { return value.load(std::memory_order_relaxed); }
+protected:
+    void Format(std::string& out) const override;
+};
+
+// Value that goes up and down, such as a queue depth
+class CMetricGauge : public CMetric {
+    std::atomic_int64_t value {0};
+public:
+    CMetricGauge(): CMetric(METRIC_GAUGE) {}
+
+    void Set(int64_t v) { value.store(v, std::memory_order_relaxed); }
+    void Add(int64_t n = 1) { value.fetch_add(n, std::memory_order_relaxed); }
+    void Sub(int64_t n = 1) { value.fetch_sub(n, std::memory_order_relaxed); }
+    int64_t Value() const { return value.load(std::memory_order_relaxed); }
+protected:
+    void Format(std::string& out) const override;
+};
+
+// Distribution of observed values over fixed buckets
+class CMetricHistogram : public CMetric {
+    std::vector<double> bounds;                     // upper bounds, ascending, +Inf implied
+    std::unique_ptr<std::atomic_uint64_t[]> counts; // per bucket, not cumulative
+    std::atomic<double> sum {0};
+public:
+    CMetricHistogram(const std::vector<double>& buckets);
+
+    void Observe(double v) {
+        size_t bucket = std::lower_bound(bounds.begin(), bounds.end(), v) - bounds.begin();
+        counts[bucket].fetch_add(1, std::memory_order_relaxed);
+        sum.fetch_add(v, std::memory_order_relaxed);
+    }
+    uint64_t Count() const;
+protected:
+    void Format(std::string& out) const override;
+};
+
+//
+//   CLASS: CMetrics
+//
+//   PURPOSE: Registry of counters, gauges and histograms in the Prometheus
+//   text exposition format. The library registers its own metrics in the
+//   default registry: IPC queues and traffic, the thread pool and the
+//   lifecycle of each service.
+//
+//   Updating a metric is one relaxed atomic operation. Registration takes a
+//   lock, so components register once and keep the reference. Metrics are
+//   kept in a list that only ever grows at its head, so a scrape walks it
+//   without a lock and never holds up an update or a registration.
+//
+//   A scrape is written to a file on an interval, atomically replaced for
+//   collectors reading the directory, or served over HTTP on a loopback port.
+//
+class CMetrics {
+    std::atomic<CMetric*> head;
+    std::mutex mtx_register;
+
+    std::mutex mtx_export;
+    std::condition_variable cv_export;
+    bool exporting;
+    std::thread file_thread, server_thread;
+    SOCKET listener;
+public:
+    CMetrics();
+    virtual ~CMetrics();
+
+    // The registry the library registers its metrics in
+    static CMetrics& Default();
+
+    // Register a metric, or get the one already registered with this name and
+    // labels. Labels are written as in the exposition format, see Label.
+    // Throws ERROR_ALREADY_EXISTS when the name is in use by another type.
+    CMetricCounter& Counter(const std::string& name, const std::string& help, const std::string& labels = "");
+    CMetricGauge& Gauge(const std::string& name, const std::string& help, const std::string& labels = "");
+    CMetricHistogram& Histogram(const std::string& name, const std::string& help, const std::string& labels = "",
+                                const std::vector<double>& buckets = METRICS_LATENCY_BUCKETS);
+
+    // name="value", with the value escaped
+    static std::string Label(const std::string& name, const std::string& value);
+
+    // Append every metric in the text exposition format
+    void Format(std::string& out) const;
+
+    // Write a scrape to a file through a temporary file, so readers never see a partial one
+    bool WriteFile(const std::string& path) const;
+
+    // Write a scrape to the file every interval milliseconds until StopExport
+    bool StartFileExport(const std::string& path, DWORD interval = 10000);
+    // Serve scrapes over HTTP on 127.0.0.1 until StopExport
+    bool StartServer(unsigned short port);
+    void StopExport();
+
+private:
+    CMetric* Find(const std::string& name, const std::string& labels, CMetricType type); // requires mtx_register
+    void Publish(CMetric* metric, const std::string& name, const std::string& help, const std::string& labels);
+
+    void FileHandle(std::string path, DWORD interval);
+    void ServerHandle();
+};
@@ -0,0 +1,72 @@
+#pragma once
+#include "libwinservice.h"
+
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <chrono>
+
+class IPCController;
+
+//
+//   CLASS: IPCReactor
+//
+//   PURPOSE: Services the inboxes and outboxes of many IPCControllers from a
+//   single thread. Controllers register with a reactor instead of owning a
+//   thread of their own, so a service talking to hundreds of children only
+//   carries one mostly-sleeping IPC thread. The reactor idles on a wake event
+//   which is signaled whenever a controller has outgoing messages queued.
+//
+//   For latency critical endpoints a reactor can be given a spin budget, in
+//   which case it keeps polling its controllers for that many microseconds
+//   after running dry before falling back to the idle wait, optionally pinned
+//   to a set of processors. This trades a core for the lowest round trip.
+//
+//   Controllers are serviced without the controller list locked, so code run
+//   by a pass, such as a receive notify, may create and destroy controllers;
+//   only the controller being serviced must not be destroyed from within it.
+//
+class IPCReactor {
+    struct Entry {
+        IPCController* controller;
+        std::atomic_bool removed {false};
+    };
+
+    std::thread reactor_thread;
+    std::mutex mtx_controllers;
+    std::vector<std::shared_ptr<Entry>> controllers;
+    uint64_t controllers_version;                       // bumped on every change, guarded by mtx_controllers
+    std::vector<std::shared_ptr<Entry>> poll_snapshot;  // reactor thread only
+    uint64_t poll_version;
+    std::atomic<IPCController*> polling;                // controller being serviced right now
+
+    std::atomic_bool reactor_running;
+    HANDLE wake_event;
+    DWORD idle_timeout;
+
+    std::chrono::microseconds spin_budget;
+    DWORD_PTR affinity_mask;
+    std::atomic_size_t spin_hits, spin_misses;
+
+public:
+    IPCReactor(DWORD idleTimeout = 25, DWORD spinMicroseconds = 0, DWORD_PTR affinityMask = 0);
+    virtual ~IPCReactor();
+
+    void Register(IPCController* controller);   // begin servicing a controller
+    void Unregister(IPCController* controller); // blocks until the controller is no longer being serviced
+    void Wake();                                // service all controllers immediately
+    HANDLE WakeEvent() const { return wake_event; } // for transports able to signal arrivals
+
+    size_t Count();
+    size_t SpinHits() const { return spin_hits; }     // spins that found work before the budget ran out
+    size_t SpinMisses() const { return spin_misses; } // spins that fell back to the idle wait
+
+    // The process-wide reactor used by controllers that are not given one explicitly.
+    static IPCReactor& Default();
+
+private:
+    void ReactorHandle();
+    bool ReactorPoll(); // service every controller once, true if any moved data
+};
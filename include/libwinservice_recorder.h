@@ -0,0 +1,85 @@
+#pragma once
+#include "libwinservice.h"
+#include "libwinservice_recorder_format.h"
+
+#include <string>
+#include <memory>
+#include <atomic>
+#include <chrono>
+
+constexpr size_t FLIGHT_RECORDER_SIZE = 16384;    // events kept, a power of two
+constexpr size_t FLIGHT_MAX_SOURCES = 64;         // named sources, later names share source 0
+
+//
+//   CLASS: CFlightRecorder
+//
+//   PURPOSE: Always-on in-memory trace of what the process did last. Every
+//   event is a fixed size binary record in a circular buffer shared by all
+//   threads: claiming a slot is one atomic increment, and writing it a few
+//   stores, so recording costs tens of nanoseconds and never blocks. Once
+//   the buffer is full the oldest events are overwritten.
+//
+//   Dump writes the buffer to a file in the CFlightDumpHeader layout, which
+//   tools/flight_decode.cpp turns into text on any platform. Dumping needs
+//   no allocation, so it can run from the crash handler DumpOnCrash installs.
+//
+class CFlightRecorder {
+    struct Slot {
+        std::atomic_uint64_t sequence;  // index + 1 once written, 0 while being written
+        CFlightRecord record;
+    };
+
+    std::unique_ptr<Slot[]> slots;
+    std::atomic_uint64_t next;          // index of the next event
+    std::atomic_bool recording;
+
+    char source_names[FLIGHT_MAX_SOURCES][FLIGHT_SOURCE_NAME];
+    std::atomic_size_t source_count;
+    std::atomic_flag source_lock = ATOMIC_FLAG_INIT;
+
+    char dump_path[MAX_PATH];
+    std::atomic_flag dumping = ATOMIC_FLAG_INIT;
+public:
+    CFlightRecorder();
+    virtual ~CFlightRecorder() = default;
+
+    // The recorder the library records its events to
+    static CFlightRecorder& Default();
+
+    void Record(CFlightEvent type, uint16_t source, uint32_t a = 0, uint32_t b = 0) {
+        if(!recording.load(std::memory_order_relaxed)) return;
+
+        uint64_t index = next.fetch_add(1, std::memory_order_relaxed);
+        Slot& slot = slots[index & (FLIGHT_RECORDER_SIZE - 1)];
+
+        // Dump skips a slot whose sequence changes while it copies it.
+        slot.sequence.store(0, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        slot.record.time = Now();
+        slot.record.type = type;
+        slot.record.source = source;
+        slot.record.thread = GetCurrentThreadId();
+        slot.record.a = a;
+        slot.record.b = b;
+        slot.sequence.store(index + 1, std::memory_order_release);
+    }
+
+    // Id for events of a named service or endpoint. The same name always gets the same id.
+    uint16_t Source(const std::string& name);
+
+    void Enable(bool enabled) { recording = enabled; }
+    bool IsEnabled() const { return recording; }
+    uint64_t Recorded() const { return next; }
+
+    // Where Dump(reason) and the crash handler write
+    void SetDumpPath(const std::string& path);
+    // Dump on an unhandled exception or std::terminate, to the dump path
+    void DumpOnCrash();
+
+    bool Dump(CFlightDumpReason reason = FLIGHT_DUMP_REQUESTED);
+    bool Dump(const char* path, CFlightDumpReason reason = FLIGHT_DUMP_REQUESTED);
+
+    static uint64_t Now() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+};
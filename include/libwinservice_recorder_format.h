@@ -0,0 +1,140 @@
+#pragma once
+
+// Layout of flight recorder dumps. This header only needs the standard
+// library, so the decoder in tools/ builds from it on any platform.
+
+#include <cstdint>
+#include <cstddef>
+
+#define FLIGHT_DUMP_MAGIC "LWSFLT1"    // followed by its terminator
+constexpr uint16_t FLIGHT_DUMP_VERSION = 1;
+constexpr size_t FLIGHT_SOURCE_NAME = 48;   // longest source name kept, with its terminator
+
+// What happened, and what the two arguments of the record hold
+enum CFlightEvent : uint16_t {
+    FLIGHT_CONTROL = 1,         // a: control code, b: event type
+    FLIGHT_STATE = 2,           // a: service state reported, b: win32 exit code
+    FLIGHT_IPC_SEND = 3,        // a: bytes on the wire, b: messages waiting to be written, this one included
+    FLIGHT_IPC_RECEIVE = 4,     // a: bytes on the wire, b: sender id, 0 for plain text
+    FLIGHT_IPC_OPEN = 5,        // a: FLIGHT_INBOX or FLIGHT_OUTBOX, b: greeting frame type sent
+    FLIGHT_IPC_PEER = 6,        // a: control frame type received, b: sender id
+    FLIGHT_ERROR = 7,           // a: error code
+    FLIGHT_DUMP = 8,            // a: CFlightDumpReason
+    FLIGHT_MARK = 9,            // a, b: defined by the application
+};
+
+enum CFlightEndpoint : uint32_t {
+    FLIGHT_INBOX = 1,
+    FLIGHT_OUTBOX = 2,
+};
+
+enum CFlightDumpReason : uint16_t {
+    FLIGHT_DUMP_REQUESTED = 1,  // Dump was called
+    FLIGHT_DUMP_STOPPED = 2,    // a service reported SERVICE_STOPPED
+    FLIGHT_DUMP_CONTROL = 3,    // a service received its dump control code
+    FLIGHT_DUMP_CRASH = 4,      // unhandled exception or std::terminate
+};
+
+#pragma pack(push, 1)
+struct CFlightRecord {
+    uint64_t time;          // nanoseconds on the recorder clock
+    uint16_t type;          // CFlightEvent
+    uint16_t source;        // index into the source names, 0 when unnamed
+    uint32_t thread;        // thread id
+    uint32_t a, b;
+};
+
+// A dump is this header, the source names, then the records oldest first
+struct CFlightDumpHeader {
+    char magic[8];          // FLIGHT_DUMP_MAGIC
+    uint16_t version;       // FLIGHT_DUMP_VERSION
+    uint16_t record_size;   // sizeof(CFlightRecord)
+    uint16_t sources;       // CFlightSourceName entries after the header
+    uint16_t reason;        // CFlightDumpReason
+    uint32_t process_id;
+    uint32_t records;
+    uint64_t recorded;      // events recorded since the process started, overwritten ones included
+    uint64_t time;          // recorder clock at the dump, nanoseconds
+    int64_t wall_time;      // UTC at the dump, microseconds since 1970
+};
+
+struct CFlightSourceName {
+    uint16_t id;
+    uint16_t length;        // bytes of name that follow, no terminator
+};
+#pragma pack(pop)
+
+inline const char* FlightEventName(uint16_t type) {
+    switch(type){
+    case FLIGHT_CONTROL: return "control";
+    case FLIGHT_STATE: return "state";
+    case FLIGHT_IPC_SEND: return "ipc-send";
+    case FLIGHT_IPC_RECEIVE: return "ipc-receive";
+    case FLIGHT_IPC_OPEN: return "ipc-open";
+    case FLIGHT_IPC_PEER: return "ipc-peer";
+    case FLIGHT_ERROR: return "error";
+    case FLIGHT_DUMP: return "dump";
+    case FLIGHT_MARK: return "mark";
+    default: return "unknown";
+    }
+}
+
+// SERVICE_CONTROL_* codes, spelled out so the decoder needs no Windows headers
+inline const char* FlightControlName(uint32_t control) {
+    switch(control){
+    case 1: return "stop";
+    case 2: return "pause";
+    case 3: return "continue";
+    case 4: return "interrogate";
+    case 5: return "shutdown";
+    case 6: return "paramchange";
+    case 7: return "netbindadd";
+    case 8: return "netbindremove";
+    case 9: return "netbindenable";
+    case 10: return "netbinddisable";
+    case 11: return "deviceevent";
+    case 12: return "hardwareprofilechange";
+    case 13: return "powerevent";
+    case 14: return "sessionchange";
+    case 15: return "preshutdown";
+    case 16: return "timechange";
+    case 32: return "triggerevent";
+    default: return control >= 128 && control <= 255 ? "user" : "unknown";
+    }
+}
+
+// SERVICE_* states
+inline const char* FlightStateName(uint32_t state) {
+    switch(state){
+    case 1: return "stopped";
+    case 2: return "start-pending";
+    case 3: return "stop-pending";
+    case 4: return "running";
+    case 5: return "continue-pending";
+    case 6: return "pause-pending";
+    case 7: return "paused";
+    default: return "unknown";
+    }
+}
+
+// IPCFrameType values
+inline const char* FlightFrameName(uint32_t type) {
+    switch(type){
+    case 0: return "data";
+    case 1: return "hello";
+    case 2: return "ready";
+    case 3: return "bye";
+    case 4: return "caps";
+    default: return "unknown";
+    }
+}
+
+inline const char* FlightDumpReasonName(uint32_t reason) {
+    switch(reason){
+    case FLIGHT_DUMP_REQUESTED: return "requested";
+    case FLIGHT_DUMP_STOPPED: return "stopped";
+    case FLIGHT_DUMP_CONTROL: return "control";
+    case FLIGHT_DUMP_CRASH: return "crash";
+    default: return "unknown";
+    }
+}
@@ -0,0 +1,51 @@
+#pragma once
+#include "libwinservice.h"
+
+#include <string>
+
+#define IPC_REGISTRY_NAME "libwinservice_registry"
+constexpr size_t IPC_REGISTRY_SLOTS = 256;
+constexpr DWORD IPC_REGISTRY_LEASE = 10000; // default lease in milliseconds
+
+struct IPCRegistryEntry {
+    char name[64];          // logical endpoint name
+    char address[128];      // transport address of the endpoint's inbox
+    DWORD pid;              // owning process
+    ULONGLONG expires;      // GetTickCount64 value after which the lease has lapsed
+};
+
+//
+//   CLASS: IPCRegistry
+//
+//   PURPOSE: A table in named shared memory mapping logical endpoint names to
+//   live transport addresses, so processes find each other by name instead
+//   of by pid-suffixed mailslot strings. Entries are held on a lease that
+//   the owner renews; an entry is ignored once its lease lapses or its
+//   owning process exits, so a restarted endpoint can be looked up again
+//   immediately. Access is serialized by a named mutex.
+//
+class IPCRegistry {
+    HANDLE mapping, lock;
+    IPCRegistryEntry* table;
+    SECURITY_ATTRIBUTES sa;
+
+public:
+    IPCRegistry();
+    virtual ~IPCRegistry();
+
+    bool IsValid() const { return table != NULL; }
+
+    // Claim or renew a name. Fails if the name is held by another live process.
+    bool Register(const std::string& name, const std::string& address, DWORD lease = IPC_REGISTRY_LEASE);
+    bool Unregister(const std::string& name);
+    bool Lookup(const std::string& name, std::string& address);
+
+    // The registry shared by every controller in this process.
+    static IPCRegistry& Default();
+
+private:
+    bool Lock();
+    void Unlock();
+    bool IsLive(const IPCRegistryEntry& entry, ULONGLONG tick);
+    IPCRegistryEntry* Find(const std::string& name, ULONGLONG tick);
+};
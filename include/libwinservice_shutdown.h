@@ -0,0 +1,110 @@
+#pragma once
+#include "libwinservice.h"
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <utility>
+#include <chrono>
+
+// Priorities of the usual drain steps, which run lowest first
+enum CShutdownPriority : int {
+    SHUTDOWN_FLUSH = 100,       // deliver the messages still queued for other processes
+    SHUTDOWN_CHILDREN = 200,    // tell child processes to exit
+    SHUTDOWN_WAIT = 300,        // wait for children and worker threads to finish
+    SHUTDOWN_CHECKPOINT = 400,  // persist state for the next start
+};
+
+//
+//   CLASS: CShutdownDrain
+//
+//   PURPOSE: Work to finish before the system shuts down, declared as steps
+//   with a priority. Run starts the steps one at a time in priority order,
+//   in the order they were added within a priority, and gives the whole
+//   drain a time budget.
+//
+//   Each step runs on the thread pool and is handed its deadline, the end
+//   of the budget, to bound its waits by. When the budget runs out Run stops
+//   waiting: the step still running is abandoned and the steps after it are
+//   skipped, so the service can report that it has stopped before the SCM
+//   gives up on it. An abandoned step keeps running on the thread pool until
+//   it returns; it must not touch anything that may be gone by then.
+//
+//   A step failing with an exception, a DWORD error code by convention, is
+//   recorded and the drain moves on to the next one, since the steps after
+//   it still stand to lose data if skipped.
+//
+class CShutdownDrain {
+public:
+    // The end of the budget, as handed to each step
+    class Deadline {
+        std::chrono::steady_clock::time_point until;
+    public:
+        Deadline(std::chrono::steady_clock::time_point until): until(until) {}
+
+        std::chrono::steady_clock::time_point Until() const { return until; }
+        bool Expired() const { return std::chrono::steady_clock::now() >= until; }
+
+        // Milliseconds left, rounded up, for WaitForSingleObject and friends
+        DWORD Remaining() const {
+            auto left = until - std::chrono::steady_clock::now();
+            if(left <= left.zero()) return 0;
+            return (DWORD)std::chrono::ceil<std::chrono::milliseconds>(left).count();
+        }
+    };
+
+    using Step = std::function<void(const Deadline&)>;
+
+    struct Progress {
+        size_t started, total;      // the step about to start is number started
+        const std::string& step;
+        DWORD remaining;            // milliseconds left in the budget
+    };
+
+    struct Result {
+        size_t completed = 0;
+        std::vector<std::pair<std::string, DWORD>> failed; // threw, with the DWORD thrown
+        std::vector<std::string> abandoned; // still running or not started when the budget ran out
+    };
+
+    // Add a step. Steps stay declared for further runs until Clear.
+    void Add(const std::string& name, Step step, int priority = SHUTDOWN_CHECKPOINT);
+
+    // Run every step within the budget in milliseconds, calling progress on
+    // this thread before each step starts.
+    Result Run(DWORD budget, const std::function<void(const Progress&)>& progress);
+
+    bool Empty();
+    void Clear();
+
+private:
+    struct Entry {
+        std::string name;
+        Step step;
+        int priority;
+    };
+
+    // A step handed to the thread pool. It keeps itself alive until it
+    // returns, so Run may give up on it at any time.
+    struct Job {
+        std::string name;
+        Step step;
+        Deadline deadline;
+        std::mutex lock;
+        std::condition_variable finished;
+        bool done = false;
+        DWORD error = NO_ERROR;
+        std::shared_ptr<Job> self;
+
+        Job(const std::string& name, const Step& step, Deadline deadline):
+            name(name), step(step), deadline(deadline) {}
+
+        void Run();    // called on the thread pool
+    };
+
+    std::mutex m_lock;
+    std::vector<Entry> m_steps;
+};
@@ -0,0 +1,72 @@
+#pragma once
+#include "libwinservice.h"
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+
+//
+//   CLASS: CStartupGraph
+//
+//   PURPOSE: Startup work declared as tasks with dependencies. Run queues
+//   every task whose dependencies have completed to the thread pool, so
+//   independent tasks such as loading caches and opening IPC endpoints run
+//   in parallel instead of one after another, and reports progress on the
+//   calling thread each time a task completes.
+//
+//   A task may only depend on tasks added before it, so the graph can never
+//   hold a cycle. A task failing with an exception stops further tasks from
+//   starting; Run rethrows it once the tasks already running have finished.
+//
+class CStartupGraph {
+public:
+    using Task = std::function<void()>;
+
+    struct Progress {
+        size_t completed, total;
+        DWORD remaining;    // estimated milliseconds along the longest chain of unfinished tasks
+    };
+
+    // Add a task run after the given tasks, returning its id. The estimate
+    // in milliseconds is only used for the wait hints reported to the SCM.
+    // Throws ERROR_BUSY while Run is in progress, e.g. when called from a task.
+    size_t Add(const std::string& name, Task task, const std::vector<size_t>& after = {}, DWORD dwEstimate = 1000);
+
+    // Run every task, calling progress after each completion but the last
+    void Run(const std::function<void(const Progress&)>& progress);
+
+    DWORD Estimate();   // the longest chain of estimates through the whole graph
+    bool Empty() const { return m_tasks.empty(); }
+    void Clear();
+
+private:
+    struct Node {
+        std::string name;
+        Task task;
+        DWORD estimate;
+        std::vector<size_t> after, dependents;
+        size_t waiting;     // dependencies not completed yet
+        bool done;
+    };
+
+    // Queue a task whose dependencies have completed. Requires m_lock.
+    void Schedule(size_t id);
+    // Run one task from the ready queue - called on the thread pool.
+    void RunReady();
+    // Longest chain of estimates through the tasks not yet done, or through
+    // all of them. Requires m_lock.
+    DWORD Remaining(bool whole);
+
+    std::mutex m_lock;
+    std::condition_variable m_changed;
+    std::vector<Node> m_tasks;
+    std::deque<size_t> m_ready;
+    size_t m_completed = 0;
+    size_t m_scheduled = 0;    // queued or running
+    bool m_running = false;    // Run is in progress, tasks may no longer be added
+    std::exception_ptr m_error;
+};
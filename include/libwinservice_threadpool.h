@@ -40,6 +40,8 @@
 #pragma once
 
 #include <memory>
+#include <tuple>
+#include <chrono>
 
 
 class CThreadPool
@@ -50,30 +52,75 @@ public:
     static void QueueUserWorkItem(void (T::*function)(void),
         T *object, ULONG flags = WT_EXECUTELONGFUNCTION)
     {
-        typedef std::pair<void (T::*)(), T *> CallbackType;
-        std::unique_ptr<CallbackType> p(new CallbackType(function, object));
+        typedef std::tuple<void (T::*)(), T *, uint64_t, std::chrono::steady_clock::time_point> CallbackType;
 
+        // While tracing, queuing and running the work item are linked by a flow
+        CTracer &tracer = CTracer::Default();
+        uint64_t flow = tracer.IsTracing() ? tracer.NewFlow() : 0;
+        CTraceSpan span("QueueUserWorkItem", "pool", flow, TRACE_FLOW_OUT);
+
+        std::unique_ptr<CallbackType> p(new CallbackType(function, object, flow,
+            std::chrono::steady_clock::now()));
+
+        // Counted as waiting first, the work item may start before the call returns.
+        GetMetrics().waiting.Add();
         if (::QueueUserWorkItem(ThreadProc<T>, p.get(), flags))
         {
-            // The ThreadProc now has the responsibility of deleting the pair.
+            // The ThreadProc now has the responsibility of deleting the callback.
             p.release();
+            GetMetrics().queued.Add();
         }
         else
         {
-            throw GetLastError();
+            DWORD dwError = GetLastError();
+            GetMetrics().waiting.Sub();
+            throw dwError;
         }
     }
 
 private:
 
+    // Process-wide metrics of the work items queued through this class
+    struct Metrics
+    {
+        CMetricCounter &queued = CMetrics::Default().Counter("libwinservice_threadpool_queued_total",
+            "Work items queued to the thread pool");
+        CMetricGauge &waiting = CMetrics::Default().Gauge("libwinservice_threadpool_waiting",
+            "Work items queued and not started yet");
+        CMetricGauge &running = CMetrics::Default().Gauge("libwinservice_threadpool_running",
+            "Work items running");
+        CMetricHistogram &wait = CMetrics::Default().Histogram("libwinservice_threadpool_wait_seconds",
+            "Time from queuing a work item to its start");
+        CMetricHistogram &run = CMetrics::Default().Histogram("libwinservice_threadpool_run_seconds",
+            "Time a work item ran");
+    };
+
+    static Metrics &GetMetrics()
+    {
+        static Metrics metrics;
+        return metrics;
+    }
+
     template <typename T>
     static DWORD WINAPI ThreadProc(PVOID context)
     {
-        typedef std::pair<void (T::*)(), T *> CallbackType;
+        typedef std::tuple<void (T::*)(), T *, uint64_t, std::chrono::steady_clock::time_point> CallbackType;
 
         std::unique_ptr<CallbackType> p(static_cast<CallbackType *>(context));
 
-        (p->second->*p->first)();
+        Metrics &metrics = GetMetrics();
+        auto start = std::chrono::steady_clock::now();
+        metrics.wait.Observe(std::chrono::duration<double>(start - std::get<3>(*p)).count());
+        metrics.waiting.Sub();
+        metrics.running.Add();
+
+        {
+            CTraceSpan span("work item", "pool", std::get<2>(*p), TRACE_FLOW_IN);
+            (std::get<1>(*p)->*std::get<0>(*p))();
+        }
+
+        metrics.running.Sub();
+        metrics.run.Observe(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
         return 0;
     }
 };
@@ -0,0 +1,18 @@
+#pragma once
+#include "libwinservice.h"
+
+#include <string_view>
+#include <vector>
+
+//
+//   FUNCTION: SplitFields(std::string_view, char, std::vector<std::string_view>&)
+//
+//   PURPOSE: Split a text message at every delimiter without copying it. The
+//   fields are views into text, so they are only valid while the message is.
+//   The vector is cleared rather than reallocated, so a vector reused between
+//   messages stops allocating once it has grown to the usual field count.
+//   Text with n delimiters always gives n + 1 fields, empty ones included.
+//   Delimiters are found 32 bytes at a time with AVX2 when the processor has
+//   it, 16 at a time with SSE2 otherwise, and one at a time on other targets.
+//
+size_t SplitFields(std::string_view text, char delimiter, std::vector<std::string_view>& fields);
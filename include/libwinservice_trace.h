@@ -0,0 +1,107 @@
+#pragma once
+#include "libwinservice.h"
+
+#include <string>
+#include <string_view>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+constexpr size_t TRACE_FLUSH = 64 * 1024;       // buffered bytes that trigger a write
+constexpr DWORD TRACE_FLUSH_INTERVAL = 1000;    // milliseconds after which the next event writes the buffer
+
+// How a span takes part in a flow, the arrows between spans in the viewer
+enum CTraceFlow {
+    TRACE_FLOW_NONE,
+    TRACE_FLOW_OUT,     // the flow starts at this span
+    TRACE_FLOW_IN,      // the flow ends at this span
+};
+
+//
+//   CLASS: CTracer
+//
+//   PURPOSE: Opt-in timeline of service controls, lifecycle operations,
+//   thread pool work items and IPC messages in the Chrome trace event
+//   format, which chrome://tracing and ui.perfetto.dev open directly.
+//
+//   Events are buffered and appended to the file as whole lines, and the
+//   closing bracket is left out as the format allows, so several processes
+//   can trace into the same file: a service and its children then show up
+//   as one timeline. Timestamps are wall clock microseconds so processes
+//   line up, and a message is linked from the sending to the receiving
+//   process through its sender id and frame sequence number.
+//
+//   While tracing is off each instrumentation point costs one atomic load.
+//
+class CTracer {
+    HANDLE file;
+    std::mutex mtx_trace;
+    std::atomic_bool tracing;
+    std::atomic_uint32_t session;   // tells thread names written to an earlier trace apart
+    std::atomic_uint32_t flows;
+    std::string buffer;
+    ULONGLONG flushed;              // tick count of the last write
+public:
+    CTracer();
+    virtual ~CTracer();
+
+    // The tracer the library instruments
+    static CTracer& Default();
+
+    // Start appending to a trace file, naming this process in the timeline.
+    // The opening bracket, when this call creates the file, and the process
+    // name are written before it returns, so a child started right after
+    // can trace into the same file.
+    bool Start(const std::string& path, const std::string& process = "");
+    void Stop();
+    bool IsTracing() const { return tracing.load(std::memory_order_relaxed); }
+
+    // A span that started and ended at these times, see Now
+    void Complete(std::string_view name, const char* category, uint64_t start, uint64_t end,
+                  uint64_t flow = 0, CTraceFlow direction = TRACE_FLOW_NONE);
+    void Instant(std::string_view name, const char* category);
+
+    // Name the calling thread in the timeline
+    void NameThread(const std::string& name);
+
+    // A flow id unique to this process, for spans linked within it
+    uint64_t NewFlow();
+    // The flow id of an IPC data frame, the same in the sending and the receiving process
+    static uint64_t MessageFlow(uint32_t sender, uint32_t sequence) {
+        return ((uint64_t)sender << 32) | (sequence & 0x7fffffff);
+    }
+
+    // Nanoseconds since 1970, comparable between processes
+    static uint64_t Now() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+    }
+
+private:
+    void Append(const std::string& event); // requires mtx_trace
+    bool Flush();                          // requires mtx_trace
+    void Escape(std::string& out, std::string_view text);
+    void Micros(std::string& event, uint64_t nanoseconds);
+    void Header(std::string& event, std::string_view name, const char* category, const char* phase, uint64_t time);
+};
+
+//
+//   CLASS: CTraceSpan
+//
+//   PURPOSE: Traces the scope it lives in as a span of the calling thread.
+//   The name must outlive the span.
+//
+class CTraceSpan {
+    std::string_view name;
+    const char* category;
+    uint64_t start, flow;
+    CTraceFlow direction;
+public:
+    CTraceSpan(std::string_view name, const char* category, uint64_t flow = 0, CTraceFlow direction = TRACE_FLOW_NONE):
+        name(name), category(category), start(CTracer::Default().IsTracing() ? CTracer::Now() : 0),
+        flow(flow), direction(direction) {}
+
+    ~CTraceSpan() {
+        if(start) CTracer::Default().Complete(name, category, start, CTracer::Now(), flow, direction);
+    }
+};
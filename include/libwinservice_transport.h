@@ -0,0 +1,155 @@
+#pragma once
+#include "libwinservice.h"
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <atomic>
+#include <memory>
+#include <cstdint>
+
+#define IPC_MAILSLOT_HEADER "\\\\.\\mailslot\\"
+#define IPC_TCP_SCHEME "tcp://"
+constexpr size_t BUFSIZE = 4096; // incoming cache size
+constexpr uint32_t IPC_TCP_MAX_FRAME = 16 * 1024 * 1024; // larger length prefixes drop the connection
+constexpr size_t IPC_TCP_SEND_BUFFER = 64 * 1024;         // messages framed per send
+constexpr DWORD IPC_TCP_CONNECT_TIMEOUT = 5000;           // ms a connect may stay in progress
+
+// Running counters kept by an IPCController and its transports
+struct IPCStats {
+    std::atomic_size_t messages_sent {0}, messages_received {0},
+                       bytes_sent {0}, bytes_received {0},
+                       write_calls {0}, read_calls {0}, // system calls issued by the transports
+                       wakeups {0},                     // reactor passes that moved data
+                       spin_hits {0}, spin_misses {0},  // WaitReceive spins that did / did not find a message
+                       throttled_dropped {0}, throttled_deferred {0}, throttled_flagged {0}, // inbox rate limit
+                       checksum_errors {0},             // frames dropped for a CRC32C mismatch
+                       decode_errors {0};               // frames dropped because the codec could not decode them
+};
+
+//
+//   CLASS: IPCInboxTransport
+//
+//   PURPOSE: The receiving end of an IPC connection. Read drains every
+//   message currently available in one pass so the reactor reaps messages in
+//   bulk rather than one per wakeup. On failure the transport returns false
+//   with the Win32 error available from GetLastError.
+//
+class IPCInboxTransport {
+public:
+    virtual ~IPCInboxTransport() = default;
+
+    virtual bool Open(const std::string& address, SECURITY_ATTRIBUTES* sa) = 0;
+    virtual void Close() = 0;
+    virtual bool Read(std::vector<std::string>& messages, IPCStats& stats) = 0;
+
+    // Signal this event when data arrives, for transports able to do so
+    virtual void Notify(HANDLE event) {}
+};
+
+//
+//   CLASS: IPCOutboxTransport
+//
+//   PURPOSE: The sending end of an IPC connection. Write submits a whole
+//   batch of queued messages per reactor wakeup, removing each message from
+//   the front of the batch once it has been handed to the system.
+//
+//   A stream transport may take a message it could only partly send; it
+//   reports it as Pending until a later Write finishes it, and gives it back
+//   with Requeue when it is replaced. Open may fail with WSAEWOULDBLOCK
+//   while a connection is still being made, and is called again to finish it.
+//
+class IPCOutboxTransport {
+public:
+    virtual ~IPCOutboxTransport() = default;
+
+    virtual bool Open(const std::string& address) = 0;
+    virtual void Close() = 0;
+    virtual bool Write(std::deque<std::string>& batch, IPCStats& stats) = 0;
+
+    virtual size_t Pending() const { return 0; }               // messages taken from the batch but not fully sent
+    virtual void Requeue(std::deque<std::string>& batch) {}    // put them back at the front of the batch
+    virtual bool Connecting() const { return false; }          // an Open is still in progress
+};
+
+// Mailslot inbox reading into a buffer that is allocated once and reused
+class MailslotInbox : public IPCInboxTransport {
+    HANDLE mailslot;
+    std::vector<char> buffer;
+public:
+    MailslotInbox();
+    virtual ~MailslotInbox();
+
+    bool Open(const std::string& address, SECURITY_ATTRIBUTES* sa) override;
+    void Close() override;
+    bool Read(std::vector<std::string>& messages, IPCStats& stats) override;
+};
+
+class MailslotOutbox : public IPCOutboxTransport {
+    HANDLE mailslot;
+public:
+    MailslotOutbox();
+    virtual ~MailslotOutbox();
+
+    bool Open(const std::string& address) override;
+    void Close() override;
+    bool Write(std::deque<std::string>& batch, IPCStats& stats) override;
+};
+
+//
+//   CLASS: TcpInbox / TcpOutbox
+//
+//   PURPOSE: Stream transport for children on other hosts, addressed as
+//   "tcp://host:port". Each message is framed by a 4 byte little-endian
+//   length prefix. The inbox listens and accepts any number of senders;
+//   the outbox disables Nagle and coalesces the messages of a reactor
+//   wakeup into as few sends as possible, so batching happens in the
+//   application rather than by delaying packets. The outbox never blocks
+//   the reactor: it connects in the background and keeps a frame the socket
+//   would only partly accept until a later pass.
+//
+class TcpInbox : public IPCInboxTransport {
+    struct Connection {
+        SOCKET socket;
+        std::string pending; // bytes of an incomplete frame
+    };
+
+    SOCKET listener;
+    std::vector<Connection> connections;
+    std::vector<char> buffer;
+    HANDLE notify;
+public:
+    TcpInbox();
+    virtual ~TcpInbox();
+
+    bool Open(const std::string& address, SECURITY_ATTRIBUTES* sa) override;
+    void Close() override;
+    bool Read(std::vector<std::string>& messages, IPCStats& stats) override;
+    void Notify(HANDLE event) override;
+};
+
+class TcpOutbox : public IPCOutboxTransport {
+    SOCKET connection;
+    std::string connect_address;    // address of a connect in progress
+    ULONGLONG connect_started;
+    std::string partial;            // frame that has started going out, finished before any other
+    size_t partial_sent;
+    std::string buffer;             // frames of the current send, reused
+
+    bool Send(const char* data, size_t size, size_t& sent, IPCStats& stats);
+public:
+    TcpOutbox();
+    virtual ~TcpOutbox();
+
+    bool Open(const std::string& address) override;
+    void Close() override;
+    bool Write(std::deque<std::string>& batch, IPCStats& stats) override;
+
+    size_t Pending() const override { return partial.empty() ? 0 : 1; }
+    void Requeue(std::deque<std::string>& batch) override;
+    bool Connecting() const override { return !connect_address.empty(); }
+};
+
+// Create the transport able to serve an address
+std::unique_ptr<IPCInboxTransport> CreateInboxTransport(const std::string& address);
+std::unique_ptr<IPCOutboxTransport> CreateOutboxTransport(const std::string& address);
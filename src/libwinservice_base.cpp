@@ -1,8 +1,8 @@
 #include "libwinservice.h"
 #include <strsafe.h>
 
-// Initialize the singleton service instance.
-CServiceBase *CServiceBase::s_service = NULL;
+// Initialize the table of hosted services.
+std::vector<CServiceBase*> CServiceBase::s_services;
 
 
 //
@@ -15,39 +15,104 @@ CServiceBase *CServiceBase::s_service = NULL;
 //
 //   PARAMETERS:
 //   * service - the reference to a CServiceBase object. It will become the
-//     singleton service instance of this service application.
+//     only service hosted by this service application.
+//   * dispatcher - the control manager to run under, the SCM by default
 //
 //   RETURN VALUE: If the function succeeds, the return value is TRUE. If the
 //   function fails, the return value is FALSE. To get extended error
 //   information, call GetLastError.
 //
-BOOL CServiceBase::Run(CServiceBase &service, DWORD &errorCode)
+BOOL CServiceBase::Run(CServiceBase &service, DWORD &errorCode,
+    CServiceDispatcher &dispatcher)
 {
-    s_service = &service;
+    return Run(std::vector<CServiceBase*> { &service }, errorCode, dispatcher);
+}
+
 
-    SERVICE_TABLE_ENTRY serviceTable[] =
+//
+//   FUNCTION: CServiceBase::Run(const std::vector<CServiceBase*> &)
+//
+//   PURPOSE: Register several services implemented by this executable with
+//   the SCM in a single dispatcher table. The SCM starts each service on its
+//   own thread and routes controls to it through its own handler context.
+//   This method blocks until all of the services have stopped.
+//
+//   PARAMETERS:
+//   * services - the CServiceBase objects hosted by this process. When more
+//     than one is given they report SERVICE_WIN32_SHARE_PROCESS, and should
+//     be installed with that service type.
+//   * dispatcher - the control manager to run under, the SCM by default
+//
+//   RETURN VALUE: If the function succeeds, the return value is TRUE. If the
+//   function fails, the return value is FALSE. To get extended error
+//   information, call GetLastError.
+//
+BOOL CServiceBase::Run(const std::vector<CServiceBase*> &services, DWORD &errorCode,
+    CServiceDispatcher &dispatcher)
+{
+    if (services.empty())
     {
-        { (LPSTR)service.m_name, &ServiceMain },
-        { NULL, NULL }
-    };
+        errorCode = ERROR_INVALID_PARAMETER;
+        SetLastError(errorCode);
+        return FALSE;
+    }
 
-    service.WriteEventLogEntry("Service Attempting To Start", EVENTLOG_INFORMATION_TYPE);
+    s_services = services;
+
+    std::vector<SERVICE_TABLE_ENTRY> serviceTable;
+    for (CServiceBase *service : s_services)
+    {
+        if (s_services.size() > 1) service->m_status.dwServiceType = SERVICE_WIN32_SHARE_PROCESS;
+        service->m_dispatcher = &dispatcher;
+        serviceTable.push_back({ (LPSTR)service->m_name, &ServiceMain });
+
+        service->WriteEventLogEntry("Service Attempting To Start", EVENTLOG_INFORMATION_TYPE);
+    }
+    serviceTable.push_back({ NULL, NULL });
 
     // Connects the main thread of a service process to the service control
     // manager, which causes the thread to be the service control dispatcher
-    // thread for the calling process. This call returns when the service has
-    // stopped. The process should simply terminate when the call returns.
-    auto r = StartServiceCtrlDispatcher(serviceTable);
-    if(!r) errorCode = service.WriteErrorLogEntry("Service Failed To Start");
+    // thread for the calling process. This call returns when every service
+    // has stopped. The process should simply terminate when the call returns.
+    auto r = dispatcher.StartDispatcher(serviceTable.data());
+    if(!r) errorCode = s_services.front()->WriteErrorLogEntry("Service Failed To Start");
+
+    // The lifecycle threads report SERVICE_STOPPED as their last act, let
+    // them finish before the services can be destroyed.
+    for (CServiceBase *service : s_services)
+    {
+        if (service->m_lifecycleThread.joinable()) service->m_lifecycleThread.join();
+        if (service->m_heartbeatThread.joinable()) service->m_heartbeatThread.join();
+    }
     return r;
 }
 
 
+//
+//   FUNCTION: CServiceBase::FindService(const char *)
+//
+//   PURPOSE: Find the hosted service with the given name. A process hosting
+//   a single service always returns it, whatever name it was started as.
+//
+CServiceBase *CServiceBase::FindService(const char* pszServiceName)
+{
+    if (s_services.size() == 1) return s_services.front();
+
+    for (CServiceBase *service : s_services)
+    {
+        if (pszServiceName != NULL && lstrcmpi(service->m_name, pszServiceName) == 0) return service;
+    }
+    return NULL;
+}
+
+
 //
 //   FUNCTION: CServiceBase::ServiceMain(DWORD, PWSTR *)
 //
 //   PURPOSE: Entry point for the service. It registers the handler function
-//   for the service and starts the service.
+//   for the service and starts the service on its lifecycle thread, which
+//   then runs the controls the handler queues. The SCM passes the name of
+//   the service being started as the first argument.
 //
 //   PARAMETERS:
 //   * dwArgc   - number of command line arguments
@@ -55,25 +120,50 @@ BOOL CServiceBase::Run(CServiceBase &service, DWORD &errorCode)
 //
 void WINAPI CServiceBase::ServiceMain(DWORD dwArgc, char **pszArgv)
 {
-    assert(s_service != NULL);
+    CServiceBase *service = FindService(dwArgc > 0 ? pszArgv[0] : NULL);
+    assert(service != NULL);
+
+    // A service started again in a shared process still holds the threads of
+    // its last run. They end once it has reported SERVICE_STOPPED, and must be
+    // joined before their std::thread objects are reused.
+    if (service->m_lifecycleThread.joinable()) service->m_lifecycleThread.join();
+    if (service->m_heartbeatThread.joinable()) service->m_heartbeatThread.join();
+
+    // Register the handler function for the service, with the service as its context
+    service->m_statusHandle = service->m_dispatcher->RegisterHandler(service->m_name, &ServiceCtrlHandler, service);
+    if (service->m_statusHandle == NULL)
+    {
+        throw service->WriteErrorLogEntry("RegisterServiceCtrlHandlerEx");
+    }
 
-    // Register the handler function for the service
-    s_service->m_statusHandle = RegisterServiceCtrlHandler((LPCSTR)s_service->m_name, &ServiceCtrlHandler);
-    if (s_service->m_statusHandle == NULL)
+    // The arguments are copied, they only live as long as this call.
+    service->m_args.assign(pszArgv, pszArgv + dwArgc);
     {
-        throw s_service->WriteErrorLogEntry("RegisterServiceCtrlHandler");
+        std::lock_guard<std::mutex> lock(service->m_statusLock);
+        service->m_status.dwCurrentState = SERVICE_START_PENDING;
+        service->m_transitionMetrics[SERVICE_START_PENDING]->Add(); // Start reports no change
+    }
+    {
+        std::lock_guard<std::mutex> lock(service->m_controlLock);
+        service->m_controls.clear();
+        service->m_stopped = false;
     }
 
     // Start the service.
-    s_service->Start(dwArgc, (PWSTR*)pszArgv);
+    service->m_heartbeatThread = std::thread(&CServiceBase::HeartbeatThread, service);
+    service->m_lifecycleThread = std::thread(&CServiceBase::LifecycleThread, service);
 }
 
 
 //
-//   FUNCTION: CServiceBase::ServiceCtrlHandler(DWORD)
+//   FUNCTION: CServiceBase::ServiceCtrlHandler(DWORD, DWORD, LPVOID, LPVOID)
 //
 //   PURPOSE: The function is called by the SCM whenever a control code is
-//   sent to the service.
+//   sent to the service. Lifecycle controls are queued for the lifecycle
+//   thread and the function returns at once, so a long OnStop never keeps
+//   the dispatcher from answering other controls. A parameter change runs
+//   OnParamChange on the thread pool, and user-defined control codes go to
+//   the handlers registered with SetControlHandler.
 //
 //   PARAMETERS:
 //   * dwCtrlCode - the control code. This parameter can be one of the
@@ -91,27 +181,212 @@ void WINAPI CServiceBase::ServiceMain(DWORD dwArgc, char **pszArgv)
 //
 //   This parameter can also be a user-defined control code ranges from 128
 //   to 255.
+//   * dwEventType - the type of event for device, power and session controls
+//   * lpEventData - additional data for device, power and session controls
+//   * lpContext - the CServiceBase passed to RegisterServiceCtrlHandlerEx
+//
+//   RETURN VALUE: NO_ERROR for handled controls, ERROR_CALL_NOT_IMPLEMENTED
+//   for controls the service does not handle.
 //
-void WINAPI CServiceBase::ServiceCtrlHandler(DWORD dwCtrl)
+DWORD WINAPI CServiceBase::ServiceCtrlHandler(DWORD dwCtrl, DWORD dwEventType,
+    LPVOID lpEventData, LPVOID lpContext)
 {
+    CServiceBase *service = (CServiceBase*)lpContext;
+    CFlightRecorder::Default().Record(FLIGHT_CONTROL, service->m_flightSource, dwCtrl, dwEventType);
+
+    // While tracing, the control is linked to where the lifecycle thread runs it.
+    CTracer &tracer = CTracer::Default();
+    uint64_t flow = tracer.IsTracing() ? tracer.NewFlow() : 0;
+    CTraceSpan span(FlightControlName(dwCtrl), "control", flow, TRACE_FLOW_OUT);
+
     switch (dwCtrl)
     {
     case SERVICE_CONTROL_STOP:
-        if(s_service->service_log) s_service->WriteEventLogEntry("Attempting To Stop Service", EVENTLOG_INFORMATION_TYPE);
-        s_service->Stop(); break;
     case SERVICE_CONTROL_PAUSE:
-        if(s_service->service_log) s_service->WriteEventLogEntry("Attempting To Pause Service", EVENTLOG_INFORMATION_TYPE);
-        s_service->Pause(); break;
     case SERVICE_CONTROL_CONTINUE:
-        if(s_service->service_log) s_service->WriteEventLogEntry("Attempting To Continue Service", EVENTLOG_INFORMATION_TYPE);
-        s_service->Continue(); break;
     case SERVICE_CONTROL_SHUTDOWN:
-        if(s_service->service_log) s_service->WriteEventLogEntry("Attempting To Shutdown Service", EVENTLOG_INFORMATION_TYPE);
-        s_service->Shutdown(); break;
+    case SERVICE_CONTROL_PRESHUTDOWN:
+        service->QueueControl(dwCtrl, flow); break;
     case SERVICE_CONTROL_INTERROGATE:
-        if(s_service->service_log) s_service->WriteEventLogEntry("Cannot Interrogate Service Because There Is Not Control For This", EVENTLOG_WARNING_TYPE);
+        break; // the SCM already holds the last reported status
+    case SERVICE_CONTROL_PARAMCHANGE:
+        // Changes that arrive while a reload is queued are read by that reload.
+        if (service->m_paramChangePending.exchange(true)) break;
+        try
+        {
+            CThreadPool::QueueUserWorkItem(&CServiceBase::ParamChange, service);
+        }
+        catch (DWORD dwError)
+        {
+            service->m_paramChangePending = false;
+            return dwError;
+        }
         break;
-    default: break;
+    default:
+        if (dwCtrl >= 128 && dwCtrl <= 255)
+        {
+            ControlHandler handler;
+            {
+                std::lock_guard<std::mutex> lock(service->m_handlerLock);
+                auto found = service->m_handlers.find(dwCtrl);
+                if (found != service->m_handlers.end()) handler = found->second;
+            }
+            if (handler)
+            {
+                try
+                {
+                    return handler(dwEventType, lpEventData);
+                }
+                catch (DWORD dwError)
+                {
+                    return service->WriteErrorLogEntry("Control handler", dwError);
+                }
+                catch (...)
+                {
+                    // Nothing may unwind into the SCM's dispatcher thread.
+                    service->WriteEventLogEntry("Service control handler failed", EVENTLOG_ERROR_TYPE);
+                    return ERROR_EXCEPTION_IN_SERVICE;
+                }
+            }
+        }
+        return ERROR_CALL_NOT_IMPLEMENTED;
+    }
+    return NO_ERROR;
+}
+
+
+//
+//   FUNCTION: CServiceBase::QueueControl(DWORD, uint64_t)
+//
+//   PURPOSE: Queue a lifecycle control for the lifecycle thread. Controls
+//   that have not started yet are merged where the outcome is the same:
+//
+//     a stop drops every queued pause and continue
+//     a shutdown or preshutdown also drops a queued stop
+//     a pause and a continue cancel each other out
+//     a control already queued, or following a queued stop, is dropped
+//
+//   PARAMETERS:
+//   * dwCtrl - SERVICE_CONTROL_STOP, _PAUSE, _CONTINUE, _SHUTDOWN or
+//     _PRESHUTDOWN
+//   * flow - the trace flow of the control, 0 when not tracing
+//
+void CServiceBase::QueueControl(DWORD dwCtrl, uint64_t flow)
+{
+    auto stopping = [](DWORD dwQueued)
+    {
+        return dwQueued == SERVICE_CONTROL_STOP || dwQueued == SERVICE_CONTROL_SHUTDOWN ||
+            dwQueued == SERVICE_CONTROL_PRESHUTDOWN;
+    };
+
+    {
+        std::lock_guard<std::mutex> lock(m_controlLock);
+        if (m_stopped) return;
+
+        if (stopping(dwCtrl))
+        {
+            m_controls.erase(std::remove_if(m_controls.begin(), m_controls.end(),
+                [&](const QueuedControl &queued) { return !stopping(queued.dwCtrl) || dwCtrl != SERVICE_CONTROL_STOP; }),
+                m_controls.end());
+            if (!m_controls.empty()) return;
+        }
+        else if (!m_controls.empty())
+        {
+            // The queue holds a stop, the same control, or the opposite one.
+            if (!stopping(m_controls.back().dwCtrl) && m_controls.back().dwCtrl != dwCtrl) m_controls.pop_back();
+            return;
+        }
+        m_controls.push_back({ dwCtrl, flow, std::chrono::steady_clock::now() });
+    }
+    m_controlQueued.notify_one();
+}
+
+
+//
+//   FUNCTION: CServiceBase::LifecycleThread()
+//
+//   PURPOSE: Start the service, then run the controls queued by
+//   ServiceCtrlHandler one at a time until the service reports that it has
+//   stopped.
+//
+void CServiceBase::LifecycleThread()
+{
+    CTracer::Default().NameThread(std::string(m_name) + " lifecycle");
+
+    std::vector<char*> argv;
+    for (std::string &arg : m_args) argv.push_back(arg.data());
+    {
+        CTraceSpan span("start", "lifecycle");
+        Start((DWORD)argv.size(), (PWSTR*)argv.data());
+    }
+
+    for (;;)
+    {
+        QueuedControl control;
+        {
+            std::unique_lock<std::mutex> lock(m_controlLock);
+            m_controlQueued.wait(lock, [this]() { return m_stopped || !m_controls.empty(); });
+            if (m_stopped) break;
+
+            control = m_controls.front();
+            m_controls.pop_front();
+        }
+
+        CTraceSpan span(FlightControlName(control.dwCtrl), "lifecycle", control.flow, TRACE_FLOW_IN);
+        switch (control.dwCtrl)
+        {
+        case SERVICE_CONTROL_STOP:
+            WriteEventLogEntry("Attempting To Stop Service", EVENTLOG_INFORMATION_TYPE);
+            Stop(); break;
+        case SERVICE_CONTROL_PAUSE:
+            WriteEventLogEntry("Attempting To Pause Service", EVENTLOG_INFORMATION_TYPE);
+            Pause(); break;
+        case SERVICE_CONTROL_CONTINUE:
+            WriteEventLogEntry("Attempting To Continue Service", EVENTLOG_INFORMATION_TYPE);
+            Continue(); break;
+        case SERVICE_CONTROL_SHUTDOWN:
+            WriteEventLogEntry("Attempting To Shutdown Service", EVENTLOG_INFORMATION_TYPE);
+            Shutdown(); break;
+        case SERVICE_CONTROL_PRESHUTDOWN:
+            WriteEventLogEntry("Attempting To Drain Service Before Shutdown", EVENTLOG_INFORMATION_TYPE);
+            Preshutdown(); break;
+        }
+        m_controlMetric->Observe(std::chrono::duration<double>(std::chrono::steady_clock::now() - control.received).count());
+    }
+}
+
+
+//
+//   FUNCTION: CServiceBase::HeartbeatThread()
+//
+//   PURPOSE: While the service is in a pending state, report it again with
+//   the next checkpoint whenever the heartbeat interval passes without a
+//   report, so the SCM sees progress during a long operation.
+//
+void CServiceBase::HeartbeatThread()
+{
+    std::unique_lock<std::mutex> lock(m_statusLock);
+    while (m_status.dwCurrentState != SERVICE_STOPPED)
+    {
+        if (m_heartbeat == 0)
+        {
+            m_statusChanged.wait(lock);
+            continue;
+        }
+
+        if (m_statusChanged.wait_for(lock, std::chrono::milliseconds(m_heartbeat)) == std::cv_status::timeout)
+        {
+            switch (m_status.dwCurrentState)
+            {
+            case SERVICE_START_PENDING:
+            case SERVICE_STOP_PENDING:
+            case SERVICE_PAUSE_PENDING:
+            case SERVICE_CONTINUE_PENDING:
+                m_status.dwCheckPoint = m_checkPoint++;
+                ReportStatus();
+                break;
+            }
+        }
     }
 }
 
@@ -136,8 +411,38 @@ CServiceBase::CServiceBase(const char* pszServiceName, DWORD dwControlsAccepted)
 
     service_log = false; // logging disabled by default
 
+    m_flightSource = CFlightRecorder::Default().Source(m_name);
+
+    m_dumpOnStop = false;
+
+    m_paramChangePending = false;
+
+    // Services with the same name share their metrics, e.g. when one is restarted.
+    CMetrics &metrics = CMetrics::Default();
+    std::string label = CMetrics::Label("service", m_name);
+    m_stateMetric = &metrics.Gauge("libwinservice_service_state",
+        "Last state reported, as a SERVICE_* value", label);
+    m_controlMetric = &metrics.Histogram("libwinservice_service_control_seconds",
+        "Time from receiving a lifecycle control to completing it", label);
+    m_transitionMetrics[0] = NULL;
+    for (DWORD dwState = SERVICE_STOPPED; dwState <= SERVICE_PAUSED; dwState++)
+    {
+        m_transitionMetrics[dwState] = &metrics.Counter("libwinservice_service_transitions_total",
+            "State changes reported", label + "," + CMetrics::Label("state", FlightStateName(dwState)));
+    }
+
     m_statusHandle = NULL;
 
+    m_checkPoint = 1;
+
+    m_dispatcher = &CServiceDispatcher::Default();
+
+    m_stopped = false;
+
+    m_heartbeat = 1000;
+
+    m_preshutdownBudget = 10000;
+
     // The service runs in its own process.
     m_status.dwServiceType = SERVICE_WIN32_OWN_PROCESS;
 
@@ -164,16 +469,185 @@ CServiceBase::~CServiceBase(void)
 }
 
 //
-//   FUNCTION: CServiceBase::EnableLogging(BOOL)
+//   FUNCTION: CServiceBase::EnableLogging(BOOL, std::unique_ptr<CEventLogBackend>)
 //
-//   PURPOSE: The function enables or disables the service event log
+//   PURPOSE: The function enables or disables the service event log. The
+//   event source is registered once here rather than for every entry.
 //
 //   PARAMETERS:
 //   * enabled   - enabled or disabled logging
+//   * backend   - where entries are written, the Application event log if NULL
+//
+void CServiceBase::EnableLogging(bool enabled, std::unique_ptr<CEventLogBackend> backend)
+{
+    service_log = false;
+    m_eventLog.Close();
+
+    if (enabled)
+    {
+        if (!m_eventLog.Open(m_name, std::move(backend)))
+        {
+            std::cout << "Error Writing To Event Log" << std::endl;
+            return;
+        }
+        service_log = true;
+    }
+}
+
+//
+//   FUNCTION: CServiceBase::EnableFlightDump(const std::string &, DWORD)
+//
+//   PURPOSE: The function has the flight recorder, which always records the
+//   controls, states and errors of the service, written to a file when the
+//   service stops or the process crashes, and on demand through a control
+//   code. Decode the file with tools/flight_decode.
+//
+//   PARAMETERS:
+//   * path - the dump file, overwritten by each dump
+//   * dwControl - a user-defined control code from 128 to 255 that dumps
+//     the recorder, or 0 for none
+//
+void CServiceBase::EnableFlightDump(const std::string &path, DWORD dwControl)
+{
+    CFlightRecorder::Default().SetDumpPath(path);
+    CFlightRecorder::Default().DumpOnCrash();
+
+    m_dumpOnStop = true;
+    if (dwControl >= 128 && dwControl <= 255)
+    {
+        SetControlHandler(dwControl, [this](DWORD, LPVOID) -> DWORD
+        {
+            CThreadPool::QueueUserWorkItem(&CServiceBase::DumpFlightRecorder, this);
+            return NO_ERROR;
+        });
+    }
+}
+
+//
+//   FUNCTION: CServiceBase::DumpFlightRecorder()
+//
+//   PURPOSE: Dump the flight recorder for the dump control code. It runs on
+//   the thread pool so the control handler returns without waiting on disk.
+//
+void CServiceBase::DumpFlightRecorder()
+{
+    if (!CFlightRecorder::Default().Dump(FLIGHT_DUMP_CONTROL))
+    {
+        WriteErrorLogEntry("Flight recorder dump");
+    }
+}
+
+//
+//   FUNCTION: CServiceBase::SetPreshutdownBudget(DWORD)
+//
+//   PURPOSE: Set the time the preshutdown drain may take. The SCM waits for
+//   the service to stop for the preshutdown timeout it was installed with,
+//   see InstallService; the budget should leave some of it to spare.
+//
+//   PARAMETERS:
+//   * dwBudget - the budget in milliseconds
 //
-void CServiceBase::EnableLogging(bool enabled)
+void CServiceBase::SetPreshutdownBudget(DWORD dwBudget)
 {
-    service_log = enabled;
+    m_preshutdownBudget = dwBudget;
+}
+
+//
+//   FUNCTION: CServiceBase::AddShutdownStep(const std::string &, Step, int)
+//
+//   PURPOSE: Declare a step of the preshutdown drain. Steps stay declared
+//   for the life of the service, so declare them once, e.g. when setting
+//   the service up, or from OnPreshutdown.
+//
+//   PARAMETERS:
+//   * name - the name of the step, logged if it fails or is abandoned
+//   * step - the work to do, bounding its waits by the deadline it is given
+//     and throwing a DWORD error code on failure
+//   * priority - steps with a lower priority run first, see CShutdownPriority
+//
+void CServiceBase::AddShutdownStep(const std::string &name, CShutdownDrain::Step step, int priority)
+{
+    m_drain.Add(name, std::move(step), priority);
+}
+
+//
+//   FUNCTION: CServiceBase::SetControlHandler(DWORD, ControlHandler)
+//
+//   PURPOSE: Register the handler of a user-defined control code. The
+//   handler is called on the dispatcher thread, like ServiceCtrlHandler, and
+//   may throw a DWORD error code, which is logged and returned to the sender.
+//
+//   PARAMETERS:
+//   * dwControl - the control code, from 128 to 255
+//   * handler - returns NO_ERROR or an error code for the sender, or is
+//     empty to stop handling the code
+//
+void CServiceBase::SetControlHandler(DWORD dwControl, ControlHandler handler)
+{
+    if (dwControl < 128 || dwControl > 255)
+    {
+        throw DWORD(ERROR_INVALID_PARAMETER);
+    }
+
+    std::lock_guard<std::mutex> lock(m_handlerLock);
+    if (handler) m_handlers[dwControl] = std::move(handler);
+    else m_handlers.erase(dwControl);
+}
+
+//
+//   FUNCTION: CServiceBase::ParamChange()
+//
+//   PURPOSE: Run OnParamChange for SERVICE_CONTROL_PARAMCHANGE. The pending
+//   flag is cleared first, so a change made while OnParamChange reads the
+//   parameters queues another run. An error is logged and the service keeps
+//   running with what it had.
+//
+void CServiceBase::ParamChange()
+{
+    std::lock_guard<std::mutex> lock(m_paramChangeLock);
+    m_paramChangePending = false;
+    try
+    {
+        CTraceSpan span("OnParamChange", "service");
+        OnParamChange();
+    }
+    catch (DWORD dwError)
+    {
+        WriteErrorLogEntry("Service Parameter Change", dwError);
+    }
+    catch (...)
+    {
+        WriteEventLogEntry("Service failed to change parameters", EVENTLOG_ERROR_TYPE);
+    }
+}
+
+//
+//   FUNCTION: CServiceBase::OnParamChange()
+//
+//   PURPOSE: When implemented in a derived class, executes when the SCM
+//   reports that the startup parameters of the service changed. Reload the
+//   configuration here; the service is not stopped.
+//
+void CServiceBase::OnParamChange()
+{
+}
+
+//
+//   FUNCTION: CServiceBase::SetHeartbeat(DWORD)
+//
+//   PURPOSE: Set how often a pending state is reported again while the
+//   service is starting, stopping, pausing or continuing.
+//
+//   PARAMETERS:
+//   * dwInterval - interval in milliseconds, 0 disables the heartbeat
+//
+void CServiceBase::SetHeartbeat(DWORD dwInterval)
+{
+    {
+        std::lock_guard<std::mutex> lock(m_statusLock);
+        m_heartbeat = dwInterval;
+    }
+    m_statusChanged.notify_all();
 }
 
 //
@@ -181,8 +655,11 @@ void CServiceBase::EnableLogging(bool enabled)
 //
 //   PURPOSE: The function starts the service. It calls the OnStart virtual
 //   function in which you can specify the actions to take when the service
-//   starts. If an error occurs during the startup, the error will be logged
-//   in the Application event log, and the service will be stopped.
+//   starts, then runs the startup tasks it declared. The wait hint follows
+//   the estimated time left on the longest chain of unfinished tasks, with
+//   a new checkpoint each time a task completes. If an error occurs during
+//   the startup, the error will be logged in the Application event log, and
+//   the service will be stopped.
 //
 //   PARAMETERS:
 //   * dwArgc   - number of command line arguments
@@ -196,13 +673,30 @@ void CServiceBase::Start(DWORD dwArgc, PWSTR *pszArgv)
         SetServiceStatus(SERVICE_START_PENDING, NOERROR, 4000);
 
         // Perform service-specific initialization.
-        OnStart(dwArgc, pszArgv);
+        {
+            CTraceSpan span("OnStart", "service");
+            OnStart(dwArgc, pszArgv);
+        }
+
+        // Run the startup tasks declared by OnStart, in parallel where possible.
+        if (!m_startup.Empty())
+        {
+            CTraceSpan span("startup tasks", "service");
+            SetServiceStatus(SERVICE_START_PENDING, NOERROR, m_startup.Estimate() + 4000);
+            m_startup.Run([this](const CStartupGraph::Progress &progress)
+            {
+                SetServiceStatus(SERVICE_START_PENDING, NOERROR, progress.remaining + 4000);
+            });
+            m_startup.Clear();
+        }
 
         // Tell SCM that the service is started.
         SetServiceStatus(SERVICE_RUNNING);
     }
     catch (DWORD dwError)
     {
+        m_startup.Clear();
+
         // Log the error.
         WriteErrorLogEntry("Service Start", dwError);
 
@@ -211,6 +705,8 @@ void CServiceBase::Start(DWORD dwArgc, PWSTR *pszArgv)
     }
     catch (...)
     {
+        m_startup.Clear();
+
         // Log the error.
         WriteEventLogEntry("Service failed to start", EVENTLOG_ERROR_TYPE);
 
@@ -240,6 +736,29 @@ void CServiceBase::OnStart(DWORD dwArgc, PWSTR *pszArgv)
 }
 
 
+//
+//   FUNCTION: CServiceBase::AddStartupTask(const std::string &, Task, ...)
+//
+//   PURPOSE: Declare a startup task. Call it from OnStart; the tasks run once
+//   OnStart returns and are forgotten when startup ends, so a restarted
+//   service declares them again. A task cannot declare further tasks; the
+//   call throws ERROR_BUSY once the tasks are running.
+//
+//   PARAMETERS:
+//   * name - the name of the task
+//   * task - the work to do, throwing a DWORD error code on failure
+//   * after - ids of the tasks that must complete first
+//   * dwEstimate - expected duration in milliseconds, for the wait hint
+//
+//   RETURN VALUE: The id of the task, to name it as a dependency.
+//
+size_t CServiceBase::AddStartupTask(const std::string &name, CStartupGraph::Task task,
+    const std::vector<size_t> &after, DWORD dwEstimate)
+{
+    return m_startup.Add(name, std::move(task), after, dwEstimate);
+}
+
+
 //
 //   FUNCTION: CServiceBase::Stop()
 //
@@ -250,14 +769,21 @@ void CServiceBase::OnStart(DWORD dwArgc, PWSTR *pszArgv)
 //
 void CServiceBase::Stop()
 {
-    DWORD dwOriginalState = m_status.dwCurrentState;
+    DWORD dwOriginalState;
+    {
+        std::lock_guard<std::mutex> lock(m_statusLock); // the heartbeat thread reports under it
+        dwOriginalState = m_status.dwCurrentState;
+    }
     try
     {
-        // Tell SCM that the service is stopping.
-        SetServiceStatus(SERVICE_STOP_PENDING);
+        // Tell SCM that the service is stopping and should take no more than 4 seconds.
+        SetServiceStatus(SERVICE_STOP_PENDING, NOERROR, 4000);
 
         // Perform service-specific stop operations.
-        OnStop();
+        {
+            CTraceSpan span("OnStop", "service");
+            OnStop();
+        }
 
         // Tell SCM that the service is stopped.
         SetServiceStatus(SERVICE_STOPPED);
@@ -308,11 +834,14 @@ void CServiceBase::Pause()
 {
     try
     {
-        // Tell SCM that the service is pausing.
-        SetServiceStatus(SERVICE_PAUSE_PENDING);
+        // Tell SCM that the service is pausing and should take no more than 4 seconds.
+        SetServiceStatus(SERVICE_PAUSE_PENDING, NOERROR, 4000);
 
         // Perform service-specific pause operations.
-        OnPause();
+        {
+            CTraceSpan span("OnPause", "service");
+            OnPause();
+        }
 
         // Tell SCM that the service is paused.
         SetServiceStatus(SERVICE_PAUSED);
@@ -361,11 +890,14 @@ void CServiceBase::Continue()
 {
     try
     {
-        // Tell SCM that the service is resuming.
-        SetServiceStatus(SERVICE_CONTINUE_PENDING);
+        // Tell SCM that the service is resuming and should take no more than 4 seconds.
+        SetServiceStatus(SERVICE_CONTINUE_PENDING, NOERROR, 4000);
 
         // Perform service-specific continue operations.
-        OnContinue();
+        {
+            CTraceSpan span("OnContinue", "service");
+            OnContinue();
+        }
 
         // Tell SCM that the service is running.
         SetServiceStatus(SERVICE_RUNNING);
@@ -414,7 +946,10 @@ void CServiceBase::Shutdown()
     try
     {
         // Perform service-specific shutdown operations.
-        OnShutdown();
+        {
+            CTraceSpan span("OnShutdown", "service");
+            OnShutdown();
+        }
 
         // Tell SCM that the service is stopped.
         SetServiceStatus(SERVICE_STOPPED);
@@ -443,11 +978,89 @@ void CServiceBase::OnShutdown()
 {
 }
 
+
+//
+//   FUNCTION: CServiceBase::Preshutdown()
+//
+//   PURPOSE: The function drains the service before the system shuts down.
+//   It calls the OnPreshutdown virtual function, then runs the shutdown
+//   steps in priority order within what is left of the budget, reporting a
+//   new checkpoint as each step starts. Steps that fail or are abandoned
+//   when the budget runs out are logged, and the service reports that it
+//   has stopped either way, since the system is going down.
+//
+void CServiceBase::Preshutdown()
+{
+    DWORD dwError = NO_ERROR;
+    try
+    {
+        auto started = std::chrono::steady_clock::now();
+
+        // Tell SCM that the service is stopping and should take no longer than the budget.
+        SetServiceStatus(SERVICE_STOP_PENDING, NOERROR, m_preshutdownBudget);
+
+        // Perform service-specific preshutdown operations.
+        {
+            CTraceSpan span("OnPreshutdown", "service");
+            OnPreshutdown();
+        }
+
+        // Run the shutdown steps in what is left of the budget.
+        DWORD dwElapsed = (DWORD)std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - started).count();
+        CShutdownDrain::Result result;
+        {
+            CTraceSpan span("shutdown steps", "service");
+            result = m_drain.Run(dwElapsed < m_preshutdownBudget ? m_preshutdownBudget - dwElapsed : 0,
+                [this](const CShutdownDrain::Progress &progress)
+            {
+                SetServiceStatus(SERVICE_STOP_PENDING, NOERROR, progress.remaining);
+            });
+        }
+
+        for (const auto &[step, dwStepError] : result.failed)
+        {
+            WriteErrorLogEntry(("Shutdown step " + step).c_str(), dwStepError);
+        }
+        for (const std::string &step : result.abandoned)
+        {
+            WriteErrorLogEntry(("Shutdown step " + step).c_str(), ERROR_TIMEOUT);
+        }
+    }
+    catch (DWORD dwThrown)
+    {
+        // Log the error.
+        dwError = WriteErrorLogEntry("Service Preshutdown", dwThrown);
+    }
+    catch (...)
+    {
+        // Log the error.
+        WriteEventLogEntry("Service failed to drain before shutdown", EVENTLOG_ERROR_TYPE);
+    }
+
+    // Tell SCM that the service is stopped.
+    SetServiceStatus(SERVICE_STOPPED, dwError);
+}
+
+
+//
+//   FUNCTION: CServiceBase::OnPreshutdown()
+//
+//   PURPOSE: When implemented in a derived class, executes when the system
+//   is about to shut down and the service accepts preshutdown
+//   notifications. The shutdown steps run once it returns.
+//
+void CServiceBase::OnPreshutdown()
+{
+}
+
 //
 //   FUNCTION: CServiceBase::SetServiceStatus(DWORD, DWORD, DWORD)
 //
 //   PURPOSE: The function sets the service status and reports the status to
-//   the SCM.
+//   the SCM. It may be called from any thread. Reporting SERVICE_STOPPED
+//   ends the lifecycle thread, after the flight recorder is dumped if
+//   EnableFlightDump asked for it.
 //
 //   PARAMETERS:
 //   * dwCurrentState - the state of the service
@@ -458,27 +1071,70 @@ void CServiceBase::SetServiceStatus(DWORD dwCurrentState,
                                     DWORD dwWin32ExitCode,
                                     DWORD dwWaitHint)
 {
-    static DWORD dwCheckPoint = 1;
+    CFlightRecorder::Default().Record(FLIGHT_STATE, m_flightSource, dwCurrentState, dwWin32ExitCode);
+    CTracer::Default().Instant(FlightStateName(dwCurrentState), "status");
+
+    // Dump before SERVICE_STOPPED is reported, the process may exit right after.
+    if (dwCurrentState == SERVICE_STOPPED && m_dumpOnStop)
+    {
+        CFlightRecorder::Default().Dump(FLIGHT_DUMP_STOPPED);
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(m_statusLock);
+
+        // Count state changes, not the progress reports of a pending state.
+        if (m_status.dwCurrentState != dwCurrentState &&
+            dwCurrentState >= SERVICE_STOPPED && dwCurrentState <= SERVICE_PAUSED)
+        {
+            m_transitionMetrics[dwCurrentState]->Add();
+        }
+        m_stateMetric->Set(dwCurrentState);
+
+        // Fill in the SERVICE_STATUS structure of the service.
+
+        m_status.dwCurrentState = dwCurrentState;
+        m_status.dwWin32ExitCode = dwWin32ExitCode;
+        m_status.dwWaitHint = dwWaitHint;
+
+        m_status.dwCheckPoint =
+            ((dwCurrentState == SERVICE_RUNNING) || (dwCurrentState == SERVICE_STOPPED)) ?
+                0 : m_checkPoint++;
 
-    // Fill in the SERVICE_STATUS structure of the service.
+        // Report the status of the service to the SCM.
+        ReportStatus();
+    }
+    m_statusChanged.notify_all();
 
-    m_status.dwCurrentState = dwCurrentState;
-    m_status.dwWin32ExitCode = dwWin32ExitCode;
-    m_status.dwWaitHint = dwWaitHint;
+    if (dwCurrentState == SERVICE_STOPPED)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_controlLock);
+            m_stopped = true;
+        }
+        m_controlQueued.notify_all();
+    }
+}
 
-    m_status.dwCheckPoint =
-        ((dwCurrentState == SERVICE_RUNNING) || (dwCurrentState == SERVICE_STOPPED)) ?
-            0 : dwCheckPoint++;
 
-    // Report the status of the service to the SCM.
-    ::SetServiceStatus(m_statusHandle, &m_status);
+//
+//   FUNCTION: CServiceBase::ReportStatus()
+//
+//   PURPOSE: Report m_status to the control manager. The caller holds
+//   m_statusLock so reports from different threads are never interleaved.
+//
+void CServiceBase::ReportStatus()
+{
+    m_dispatcher->SetStatus(m_statusHandle, &m_status);
 }
 
 
 //
 //   FUNCTION: CServiceBase::WriteEventLogEntry(PWSTR, WORD)
 //
-//   PURPOSE: Log a message to the Application event log.
+//   PURPOSE: Log a message to the Application event log. The entry is queued
+//   for the event log writer thread, so this never blocks on the event log
+//   and is safe to call from the control handler.
 //
 //   PARAMETERS:
 //   * pszMessage - string message to be logged.
@@ -496,30 +1152,7 @@ void CServiceBase::WriteEventLogEntry(const char* pszMessage, WORD wType)
 {
     if(!service_log) return;
 
-    HANDLE hEventSource = NULL;
-    LPCWSTR lpszStrings[2] = { NULL, NULL };
-
-    hEventSource = RegisterEventSource(NULL, (LPCSTR)m_name);
-    if (hEventSource)
-    {
-        lpszStrings[0] = (LPCWSTR)m_name;
-        lpszStrings[1] = (PWSTR)pszMessage;
-
-        ReportEvent(hEventSource,  // Event log handle
-            wType,                 // Event type
-            0,                     // Event category
-            0,                     // Event identifier
-            NULL,                  // No security identifier
-            2,                     // Size of lpszStrings array
-            0,                     // No binary data
-            (LPCSTR*)lpszStrings,           // Array of strings
-            NULL                   // No binary data
-            );
-
-        DeregisterEventSource(hEventSource);
-    } else {
-        std::cout << "Error Writing To Event Log" << std::endl;
-    }
+    m_eventLog.Write(wType, pszMessage);
 }
 
 
@@ -538,6 +1171,8 @@ DWORD CServiceBase::WriteErrorLogEntry(const char* message, DWORD dwError)
     StringCchPrintf((STRSAFE_LPSTR)szMessage, ARRAYSIZE(szMessage),
         (STRSAFE_LPSTR)L"%s failed w/err 0x%08lx", pszFunction, dwError);*/
 
+    CFlightRecorder::Default().Record(FLIGHT_ERROR, m_flightSource, dwError);
+
     std::string msg = std::string(message) + " failed w/err 0x" + std::to_string(dwError);
     WriteEventLogEntry(msg.data(), EVENTLOG_ERROR_TYPE);
     return dwError;
@@ -0,0 +1,196 @@
+#include "libwinservice.h"
+
+// Capture
+
+IPCCapture::IPCCapture(): file(INVALID_HANDLE_VALUE), capturing(false) {}
+
+IPCCapture::~IPCCapture() {
+    Close();
+}
+
+bool IPCCapture::Open(const std::string& path) {
+    Close();
+
+    std::scoped_lock lock(mtx_capture);
+    file = CreateFile(path.c_str(), GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if(file == INVALID_HANDLE_VALUE) return false;
+
+    buffer.reserve(IPC_CAPTURE_FLUSH * 2);
+    buffer.assign(IPC_CAPTURE_MAGIC, sizeof(IPC_CAPTURE_MAGIC)); // includes the terminator
+    started = std::chrono::steady_clock::now();
+    capturing = true;
+    return true;
+}
+
+void IPCCapture::Close() {
+    std::scoped_lock lock(mtx_capture);
+    capturing = false;
+
+    if(file != INVALID_HANDLE_VALUE){
+        Flush();
+        CloseHandle(file);
+        file = INVALID_HANDLE_VALUE;
+    }
+    buffer.clear();
+}
+
+void IPCCapture::Record(IPCCaptureDirection direction, const std::string& data) {
+    if(!capturing) return;
+    std::scoped_lock lock(mtx_capture);
+    if(file == INVALID_HANDLE_VALUE) return;
+
+    IPCCaptureRecord record {};
+    record.timestamp = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - started).count();
+    record.direction = direction;
+    record.length = (uint32_t)data.size();
+
+    buffer.append((const char*)&record, sizeof(record));
+    buffer += data;
+
+    if(buffer.size() >= IPC_CAPTURE_FLUSH && !Flush()){
+        capturing = false; // stop rather than fail on every message, e.g. when the disk is full
+    }
+}
+
+bool IPCCapture::Flush() {
+    DWORD written;
+    bool success = WriteFile(file, buffer.data(), (DWORD)buffer.size(), &written, NULL) && written == buffer.size();
+    buffer.clear();
+    return success;
+}
+
+
+// Capture Reader
+
+IPCCaptureReader::IPCCaptureReader(): file(INVALID_HANDLE_VALUE), buffer(IPC_CAPTURE_FLUSH), offset(0), filled(0) {}
+
+IPCCaptureReader::~IPCCaptureReader() {
+    Close();
+}
+
+bool IPCCaptureReader::Open(const std::string& path) {
+    Close();
+
+    file = CreateFile(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if(file == INVALID_HANDLE_VALUE) return false;
+
+    if(!Fill(sizeof(IPC_CAPTURE_MAGIC)) || memcmp(buffer.data(), IPC_CAPTURE_MAGIC, sizeof(IPC_CAPTURE_MAGIC)) != 0){
+        Close();
+        SetLastError(ERROR_BAD_FORMAT);
+        return false;
+    }
+    offset += sizeof(IPC_CAPTURE_MAGIC);
+    return true;
+}
+
+void IPCCaptureReader::Close() {
+    if(file != INVALID_HANDLE_VALUE){
+        CloseHandle(file);
+        file = INVALID_HANDLE_VALUE;
+    }
+    offset = filled = 0;
+}
+
+bool IPCCaptureReader::Next(IPCCaptureRecord& record, std::string& data) {
+    if(!Fill(sizeof(record))) return false;
+    memcpy(&record, buffer.data() + offset, sizeof(record));
+
+    if(!Fill(sizeof(record) + record.length)){
+        SetLastError(ERROR_BAD_FORMAT); // truncated, e.g. the capture was not closed
+        return false;
+    }
+    data.assign(buffer.data() + offset + sizeof(record), record.length);
+    offset += sizeof(record) + record.length;
+    return true;
+}
+
+// Make at least size unread bytes available in the buffer
+bool IPCCaptureReader::Fill(size_t size) {
+    if(file == INVALID_HANDLE_VALUE) return false;
+    if(filled - offset >= size) return true;
+
+    // move the unread tail to the front and grow for records larger than the buffer
+    memmove(buffer.data(), buffer.data() + offset, filled - offset);
+    filled -= offset;
+    offset = 0;
+    if(buffer.size() < size) buffer.resize(size);
+
+    while(filled < size){
+        DWORD bytes = 0;
+        if(!ReadFile(file, buffer.data() + filled, DWORD(buffer.size() - filled), &bytes, NULL)) return false;
+        if(bytes == 0){
+            SetLastError(ERROR_HANDLE_EOF);
+            return false;
+        }
+        filled += bytes;
+    }
+    return true;
+}
+
+
+// Replay
+
+bool ReplayCapture(const std::string& path, const std::string& address, double speed,
+                   IPCCaptureDirection direction, IPCStats& stats) {
+    IPCCaptureReader reader;
+    if(!reader.Open(path)) return false;
+
+    std::unique_ptr<IPCOutboxTransport> outbox = CreateOutboxTransport(address);
+    while(!outbox->Open(address)){ // a tcp:// target connects in the background
+        if(GetLastError() != WSAEWOULDBLOCK) return false;
+        Sleep(1);
+    }
+
+    IPCCaptureRecord record;
+    std::string data;
+    std::deque<std::string> batch;
+    auto started = std::chrono::steady_clock::now();
+
+    while(reader.Next(record, data)){
+        if(record.direction != direction) continue;
+
+        // control frames belong to the captured connection, data frames and plain text are replayed
+        IPCFrameHeader header;
+        if(data.size() >= sizeof(header) && memcmp(data.data(), IPC_FRAME_MAGIC, sizeof(header.magic)) == 0){
+            memcpy(&header, data.data(), sizeof(header));
+            if(header.type != IPC_FRAME_DATA) continue;
+        }
+
+        if(speed > 0){
+            auto due = started + std::chrono::microseconds(uint64_t(record.timestamp / speed));
+            if(std::chrono::steady_clock::now() < due){
+                // send what is due before waiting for the next message
+                if(!batch.empty() && !outbox->Write(batch, stats)) return false;
+
+                auto wait = std::chrono::duration_cast<std::chrono::milliseconds>(due - std::chrono::steady_clock::now());
+                if(wait.count() > 2) Sleep(DWORD(wait.count() - 1)); // sleep most of the gap, spin the rest
+                while(std::chrono::steady_clock::now() < due) YieldProcessor();
+            }
+        }
+        batch.emplace_back(std::move(data));
+    }
+
+    DWORD error = GetLastError();
+
+    // A stream transport may hold on to part of the batch until the target
+    // reads it; wait for all of it, as closing the outbox would drop the rest.
+    const DWORD stalled = 5000; // ms without progress before giving up on the target
+    ULONGLONG progress = GetTickCount64();
+    size_t bytes = stats.bytes_sent;
+    while(!batch.empty() || outbox->Pending()){
+        if(!outbox->Write(batch, stats)) return false;
+        if(batch.empty() && !outbox->Pending()) break;
+
+        if(stats.bytes_sent != bytes){
+            bytes = stats.bytes_sent;
+            progress = GetTickCount64();
+        } else if(GetTickCount64() - progress >= stalled){
+            SetLastError(ERROR_TIMEOUT);
+            return false;
+        }
+        Sleep(1);
+    }
+
+    SetLastError(error);
+    return error == ERROR_HANDLE_EOF;
+}
@@ -0,0 +1,46 @@
+#include "libwinservice.h"
+
+IPCCompressor::IPCCompressor(): compressor(NULL), decompressor(NULL) {}
+
+IPCCompressor::~IPCCompressor() {
+    if(compressor) CloseCompressor(compressor);
+    if(decompressor) CloseDecompressor(decompressor);
+}
+
+bool IPCCompressor::Compress(std::string_view data, std::string& out) {
+    if(!compressor && !CreateCompressor(COMPRESS_ALGORITHM_XPRESS_HUFF, NULL, &compressor)){
+        compressor = NULL;
+        return false;
+    }
+
+    // An output buffer no larger than the input makes incompressible data fail fast.
+    out.resize(data.size());
+    SIZE_T size = 0;
+    if(!::Compress(compressor, data.data(), data.size(), out.data(), out.size(), &size) || size >= data.size()){
+        return false;
+    }
+    out.resize(size);
+    return true;
+}
+
+bool IPCCompressor::Decompress(std::string_view data, std::string& out) {
+    if(!decompressor && !CreateDecompressor(COMPRESS_ALGORITHM_XPRESS_HUFF, NULL, &decompressor)){
+        decompressor = NULL;
+        return false;
+    }
+
+    // The buffer format records the original size, which a call without a buffer reports.
+    SIZE_T size = 0;
+    if(!::Decompress(decompressor, data.data(), data.size(), NULL, 0, &size) && GetLastError() != ERROR_INSUFFICIENT_BUFFER){
+        return false;
+    }
+    if(size > IPC_TCP_MAX_FRAME){ // refuse to inflate beyond what any transport would carry
+        SetLastError(ERROR_INVALID_DATA);
+        return false;
+    }
+
+    out.resize(size);
+    if(!::Decompress(decompressor, data.data(), data.size(), out.data(), out.size(), &size)) return false;
+    out.resize(size);
+    return true;
+}
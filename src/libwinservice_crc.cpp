@@ -0,0 +1,90 @@
+#include "libwinservice.h"
+#include <cstring>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+    #define CRC32C_SSE42
+    #include <immintrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+    #define CRC32C_ARMV8
+    #include <arm_acle.h>
+#endif
+
+typedef uint32_t (*Crc32cUpdate)(uint32_t crc, const uint8_t* data, size_t size);
+
+static uint32_t Crc32cTable(uint32_t crc, const uint8_t* data, size_t size) {
+    // slicing-by-8 tables for the reflected polynomial 0x82F63B78
+    static const struct Tables {
+        uint32_t t[8][256];
+        Tables() {
+            for(uint32_t i=0; i < 256; ++i){
+                uint32_t c = i;
+                for(int k=0; k < 8; ++k) c = (c >> 1) ^ (0x82F63B78 & (0 - (c & 1)));
+                t[0][i] = c;
+            }
+            for(uint32_t i=0; i < 256; ++i){
+                for(int s=1; s < 8; ++s) t[s][i] = (t[s - 1][i] >> 8) ^ t[0][t[s - 1][i] & 0xFF];
+            }
+        }
+    } tables;
+    const auto& t = tables.t;
+
+    for(; size >= 8; data += 8, size -= 8){
+        uint32_t lo, hi;
+        memcpy(&lo, data, 4);
+        memcpy(&hi, data + 4, 4);
+        lo ^= crc;
+        crc = t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF] ^ t[5][(lo >> 16) & 0xFF] ^ t[4][lo >> 24] ^
+              t[3][hi & 0xFF] ^ t[2][(hi >> 8) & 0xFF] ^ t[1][(hi >> 16) & 0xFF] ^ t[0][hi >> 24];
+    }
+    while(size--) crc = (crc >> 8) ^ t[0][(crc ^ *data++) & 0xFF];
+    return crc;
+}
+
+#ifdef CRC32C_SSE42
+__attribute__((target("sse4.2")))
+static uint32_t Crc32cSSE42(uint32_t crc, const uint8_t* data, size_t size) {
+#ifdef __x86_64__
+    uint64_t crc64 = crc;
+    for(; size >= 8; data += 8, size -= 8){
+        uint64_t word;
+        memcpy(&word, data, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = (uint32_t)crc64;
+#endif
+    for(; size >= 4; data += 4, size -= 4){
+        uint32_t word;
+        memcpy(&word, data, 4);
+        crc = _mm_crc32_u32(crc, word);
+    }
+    while(size--) crc = _mm_crc32_u8(crc, *data++);
+    return crc;
+}
+#endif
+
+#ifdef CRC32C_ARMV8
+static uint32_t Crc32cARMv8(uint32_t crc, const uint8_t* data, size_t size) {
+    for(; size >= 8; data += 8, size -= 8){
+        uint64_t word;
+        memcpy(&word, data, 8);
+        crc = __crc32cd(crc, word);
+    }
+    while(size--) crc = __crc32cb(crc, *data++);
+    return crc;
+}
+#endif
+
+static Crc32cUpdate SelectCrc32c() {
+#if defined(CRC32C_SSE42)
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("sse4.2")) return Crc32cSSE42;
+#elif defined(CRC32C_ARMV8)
+    return Crc32cARMv8;
+#endif
+    return Crc32cTable;
+}
+
+uint32_t Crc32c(const void* data, size_t size, uint32_t crc) {
+    static const Crc32cUpdate update = SelectCrc32c();
+    return ~update(~crc, (const uint8_t*)data, size);
+}
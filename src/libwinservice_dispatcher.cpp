@@ -0,0 +1,213 @@
+#include "libwinservice.h"
+
+// Win32 Service Control Manager
+
+class CScmDispatcher : public CServiceDispatcher {
+public:
+    BOOL StartDispatcher(const SERVICE_TABLE_ENTRY* serviceTable) override {
+        return StartServiceCtrlDispatcher(serviceTable);
+    }
+    SERVICE_STATUS_HANDLE RegisterHandler(const char* pszServiceName, LPHANDLER_FUNCTION_EX handler, LPVOID context) override {
+        return RegisterServiceCtrlHandlerEx(pszServiceName, handler, context);
+    }
+    BOOL SetStatus(SERVICE_STATUS_HANDLE statusHandle, SERVICE_STATUS* status) override {
+        return ::SetServiceStatus(statusHandle, status);
+    }
+};
+
+CServiceDispatcher& CServiceDispatcher::Default() {
+    static CScmDispatcher dispatcher;
+    return dispatcher;
+}
+
+
+// Fake Service Control Manager
+
+CFakeServiceDispatcher::CFakeServiceDispatcher(): dispatching(false) {}
+
+BOOL CFakeServiceDispatcher::StartDispatcher(const SERVICE_TABLE_ENTRY* serviceTable) {
+    std::vector<std::thread> serviceThreads;
+    {
+        std::scoped_lock lock(mtx_dispatcher);
+        if(dispatching){
+            SetLastError(ERROR_SERVICE_ALREADY_RUNNING);
+            return FALSE;
+        }
+
+        services.clear();
+        for(const SERVICE_TABLE_ENTRY* entry = serviceTable; entry->lpServiceName; ++entry){
+            services.push_back({ entry->lpServiceName, NULL, NULL, SERVICE_START_PENDING, 0 });
+        }
+        dispatching = true;
+    }
+
+    // Like the SCM, start each service on its own thread with its name as the first argument.
+    for(const SERVICE_TABLE_ENTRY* entry = serviceTable; entry->lpServiceName; ++entry){
+        serviceThreads.emplace_back([entry](){
+            LPSTR argv[] = { entry->lpServiceName, NULL };
+            entry->lpServiceProc(1, argv);
+        });
+    }
+
+    // Run injected controls on this thread, as the SCM runs handlers on the dispatcher thread.
+    std::unique_lock lock(mtx_dispatcher);
+    for(;;){
+        cv_dispatcher.wait(lock, [&](){
+            return !controls.empty() || std::all_of(services.begin(), services.end(),
+                [](const Service& service){ return service.state == SERVICE_STOPPED; });
+        });
+        if(controls.empty()){ // every service has stopped
+            dispatching = false;
+            break;
+        }
+
+        PendingControl* pending = controls.front();
+        controls.pop_front();
+        Service service = services[pending->service];
+
+        lock.unlock();
+        DWORD result = service.handler(pending->control, 0, NULL, service.context);
+        lock.lock();
+
+        pending->result = result;
+        pending->done = true;
+        cv_dispatcher.notify_all();
+    }
+    lock.unlock();
+
+    for(std::thread& thread : serviceThreads) thread.join();
+    return TRUE;
+}
+
+SERVICE_STATUS_HANDLE CFakeServiceDispatcher::RegisterHandler(const char* pszServiceName, LPHANDLER_FUNCTION_EX handler, LPVOID context) {
+    std::scoped_lock lock(mtx_dispatcher);
+
+    Service* service = FindService(pszServiceName);
+    if(!service){
+        SetLastError(ERROR_SERVICE_DOES_NOT_EXIST);
+        return NULL;
+    }
+
+    service->handler = handler;
+    service->context = context;
+    cv_dispatcher.notify_all();
+
+    // the handle is the 1-based position in the table
+    return (SERVICE_STATUS_HANDLE)(service - services.data() + 1);
+}
+
+BOOL CFakeServiceDispatcher::SetStatus(SERVICE_STATUS_HANDLE statusHandle, SERVICE_STATUS* status) {
+    auto time = std::chrono::steady_clock::now();
+    std::scoped_lock lock(mtx_dispatcher);
+
+    size_t index = (size_t)statusHandle;
+    if(index == 0 || index > services.size()){
+        SetLastError(ERROR_INVALID_HANDLE);
+        return FALSE;
+    }
+
+    Service& service = services[index - 1];
+    service.state = status->dwCurrentState;
+    service.accepted = status->dwControlsAccepted;
+    transitions.push_back({ time, service.name, *status });
+    cv_dispatcher.notify_all();
+    return TRUE;
+}
+
+DWORD CFakeServiceDispatcher::Control(const std::string& name, DWORD control) {
+    std::unique_lock lock(mtx_dispatcher);
+
+    Service* service = FindService(name);
+    if(!dispatching || !service || !service->handler || service->state == SERVICE_STOPPED){
+        return ERROR_SERVICE_NOT_ACTIVE;
+    }
+
+    PendingControl pending { size_t(service - services.data()), control, NO_ERROR, false };
+    controls.push_back(&pending);
+    cv_dispatcher.notify_all();
+
+    cv_dispatcher.wait(lock, [&](){ return pending.done; });
+    return pending.result;
+}
+
+bool CFakeServiceDispatcher::Shutdown(DWORD preshutdownTimeout) {
+    auto notify = [&](DWORD accept){
+        std::vector<std::string> names;
+        {
+            std::scoped_lock lock(mtx_dispatcher);
+            for(const Service& service : services){
+                if(service.handler && service.state != SERVICE_STOPPED && (service.accepted & accept)) names.push_back(service.name);
+            }
+        }
+        return names;
+    };
+
+    // The SCM notifies the services in parallel; handlers only queue the work, so one at a time is close enough.
+    std::vector<std::string> draining = notify(SERVICE_ACCEPT_PRESHUTDOWN);
+    for(const std::string& name : draining) Control(name, SERVICE_CONTROL_PRESHUTDOWN);
+
+    bool stopped;
+    {
+        std::unique_lock lock(mtx_dispatcher);
+        stopped = cv_dispatcher.wait_for(lock, std::chrono::milliseconds(preshutdownTimeout), [&](){
+            return std::all_of(draining.begin(), draining.end(), [&](const std::string& name){
+                Service* service = FindService(name);
+                return !service || service->state == SERVICE_STOPPED;
+            });
+        });
+    }
+
+    for(const std::string& name : notify(SERVICE_ACCEPT_SHUTDOWN)) Control(name, SERVICE_CONTROL_SHUTDOWN);
+    return stopped;
+}
+
+bool CFakeServiceDispatcher::WaitForState(const std::string& name, DWORD state, DWORD timeout) {
+    std::unique_lock lock(mtx_dispatcher);
+    auto ready = [&](){
+        Service* service = FindService(name);
+        return service && service->state == state;
+    };
+
+    if(timeout == INFINITE){
+        cv_dispatcher.wait(lock, ready);
+        return true;
+    }
+    return cv_dispatcher.wait_for(lock, std::chrono::milliseconds(timeout), ready);
+}
+
+bool CFakeServiceDispatcher::WaitForDispatcher(DWORD timeout) {
+    std::unique_lock lock(mtx_dispatcher);
+    auto ready = [&](){
+        return dispatching && std::all_of(services.begin(), services.end(),
+            [](const Service& service){ return service.handler != NULL; });
+    };
+
+    if(timeout == INFINITE){
+        cv_dispatcher.wait(lock, ready);
+        return true;
+    }
+    return cv_dispatcher.wait_for(lock, std::chrono::milliseconds(timeout), ready);
+}
+
+DWORD CFakeServiceDispatcher::State(const std::string& name) {
+    std::scoped_lock lock(mtx_dispatcher);
+    Service* service = FindService(name);
+    return service ? service->state : 0;
+}
+
+std::vector<CServiceTransition> CFakeServiceDispatcher::Transitions() {
+    std::scoped_lock lock(mtx_dispatcher);
+    return transitions;
+}
+
+void CFakeServiceDispatcher::ClearTransitions() {
+    std::scoped_lock lock(mtx_dispatcher);
+    transitions.clear();
+}
+
+CFakeServiceDispatcher::Service* CFakeServiceDispatcher::FindService(const std::string& name) {
+    for(Service& service : services){
+        if(lstrcmpi(service.name.c_str(), name.c_str()) == 0) return &service;
+    }
+    return NULL;
+}
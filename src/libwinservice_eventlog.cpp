@@ -0,0 +1,236 @@
+#include "libwinservice.h"
+#include <cstdio>
+
+static_assert((EVENTLOG_RING_SIZE & (EVENTLOG_RING_SIZE - 1)) == 0, "the ring size must be a power of two");
+
+// Windows Event Log Backend
+
+CWindowsEventLogBackend::CWindowsEventLogBackend(): source(NULL) {}
+
+CWindowsEventLogBackend::~CWindowsEventLogBackend() {
+    Close();
+}
+
+bool CWindowsEventLogBackend::Open(const std::string& sourceName) {
+    Close();
+
+    source = RegisterEventSource(NULL, sourceName.c_str());
+    name = sourceName;
+    return source != NULL;
+}
+
+void CWindowsEventLogBackend::Close() {
+    if(source != NULL){
+        DeregisterEventSource(source);
+        source = NULL;
+    }
+}
+
+bool CWindowsEventLogBackend::Write(const std::vector<CEventLogEntry>& batch) {
+    if(source == NULL) return false;
+
+    bool success = true;
+    for(const CEventLogEntry& entry : batch){
+        LPCSTR strings[2] = { name.c_str(), entry.message.c_str() };
+        success &= ReportEvent(source, entry.type, 0, 0, NULL, 2, 0, strings, NULL) != FALSE;
+    }
+    return success;
+}
+
+
+// File Backend
+
+CFileEventLogBackend::CFileEventLogBackend(const std::string& path): file(INVALID_HANDLE_VALUE), path(path) {}
+
+CFileEventLogBackend::~CFileEventLogBackend() {
+    Close();
+}
+
+bool CFileEventLogBackend::Open(const std::string& sourceName) {
+    Close();
+
+    file = CreateFile(path.c_str(), FILE_APPEND_DATA, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    name = sourceName;
+    return file != INVALID_HANDLE_VALUE;
+}
+
+void CFileEventLogBackend::Close() {
+    if(file != INVALID_HANDLE_VALUE){
+        CloseHandle(file);
+        file = INVALID_HANDLE_VALUE;
+    }
+}
+
+bool CFileEventLogBackend::Write(const std::vector<CEventLogEntry>& batch) {
+    if(file == INVALID_HANDLE_VALUE) return false;
+
+    buffer.clear();
+    for(const CEventLogEntry& entry : batch){
+        const char* type = entry.type == EVENTLOG_ERROR_TYPE ? "ERROR" :
+                           entry.type == EVENTLOG_WARNING_TYPE ? "WARNING" :
+                           entry.type == EVENTLOG_AUDIT_FAILURE ? "AUDIT_FAILURE" :
+                           entry.type == EVENTLOG_AUDIT_SUCCESS ? "AUDIT_SUCCESS" : "INFO";
+        char prefix[96];
+        const SYSTEMTIME& t = entry.time;
+        int length = snprintf(prefix, sizeof(prefix), "%04u-%02u-%02u %02u:%02u:%02u.%03u %s ",
+                              t.wYear, t.wMonth, t.wDay, t.wHour, t.wMinute, t.wSecond, t.wMilliseconds, type);
+        buffer.append(prefix, std::max(length, 0));
+        buffer += name;
+        buffer += ": ";
+        buffer += entry.message;
+        buffer += "\r\n";
+    }
+
+    DWORD written;
+    return WriteFile(file, buffer.data(), (DWORD)buffer.size(), &written, NULL) && written == buffer.size();
+}
+
+
+// Event Log
+
+CEventLog::CEventLog():
+    ring(new Slot[EVENTLOG_RING_SIZE]), ring_head(0), ring_tail(0),
+    writer_running(false), last_hash(0), repeats(0),
+    last_type(EVENTLOG_INFORMATION_TYPE), window_end(0)
+{
+    for(size_t i = 0; i < EVENTLOG_RING_SIZE; ++i) ring[i].sequence = i;
+
+    // Auto-reset event used to cut the flush interval short when the ring fills up.
+    wake_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if(wake_event == NULL){
+        throw GetLastError();
+    }
+}
+
+CEventLog::~CEventLog() {
+    Close();
+    CloseHandle(wake_event);
+}
+
+bool CEventLog::Open(const std::string& name, std::unique_ptr<CEventLogBackend> logBackend) {
+    Close();
+
+    backend = logBackend ? std::move(logBackend) : std::make_unique<CWindowsEventLogBackend>();
+    if(!backend->Open(name)){
+        backend.reset();
+        return false;
+    }
+
+    last_hash = 0;
+    repeats = 0;
+    writer_running = true;
+    writer_thread = std::thread(&CEventLog::WriterHandle, this);
+    return true;
+}
+
+void CEventLog::Close() {
+    if(writer_thread.joinable()){
+        writer_running = false;
+        SetEvent(wake_event);
+        writer_thread.join(); // the writer drains the ring before it exits
+    }
+    if(backend){
+        backend->Close();
+        backend.reset();
+    }
+}
+
+bool CEventLog::Write(WORD type, const std::string& message) {
+    if(!writer_running) return false;
+
+    // Repeats of the last message are only counted. Two threads racing on
+    // different messages may both queue theirs, which is harmless.
+    size_t hash = std::hash<std::string>{}(message) ^ type;
+    if(hash == 0) hash = 1;
+    if(last_hash.load(std::memory_order_relaxed) == hash){
+        repeats++;
+        stats.suppressed++;
+        return true;
+    }
+    last_hash.store(hash, std::memory_order_relaxed);
+
+    CEventLogEntry entry { type, {}, message };
+    GetLocalTime(&entry.time);
+    return Push(entry, (DWORD)repeats.exchange(0));
+}
+
+bool CEventLog::Push(CEventLogEntry& entry, DWORD repeated) {
+    // Bounded multi-producer ring: a slot whose sequence equals the position
+    // is free, producers claim it by advancing the head.
+    size_t position = ring_head.load(std::memory_order_relaxed);
+    Slot* slot;
+    for(;;){
+        slot = &ring[position & (EVENTLOG_RING_SIZE - 1)];
+        size_t sequence = slot->sequence.load(std::memory_order_acquire);
+        intptr_t difference = (intptr_t)sequence - (intptr_t)position;
+
+        if(difference == 0){
+            if(ring_head.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) break;
+        } else if(difference < 0){ // full - the writer has not drained this slot yet
+            repeats += repeated;
+            stats.dropped++;
+            return false;
+        } else {
+            position = ring_head.load(std::memory_order_relaxed);
+        }
+    }
+
+    slot->entry = std::move(entry);
+    slot->repeats = repeated;
+    slot->sequence.store(position + 1, std::memory_order_release);
+
+    // Wake the writer every half ring rather than on every entry.
+    if((position & (EVENTLOG_RING_SIZE / 2 - 1)) == EVENTLOG_RING_SIZE / 2 - 1) SetEvent(wake_event);
+    return true;
+}
+
+void CEventLog::Drain(std::vector<CEventLogEntry>& batch) {
+    auto repeated = [&](size_t count){
+        CEventLogEntry entry { last_type, {}, "The previous message was repeated " + std::to_string(count) + " more times" };
+        GetLocalTime(&entry.time);
+        batch.push_back(std::move(entry));
+    };
+
+    for(;;){
+        Slot& slot = ring[ring_tail & (EVENTLOG_RING_SIZE - 1)];
+        if(slot.sequence.load(std::memory_order_acquire) != ring_tail + 1) break;
+
+        if(slot.repeats) repeated(slot.repeats);
+        last_type = slot.entry.type;
+        batch.push_back(std::move(slot.entry));
+
+        slot.sequence.store(ring_tail + EVENTLOG_RING_SIZE, std::memory_order_release);
+        ring_tail++;
+    }
+
+    // Close the suppression window: report the repeats counted so far and
+    // let the next occurrence of the message be written in full.
+    ULONGLONG tick = GetTickCount64();
+    if(tick >= window_end || !writer_running){
+        size_t count = repeats.exchange(0);
+        if(count) repeated(count);
+        last_hash = 0;
+        window_end = tick + EVENTLOG_SUPPRESS_WINDOW;
+    }
+}
+
+// Writer Thread Handle
+void CEventLog::WriterHandle() {
+    std::vector<CEventLogEntry> batch;
+    batch.reserve(EVENTLOG_RING_SIZE);
+    window_end = GetTickCount64() + EVENTLOG_SUPPRESS_WINDOW;
+
+    for(;;){
+        bool running = writer_running; // read first, so entries queued before Close are still drained
+        if(running) WaitForSingleObject(wake_event, EVENTLOG_FLUSH_INTERVAL);
+
+        Drain(batch);
+        if(!batch.empty()){
+            backend->Write(batch);
+            stats.logged += batch.size();
+            stats.batches++;
+            batch.clear();
+        }
+        if(!running) break;
+    }
+}
@@ -0,0 +1,135 @@
+#include "libwinservice.h"
+
+uint64_t CEventLoop::AddTimer(DWORD period, DWORD slack, Handler handler) {
+    if(period == 0 || !handler) throw DWORD(ERROR_INVALID_PARAMETER);
+
+    Timer timer;
+    timer.period = std::chrono::milliseconds(period);
+    timer.slack = std::chrono::milliseconds(slack);
+    timer.due = std::chrono::steady_clock::now() + timer.period;
+    timer.handler = std::make_shared<const Handler>(std::move(handler));
+
+    uint64_t id;
+    {
+        std::scoped_lock lock(m_lock);
+        id = ++m_lastId;
+        m_timers.emplace(id, std::move(timer));
+    }
+    m_wake.notify_all(); // the loop may be sleeping past the new timer's deadline
+    return id;
+}
+
+bool CEventLoop::RemoveTimer(uint64_t id) {
+    std::scoped_lock lock(m_lock);
+    return m_timers.erase(id) != 0;
+}
+
+uint64_t CEventLoop::AddEvent(Handler handler) {
+    if(!handler) throw DWORD(ERROR_INVALID_PARAMETER);
+
+    std::scoped_lock lock(m_lock);
+    Event& event = m_events[++m_lastId];
+    event.handler = std::make_shared<const Handler>(std::move(handler));
+    return m_lastId;
+}
+
+bool CEventLoop::RemoveEvent(uint64_t id) {
+    std::scoped_lock lock(m_lock);
+    return m_events.erase(id) != 0;
+}
+
+void CEventLoop::Trigger(uint64_t id) {
+    {
+        std::scoped_lock lock(m_lock);
+        auto event = m_events.find(id);
+        if(event == m_events.end() || event->second.pending) return; // already on its way
+        event->second.pending = true;
+        if(m_held) return;
+    }
+    m_wake.notify_all();
+}
+
+void CEventLoop::Post(Handler handler) {
+    {
+        std::scoped_lock lock(m_lock);
+        m_posted.push_back(std::move(handler));
+    }
+    m_wake.notify_all();
+}
+
+void CEventLoop::Quit() {
+    {
+        std::scoped_lock lock(m_lock);
+        m_quit = true;
+    }
+    m_wake.notify_all();
+}
+
+bool CEventLoop::Quitting() const {
+    std::scoped_lock lock(m_lock);
+    return m_quit;
+}
+
+void CEventLoop::Hold(bool held) {
+    {
+        std::scoped_lock lock(m_lock);
+        m_held = held;
+    }
+    m_wake.notify_all(); // released timers and events may be due already
+}
+
+bool CEventLoop::Held() const {
+    std::scoped_lock lock(m_lock);
+    return m_held;
+}
+
+CEventLoop::Stats CEventLoop::GetStats() const {
+    std::scoped_lock lock(m_lock);
+    return m_stats;
+}
+
+void CEventLoop::Run() {
+    std::vector<Handler> posted;
+    std::vector<std::shared_ptr<const Handler>> ready;
+
+    std::unique_lock lock(m_lock);
+    while(!m_quit){
+        auto now = std::chrono::steady_clock::now();
+        auto wake = std::chrono::steady_clock::time_point::max();
+
+        for(; !m_posted.empty(); m_posted.pop_front()) posted.push_back(std::move(m_posted.front()));
+        if(!m_held){
+            for(auto& [id, timer] : m_timers){
+                if(timer.due <= now){
+                    timer.due += timer.period;
+                    if(timer.due <= now) timer.due = now + timer.period; // skip the periods missed
+                    ready.push_back(timer.handler);
+                    m_stats.timers++;
+                }
+                wake = std::min(wake, timer.due + timer.slack);
+            }
+            for(auto& [id, event] : m_events){
+                if(!event.pending) continue;
+                event.pending = false;
+                ready.push_back(event.handler);
+                m_stats.events++;
+            }
+        }
+
+        if(!posted.empty() || !ready.empty()){
+            m_stats.posts += posted.size();
+            lock.unlock();
+            for(Handler& handler : posted) handler();
+            for(auto& handler : ready) (*handler)();
+            posted.clear();
+            ready.clear();
+            lock.lock();
+            continue; // a handler may have triggered or posted more
+        }
+
+        // Sleep until the latest moment every timer allows, or until woken
+        if(wake == std::chrono::steady_clock::time_point::max()) m_wake.wait(lock);
+        else m_wake.wait_until(lock, wake);
+        m_stats.wakeups++;
+    }
+}
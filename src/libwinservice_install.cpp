@@ -19,6 +19,11 @@
 //     must start before this service.
 //   * pszAccount - the name of the account under which the service runs.
 //   * pszPassword - the password to the account name.
+//   * dwServiceType - SERVICE_WIN32_OWN_PROCESS, or SERVICE_WIN32_SHARE_PROCESS
+//     for a service hosted alongside others by CServiceBase::Run.
+//   * dwPreshutdownTimeout - how long the SCM waits for a service accepting
+//     SERVICE_ACCEPT_PRESHUTDOWN to stop before the system shuts down, in
+//     milliseconds, or 0 for the system default.
 //
 //   RETURN:
 //   bool - Success status on service installation
@@ -34,7 +39,9 @@ bool InstallService(const char* pszServiceName,
                     DWORD dwErrorControl,
                     const char* pszDependencies,
                     const char* pszAccount,
-                    const char* pszPassword)
+                    const char* pszPassword,
+                    DWORD dwServiceType,
+                    DWORD dwPreshutdownTimeout)
 {
     bool success = false;
     TCHAR szPath[MAX_PATH];
@@ -44,6 +51,7 @@ bool InstallService(const char* pszServiceName,
     SERVICE_DESCRIPTION description = {LPSTR("")};
     SERVICE_FAILURE_ACTIONS recoveryOptions;
     SC_ACTION actions[3];
+    SERVICE_PRESHUTDOWN_INFO preshutdown = {dwPreshutdownTimeout};
 
     if (!IsElevated())
     {
@@ -71,7 +79,7 @@ bool InstallService(const char* pszServiceName,
         TEXT(pszServiceName),           // Name of service
         TEXT(pszDisplayName),           // Name to display
         SERVICE_ALL_ACCESS,             // Desired access
-        SERVICE_WIN32_OWN_PROCESS,      // Service type
+        dwServiceType,                  // Service type
         dwStartType,                    // Service start type
         dwErrorControl,                 // Error control type
         szPath,                         // Service's binary
@@ -107,6 +115,12 @@ bool InstallService(const char* pszServiceName,
     };
     ChangeServiceConfig2(schService, SERVICE_CONFIG_FAILURE_ACTIONS, &recoveryOptions);
 
+    //Set how long the SCM waits for the service to drain before shutdown
+    if (dwPreshutdownTimeout != 0)
+    {
+        ChangeServiceConfig2(schService, SERVICE_CONFIG_PRESHUTDOWN_INFO, &preshutdown);
+    }
+
     std::cout << pszServiceName << " is installed\n";
     success = true;
 
@@ -1,39 +1,71 @@
 #include "libwinservice.h"
 #include "libwinservice_csd.h"
 
-IPCController::IPCController(const std::string& id_inbox, const std::string& id_outbox):
-    ipc_valid(false), ipc_valid_inbox(false), ipc_valid_outbox(false), ipc_running(false),
+// Process-wide IPC metrics, summed over every controller
+struct IPCMetrics {
+    CMetricCounter& sent = CMetrics::Default().Counter("libwinservice_ipc_messages_sent_total",
+        "Messages handed to outbox transports");
+    CMetricCounter& received = CMetrics::Default().Counter("libwinservice_ipc_messages_received_total",
+        "Data messages read from inbox transports");
+    CMetricCounter& dropped = CMetrics::Default().Counter("libwinservice_ipc_messages_dropped_total",
+        "Messages dropped for a bad checksum, an undecodable payload or the rate limit");
+    CMetricCounter& errors = CMetrics::Default().Counter("libwinservice_ipc_errors_total",
+        "Transport errors");
+    CMetricGauge& outgoing = CMetrics::Default().Gauge("libwinservice_ipc_outgoing_queued",
+        "Messages queued by Send and not written yet");
+    CMetricGauge& incoming = CMetrics::Default().Gauge("libwinservice_ipc_incoming_queued",
+        "Messages received and not taken by Receive yet");
+    CMetricHistogram& write = CMetrics::Default().Histogram("libwinservice_ipc_write_seconds",
+        "Time to write one batch to an outbox transport");
+};
+
+static IPCMetrics& Metrics() {
+    static IPCMetrics metrics;
+    return metrics;
+}
+
+IPCController::IPCController(const std::string& id_inbox, const std::string& id_outbox, IPCReactor& reactor):
+    ipc_valid(false), ipc_valid_inbox(false), ipc_valid_outbox(false),
     ipc_sa(CreateSecurityAttribute()),
-    last_error(0), error_count(0), ipc_inbox_enabled(false), ipc_outbox_enabled(false)
+    last_error(0), error_count(0), ipc_inbox_enabled(false), ipc_outbox_enabled(false),
+    ipc_reactor(&reactor), retry_inbox(0), retry_outbox(0), retry_backoff(IPC_RETRY_MIN),
+    outgoing_unwritten(0), outgoing_control(0), incoming_pending(0), spin_budget(0),
+    deferred_pending(0), sender_id(GetCurrentProcessId()), ipc_checksum(false),
+    local_codecs(IPC_CODEC_PLAIN | IPC_CODEC_COMPRESSED), peer_transports(0),
+    peer_version(1), send_codec(IPC_CODEC_PLAIN),
+    peer_ready(false), peer_greeted(false), frame_sequence(0),
+    inbox_lease(IPC_REGISTRY_LEASE), renew_inbox(0), flight_source(0)
 {
     InitializeInbox(id_inbox);
     InitializeOutbox(id_outbox);
 
-    ipc_thread = std::thread(&IPCHandle, this);
+    ipc_reactor->Register(this);
 }
 
-IPCController::IPCController():
-    mailslot_in(INVALID_HANDLE_VALUE), mailslot_out(INVALID_HANDLE_VALUE),
+IPCController::IPCController(IPCReactor& reactor):
     ipc_sa(CreateSecurityAttribute()),
-    ipc_valid(false), ipc_valid_inbox(false), ipc_valid_outbox(false), ipc_running(false),
-    last_error(0), error_count(0), ipc_inbox_enabled(false), ipc_outbox_enabled(false)
+    ipc_valid(false), ipc_valid_inbox(false), ipc_valid_outbox(false),
+    last_error(0), error_count(0), ipc_inbox_enabled(false), ipc_outbox_enabled(false),
+    ipc_reactor(&reactor), retry_inbox(0), retry_outbox(0), retry_backoff(IPC_RETRY_MIN),
+    outgoing_unwritten(0), outgoing_control(0), incoming_pending(0), spin_budget(0),
+    deferred_pending(0), sender_id(GetCurrentProcessId()), ipc_checksum(false),
+    local_codecs(IPC_CODEC_PLAIN | IPC_CODEC_COMPRESSED), peer_transports(0),
+    peer_version(1), send_codec(IPC_CODEC_PLAIN),
+    peer_ready(false), peer_greeted(false), frame_sequence(0),
+    inbox_lease(IPC_REGISTRY_LEASE), renew_inbox(0), flight_source(0)
 {
-    ipc_thread = std::thread(&IPCHandle, this);
+    ipc_reactor->Register(this);
 }
 
 IPCController::~IPCController() {
     ipc_valid = false;
 
-    if(ipc_thread.joinable()){
-        ipc_running = false;
-        ipc_thread.join(); // wait for IPC thread to terminate
-    }
-
-    ipc_valid_inbox = false;
-    ipc_valid_outbox = false;
+    ipc_reactor->Unregister(this); // wait for the reactor to release this controller
 
-    if(mailslot_in != INVALID_HANDLE_VALUE) CloseHandle(mailslot_in);
-    if(mailslot_out != INVALID_HANDLE_VALUE) CloseHandle(mailslot_out);
+    IPCCloseOutbox(); // tell the peer we are going away
+    DisableInbox();
+    ClearSend();      // take what is left out of the queue metrics
+    ClearReceive();
 
     FreeSecurityAttribute(&ipc_sa);
 }
@@ -43,20 +75,19 @@ bool IPCController::Initialize(const std::string& id_inbox, const std::string& i
 }
 
 bool IPCController::InitializeInbox(const std::string& id_inbox) {
-    if(ipc_valid_inbox){
-        CloseHandle(mailslot_in);
-        mailslot_in = INVALID_HANDLE_VALUE;
-        ipc_valid_inbox = false;
-    }
+    std::scoped_lock lock(mtx_inbox);
+    ipc_valid_inbox = false;
 
     if(!id_inbox.empty()){
-        mailslot_in_str = IPC_MAILSLOT_HEADER + id_inbox;
+        inbox_address = id_inbox;
+        flight_source = CFlightRecorder::Default().Source(id_inbox);
     }
 
     ipc_inbox_enabled = true;
 
-    mailslot_in = CreateMailslot(mailslot_in_str.c_str(), 0, MAILSLOT_WAIT_FOREVER, &ipc_sa);
-    if(mailslot_in == INVALID_HANDLE_VALUE){
+    inbox = CreateInboxTransport(inbox_address); // replaces (and closes) any previous inbox
+    inbox->Notify(ipc_reactor->WakeEvent());
+    if(!inbox->Open(inbox_address, &ipc_sa)){
         IPCReportError();
         return false;
     }
@@ -64,48 +95,70 @@ bool IPCController::InitializeInbox(const std::string& id_inbox) {
     ipc_valid_inbox = true;
     ipc_valid = true;
 
+    CFlightRecorder::Default().Record(FLIGHT_IPC_OPEN, flight_source, FLIGHT_INBOX);
     return true;
 }
 
 bool IPCController::InitializeOutbox(const std::string& id_outbox) {
-    if(ipc_valid_outbox){
-        CloseHandle(mailslot_out);
-        mailslot_out = INVALID_HANDLE_VALUE;
-        ipc_valid_outbox = false;
-    }
+    {
+        std::scoped_lock lock(mtx_outbox);
+        outbox_name.clear(); // an explicit address stops following a published name
+        if(!id_outbox.empty() && id_outbox != outbox_address){
+            outbox_address = id_outbox;
+            peer_ready = false; // a different peer has to announce itself
+        }
+        if(!id_outbox.empty() && !ipc_inbox_enabled) flight_source = CFlightRecorder::Default().Source("to " + id_outbox);
 
-    if(!id_outbox.empty()){
-        mailslot_out_str = IPC_MAILSLOT_HEADER + id_outbox;
+        ipc_outbox_enabled = true;
     }
 
-    ipc_outbox_enabled = true;
+    return IPCOpenOutbox(IPC_FRAME_HELLO);
+}
+
+bool IPCController::PublishInbox(const std::string& name, DWORD lease) {
+    if(!ipc_valid_inbox){
+        // one address per process, so several instances can publish side by side
+        if(!InitializeInbox(name + "." + std::to_string(GetCurrentProcessId()))) return false;
+    }
 
-    mailslot_out = CreateFile(mailslot_out_str.c_str(), GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
-    if(mailslot_out == INVALID_HANDLE_VALUE){
+    std::scoped_lock lock(mtx_inbox);
+    if(!IPCRegistry::Default().Register(name, inbox_address, lease)){
         IPCReportError();
         return false;
     }
 
-    ipc_valid_outbox = true;
-    ipc_valid = true;
+    inbox_name = name;
+    inbox_lease = lease;
+    flight_source = CFlightRecorder::Default().Source(name);
+    renew_inbox = GetTickCount64() + lease / 3;
     return true;
 }
 
+bool IPCController::ConnectOutbox(const std::string& name) {
+    {
+        std::scoped_lock lock(mtx_outbox);
+        outbox_name = name;
+        ipc_outbox_enabled = true;
+        if(!ipc_inbox_enabled) flight_source = CFlightRecorder::Default().Source("to " + name);
+    }
+
+    // If the name is not published yet the reactor keeps looking it up.
+    return IPCResolveOutbox() && IPCOpenOutbox(IPC_FRAME_HELLO);
+}
+
 void IPCController::DisableInbox() {
-    if(ipc_valid_inbox){
-        CloseHandle(mailslot_in);
-        mailslot_in = INVALID_HANDLE_VALUE;
-        ipc_valid_inbox = false;
+    std::scoped_lock lock(mtx_inbox);
+    if(!inbox_name.empty()){
+        IPCRegistry::Default().Unregister(inbox_name);
+        inbox_name.clear();
     }
+    inbox.reset();
+    ipc_valid_inbox = false;
     ipc_inbox_enabled = false;
 }
 
 void IPCController::DisableOutbox() {
-    if(ipc_valid_outbox){
-        CloseHandle(mailslot_out);
-        mailslot_out = INVALID_HANDLE_VALUE;
-        ipc_valid_outbox = false;
-    }
+    IPCCloseOutbox();
     ipc_outbox_enabled = false;
 }
 
@@ -117,35 +170,171 @@ void IPCController::Reset() {
 
     ipc_valid = false;
     ipc_valid_inbox = false;
-    ipc_valid_outbox = false;    
+    ipc_valid_outbox = false;
     last_error = 0;
     error_count = 0;
     ipc_inbox_enabled = false;
     ipc_outbox_enabled = false;
+
+    { std::scoped_lock lock(mtx_incoming_messages); }
+    cv_incoming_messages.notify_all(); // release any WaitReceive callers
+}
+
+void IPCController::ClearSend() {
+    {
+        std::scoped_lock lock(mtx_outbox, mtx_outgoing_messages);
+        // Greeting frames come first, so a frame the transport is still
+        // sending is one of them while any are left.
+        size_t partial = outbox ? outbox->Pending() : 0;
+        size_t control = outgoing_control - std::min(outgoing_control, partial);
+        Metrics().outgoing.Sub(outgoing_messages.size() + outgoing_batch.size() - control);
+        outgoing_control -= control;
+        outgoing_messages.clear();
+        outgoing_batch.clear();
+        outgoing_unwritten = 0;
+    }
+    cv_outgoing_messages.notify_all();
+}
+
+void IPCController::ClearReceive() {
+    std::scoped_lock lock(mtx_incoming_messages);
+    incoming_messages = {};
+    IPCSetIncomingPending(0);
+    sender_buckets.clear();
+    deferred_pending = 0;
+}
+
+void IPCController::SetRateLimit(const IPCRateLimit& limit) {
+    bool released;
+    {
+        std::scoped_lock lock(mtx_incoming_messages);
+
+        // Deliver whatever the old limit held back, then start every sender on a full bucket.
+        released = deferred_pending != 0;
+        for(auto& [sender, bucket] : sender_buckets){
+            for(IPCMessage& message : bucket.deferred) incoming_messages.emplace(std::move(message));
+        }
+        sender_buckets.clear();
+        deferred_pending = 0;
+        IPCSetIncomingPending(incoming_messages.size());
+
+        rate_limit = limit;
+    }
+    cv_incoming_messages.notify_all();
+    if(released) IPCNotifyReceive();
+}
+
+void IPCController::SetReceiveNotify(std::function<void()> notify) {
+    std::scoped_lock lock(mtx_receive_notify);
+    receive_notify = std::move(notify);
+}
+
+// Tell the owner that messages are ready, outside the queue lock so notify may Receive
+void IPCController::IPCNotifyReceive() {
+    std::scoped_lock lock(mtx_receive_notify);
+    if(receive_notify) receive_notify();
 }
 
 bool IPCController::Send(const std::string& data) {
     if(!ipc_valid) return false;
     std::scoped_lock lock(mtx_outgoing_messages);
 
-    outgoing_messages.emplace(data);
+    outgoing_messages.emplace_back(data); // encoded by the reactor with whatever codec is in use then
+    Metrics().outgoing.Add();
+    ipc_reactor->Wake(); // flush without waiting for the idle timeout
     return true;
 }
 
+bool IPCController::Flush(DWORD timeout) {
+    std::unique_lock lock(mtx_outgoing_messages);
+    auto written = [&](){ return outgoing_messages.empty() && outgoing_unwritten == 0; };
+
+    if(timeout == INFINITE){
+        cv_outgoing_messages.wait(lock, written);
+        return true;
+    }
+    return cv_outgoing_messages.wait_for(lock, std::chrono::milliseconds(timeout), written);
+}
+
 bool IPCController::Receive(std::string& data) {
-    if(!ipc_valid || incoming_messages.empty()) return false;
+    IPCMessageInfo info;
+    return Receive(data, info);
+}
+
+bool IPCController::Receive(std::string& data, IPCMessageInfo& info) {
+    if(!ipc_valid) return false;
     std::scoped_lock lock(mtx_incoming_messages);
+    if(incoming_messages.empty()) return false;
 
-    data = incoming_messages.front();
+    data = std::move(incoming_messages.front().data);
+    info = incoming_messages.front().info;
     incoming_messages.pop();
+    IPCSetIncomingPending(incoming_messages.size());
     return true;
 }
 
+bool IPCController::WaitReceive(std::string& data, DWORD timeout) {
+    if(!ipc_valid) return false;
+
+    if(spin_budget.count()){
+        // busy-poll the queue size without touching the lock
+        auto deadline = std::chrono::steady_clock::now() + spin_budget;
+        do {
+            if(incoming_pending && Receive(data)){
+                ipc_stats.spin_hits++;
+                return true;
+            }
+            YieldProcessor();
+        } while(std::chrono::steady_clock::now() < deadline);
+        ipc_stats.spin_misses++;
+    }
+
+    std::unique_lock lock(mtx_incoming_messages);
+    auto ready = [&](){ return !incoming_messages.empty() || !ipc_valid; };
+
+    if(timeout == INFINITE){
+        cv_incoming_messages.wait(lock, ready);
+    } else {
+        cv_incoming_messages.wait_for(lock, std::chrono::milliseconds(timeout), ready);
+    }
+    if(incoming_messages.empty()) return false;
+
+    data = std::move(incoming_messages.front().data);
+    incoming_messages.pop();
+    IPCSetIncomingPending(incoming_messages.size());
+    return true;
+}
+
+bool IPCController::IsPeerReady() const {
+    if(!ipc_inbox_enabled && !ipc_outbox_enabled) return false;
+
+    // The outbox being open means the peer's inbox exists, and a HELLO or READY
+    // in our inbox means the peer has opened its outbox back to us.
+    return (!ipc_outbox_enabled || ipc_valid_outbox) && (!ipc_inbox_enabled || peer_ready);
+}
+
+bool IPCController::WaitForPeer(DWORD timeout) {
+    std::unique_lock lock(mtx_peer);
+    auto ready = [&](){ return IsPeerReady(); };
+
+    if(timeout == INFINITE){
+        cv_peer.wait(lock, ready);
+        return true;
+    }
+    return cv_peer.wait_for(lock, std::chrono::milliseconds(timeout), ready);
+}
+
+std::string IPCController::PeerAddress() {
+    std::scoped_lock lock(mtx_peer);
+    return peer_address;
+}
+
 bool IPCController::Peek(std::string& data) {
-    if(!ipc_valid || incoming_messages.empty()) return false;
+    if(!ipc_valid) return false;
     std::scoped_lock lock(mtx_incoming_messages);
+    if(incoming_messages.empty()) return false;
 
-    data = incoming_messages.front();
+    data = incoming_messages.front().data;
     return true;
 }
 
@@ -156,108 +345,470 @@ bool IPCController::Peek(std::string& data) {
 void IPCController::IPCReportError() {
     last_error = GetLastError();
     error_count++;
+    Metrics().errors.Add();
+    CFlightRecorder::Default().Record(FLIGHT_ERROR, flight_source, last_error);
 }
 
-// IPC Thread Handle
-void IPCController::IPCHandle() {
-    ipc_running = true;
+// Service the transports once - called from the reactor thread
+bool IPCController::IPCPoll(ULONGLONG tick) {
+    bool busy = false;
 
-    while(ipc_running){
-        if(ipc_inbox_enabled){
-            if(!ipc_valid_inbox){
-                if(!InitializeInbox()) Sleep(100); // idle timeouts
-            }
-            IPCReadData(); // process incoming messages
+    if(ipc_inbox_enabled){
+        if(!ipc_valid_inbox && tick >= retry_inbox){
+            if(!InitializeInbox()) retry_inbox = tick + 100; // idle timeouts
         }
+        busy |= IPCReadData(); // process incoming messages
 
-        if(ipc_outbox_enabled){
-            if(!ipc_valid_outbox){
-                if(!InitializeOutbox()) Sleep(100); // idle timeouts
+        std::scoped_lock lock(mtx_inbox);
+        if(!inbox_name.empty() && tick >= renew_inbox){
+            IPCRegistry::Default().Register(inbox_name, inbox_address, inbox_lease);
+            renew_inbox = tick + inbox_lease / 3;
+        }
+    }
+
+    if(ipc_outbox_enabled){
+        if(peer_greeted.exchange(false)){
+            IPCResolveOutbox();
+            if(!IPCOpenOutbox(IPC_FRAME_READY) && GetLastError() == WSAEWOULDBLOCK){ // answer on a fresh handle in case the peer restarted
+                peer_greeted = true; // answer once the connect completes
+            }
+        } else if(!ipc_valid_outbox && tick >= retry_outbox){
+            if(IPCResolveOutbox() && IPCOpenOutbox(IPC_FRAME_HELLO)){
+                retry_backoff = IPC_RETRY_MIN;
+            } else if(GetLastError() == WSAEWOULDBLOCK){
+                retry_outbox = tick + IPC_RETRY_MIN; // a connect in progress is looked at again soon
+            } else {
+                // Retry quickly so a starting peer is found promptly, backing off for
+                // remote peers whose every attempt costs a connect
+                retry_outbox = tick + retry_backoff;
+                if(outbox_address.rfind(IPC_TCP_SCHEME, 0) == 0) retry_backoff = std::min(retry_backoff * 2, IPC_RETRY_MAX);
             }
-            IPCWriteData(); // process outgoing messages
         }
-        Sleep(25); // idle sleep
+        busy |= IPCWriteData(); // process outgoing messages
     }
+
+    if(busy) ipc_stats.wakeups++;
+    return busy;
 }
 
+// (Re)open the outbox transport and greet the peer through it
+bool IPCController::IPCOpenOutbox(IPCFrameType greeting) {
+    std::string address;
+    {
+        std::scoped_lock lock(mtx_inbox);
+        if(ipc_inbox_enabled) address = inbox_address; // where the peer can answer us
+    }
 
-// Write Data to connected mailslot
-bool IPCController::IPCWriteData() {
-    std::scoped_lock lock(mtx_outgoing_messages);
-    if(!ipc_valid_outbox || outgoing_messages.empty()) return false;
+    std::scoped_lock lock(mtx_outbox);
+    ipc_valid_outbox = false;
 
-    for(const std::string& data = outgoing_messages.front(); !outgoing_messages.empty(); outgoing_messages.pop()){
-        DWORD written;
-        if(!WriteFile(mailslot_out, (LPCVOID)data.c_str(), (DWORD)data.size(), &written, NULL)){ 
-            IPCReportError();
-            ipc_valid_outbox = false;
-            return false;
+    // A connect still in progress is given the chance to finish; otherwise the
+    // transport is replaced, handing back a message it had only partly sent.
+    if(!outbox || !outbox->Connecting()){
+        if(outbox) outbox->Requeue(outgoing_batch);
+        outbox = CreateOutboxTransport(outbox_address);
+    }
+
+    if(!outbox->Open(outbox_address)){
+        if(GetLastError() != WSAEWOULDBLOCK) IPCReportError(); // still connecting is not a failure
+        return false;
+    }
+
+    // Whatever of the greeting the socket did not take goes out ahead of the
+    // queued messages, kept out of the message counts. The transport is fresh
+    // or was still connecting, so a frame it holds back is the greeting's.
+    // A peer that does not frame would take the greeting for messages, so it is not greeted.
+    std::deque<std::string> hello;
+    if(peer_version != IPC_PROTOCOL_PLAIN) hello = { IPCMakeFrame(greeting, address), IPCMakeCapabilities() };
+    bool written = hello.empty() || outbox->Write(hello, ipc_stats);
+    outgoing_control += outbox->Pending();
+    if(!written){
+        IPCReportError();
+        return false;
+    }
+    outgoing_control += hello.size();
+    for(; !hello.empty(); hello.pop_back()) outgoing_batch.push_front(std::move(hello.back()));
+
+    ipc_valid_outbox = true;
+    ipc_valid = true;
+    CFlightRecorder::Default().Record(FLIGHT_IPC_OPEN, flight_source, FLIGHT_OUTBOX, greeting);
+
+    IPCNotifyPeer();
+    return true;
+}
+
+bool IPCController::IPCResolveOutbox() {
+    std::scoped_lock lock(mtx_outbox);
+    if(outbox_name.empty()) return true; // explicit address
+
+    std::string address;
+    if(!IPCRegistry::Default().Lookup(outbox_name, address)){
+        IPCReportError();
+        return false;
+    }
+
+    if(address != outbox_address){
+        outbox_address = address;
+        peer_ready = false; // a different instance has to announce itself
+        IPCNegotiate(NULL); // and is greeted, whatever the last one understood
+    }
+    return true;
+}
+
+void IPCController::IPCCloseOutbox() {
+    std::scoped_lock lock(mtx_outbox);
+    if(outbox && outbox->Pending()){
+        outbox->Requeue(outgoing_batch); // sent whole on the next connection, no BYE after half a frame
+    } else if(ipc_valid_outbox && peer_version != IPC_PROTOCOL_PLAIN){
+        std::deque<std::string> bye { IPCMakeFrame(IPC_FRAME_BYE) };
+        outbox->Write(bye, ipc_stats);
+    }
+    outbox.reset();
+    ipc_valid_outbox = false;
+}
+
+std::string IPCController::IPCMakeFrame(IPCFrameType type, const std::string& payload, uint16_t flags) {
+    IPCFrameHeader header {};
+    memcpy(header.magic, IPC_FRAME_MAGIC, sizeof(header.magic));
+    header.version = IPC_FRAME_VERSION;
+    header.type = type;
+    header.flags = flags | (ipc_checksum ? IPC_FRAME_CRC : 0);
+    header.sender = sender_id;
+    header.sequence = frame_sequence++;
+
+    std::string frame((const char*)&header, sizeof(header));
+    if(header.flags & IPC_FRAME_CRC){
+        uint32_t crc = Crc32c(payload.data(), payload.size(), Crc32c(&header, sizeof(header)));
+        frame.append((const char*)&crc, sizeof(crc));
+    }
+    frame += payload;
+    return frame;
+}
+
+bool IPCController::IPCHandleFrame(std::string& data, IPCMessageInfo& info) {
+    IPCFrameHeader header;
+    if(data.size() < sizeof(header) || memcmp(data.data(), IPC_FRAME_MAGIC, sizeof(header.magic)) != 0) return false;
+    memcpy(&header, data.data(), sizeof(header));
+
+    size_t offset = sizeof(header);
+    if(header.flags & IPC_FRAME_CRC){
+        uint32_t crc;
+        if(data.size() < offset + sizeof(crc)){
+            ipc_stats.checksum_errors++;
+            Metrics().dropped.Add();
+            return true;
+        }
+        memcpy(&crc, data.data() + offset, sizeof(crc));
+        offset += sizeof(crc);
+
+        if(Crc32c(data.data() + offset, data.size() - offset, Crc32c(&header, sizeof(header))) != crc){
+            ipc_stats.checksum_errors++;
+            Metrics().dropped.Add();
+            return true; // dropped
+        }
+    }
+
+    if(header.type != IPC_FRAME_DATA){
+        CFlightRecorder::Default().Record(FLIGHT_IPC_PEER, flight_source, header.type, header.sender);
+    }
+
+    switch(header.type){
+    case IPC_FRAME_DATA: // unwrap to the user message
+        info.sender = header.sender;
+        info.sequence = header.sequence;
+        if(header.flags & IPC_FRAME_COMPRESSED){
+            if(!compressor.Decompress(std::string_view(data).substr(offset), codec_buffer)){
+                ipc_stats.decode_errors++;
+                Metrics().dropped.Add();
+                return true; // dropped
+            }
+            data.swap(codec_buffer);
+        } else {
+            data.erase(0, offset);
         }
+        return false;
+    case IPC_FRAME_HELLO:
+        peer_greeted = true; // answered from the outbox side of IPCPoll
+        [[fallthrough]];
+    case IPC_FRAME_READY:
+        {
+            std::scoped_lock lock(mtx_peer);
+            peer_address = data.substr(offset);
+        }
+        IPCNegotiate(NULL); // plain until the CAPS frame that follows, if the peer sends one
+        peer_ready = true;
+        IPCNotifyPeer();
+        break;
+    case IPC_FRAME_CAPS:
+        if(data.size() - offset >= sizeof(IPCCapabilities)){
+            IPCCapabilities caps;
+            memcpy(&caps, data.data() + offset, sizeof(caps));
+            IPCNegotiate(&caps);
+        }
+        break;
+    case IPC_FRAME_BYE:
+        peer_ready = false;
+        IPCNegotiate(NULL);
+        break;
+    default: break; // unknown control frames are dropped
     }
     return true;
 }
 
-// Read Data from connected mailslot
-bool IPCController::IPCReadData() {
-    std::scoped_lock lock(mtx_incoming_messages);
+std::string IPCController::IPCMakeCapabilities() {
+    IPCCapabilities caps {};
+    caps.version = IPC_PROTOCOL_VERSION;
+    caps.codecs = local_codecs;
+    caps.transports = IPC_TRANSPORT_MAILSLOT | IPC_TRANSPORT_TCP;
+    return IPCMakeFrame(IPC_FRAME_CAPS, std::string((const char*)&caps, sizeof(caps)));
+}
 
-    if(!ipc_valid_inbox) return false;
+void IPCController::IPCNegotiate(const IPCCapabilities* caps) {
+    if(!caps){ // a peer from before capabilities: frames, but nothing beyond plain data
+        peer_version = 1;
+        peer_transports = 0;
+        send_codec = IPC_CODEC_PLAIN;
+        return;
+    }
 
-    DWORD szNextMsg, szMsg;
-    DWORD timeout = 2000;
-    char cacheBuf[BUFSIZE] {};
-    std::stringstream msgCache;
+    peer_version = std::clamp<uint8_t>(caps->version, 1, IPC_PROTOCOL_VERSION); // it frames, having sent this
+    peer_transports = caps->transports;
 
-    szNextMsg = szMsg = 0;
+    // Compression costs more CPU than it saves on a local transport, so it is
+    // only chosen when the peer is reached over the network.
+    bool remote;
+    {
+        std::scoped_lock lock(mtx_peer);
+        remote = peer_address.rfind(IPC_TCP_SCHEME, 0) == 0;
+    }
+    uint16_t common = caps->codecs & local_codecs;
+    send_codec = remote && (common & IPC_CODEC_COMPRESSED) ? IPC_CODEC_COMPRESSED : IPC_CODEC_PLAIN;
+}
 
-    if(!GetMailslotInfo( mailslot_in, (LPDWORD) NULL, &szNextMsg, &szMsg, &timeout)){
+// Frame a queued message for the peer - called from the reactor thread
+std::string IPCController::IPCEncode(std::string& data) {
+    // Data frames carry our sender id. A peer that has greeted us understands
+    // them; without an inbox we never hear from the peer and assume it does.
+    if(ipc_inbox_enabled && !peer_ready) return std::move(data);
+
+    if(send_codec == IPC_CODEC_COMPRESSED && data.size() >= IPC_COMPRESS_THRESHOLD && compressor.Compress(data, codec_buffer)){
+        return IPCMakeFrame(IPC_FRAME_DATA, codec_buffer, IPC_FRAME_COMPRESSED);
+    }
+    return IPCMakeFrame(IPC_FRAME_DATA, data);
+}
+
+void IPCController::IPCNotifyPeer() {
+    { std::scoped_lock lock(mtx_peer); }
+    cv_peer.notify_all();
+}
+
+
+// The trace flow of an encoded data frame, 0 for plain messages
+static uint64_t IPCTraceFlow(const std::string& frame) {
+    IPCFrameHeader header;
+    if(frame.size() < sizeof(header) || memcmp(frame.data(), IPC_FRAME_MAGIC, sizeof(header.magic)) != 0) return 0;
+    memcpy(&header, frame.data(), sizeof(header));
+    return header.type == IPC_FRAME_DATA ? CTracer::MessageFlow(header.sender, header.sequence) : 0;
+}
+
+// Write every queued message to the outbox transport
+bool IPCController::IPCWriteData() {
+    std::scoped_lock lock(mtx_outbox);
+    if(!ipc_valid_outbox) return false;
+
+    {
+        // Take the whole queue at once so Send is never blocked behind the writes
+        // or the encoding. Messages left over from a failed write are already
+        // encoded and stay at the front of the batch.
+        std::scoped_lock lock(mtx_outgoing_messages);
+        outgoing_taken.swap(outgoing_messages);
+        outgoing_unwritten = outgoing_taken.size() + outgoing_batch.size() + outbox->Pending() - outgoing_control;
+    }
+    // While tracing, each data frame starts a flow the receiving process ends.
+    CTracer& tracer = CTracer::Default();
+    bool tracing = tracer.IsTracing();
+    for(std::string& data : outgoing_taken){
+        uint64_t start = tracing ? CTracer::Now() : 0;
+        ipc_capture.Record(IPC_CAPTURE_OUTGOING, outgoing_batch.emplace_back(IPCEncode(data)));
+        CFlightRecorder::Default().Record(FLIGHT_IPC_SEND, flight_source, (uint32_t)outgoing_batch.back().size(), (uint32_t)outgoing_batch.size());
+        if(tracing) tracer.Complete("ipc send", "ipc", start, CTracer::Now(), IPCTraceFlow(outgoing_batch.back()), TRACE_FLOW_OUT);
+    }
+    outgoing_taken.clear();
+
+    // A message the transport could only partly send is finished even when nothing new is queued
+    size_t queued = outgoing_batch.size() + outbox->Pending();
+    if(queued == 0) return false;
+
+    CTraceSpan span("ipc write", "ipc");
+    IPCMetrics& metrics = Metrics();
+    size_t bytes = ipc_stats.bytes_sent;
+    auto start = std::chrono::steady_clock::now();
+
+    bool written = outbox->Write(outgoing_batch, ipc_stats);
+    metrics.write.Observe(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    size_t unwritten = outgoing_batch.size() + outbox->Pending(); // a failed write leaves the rest at the front
+    size_t control = std::min(outgoing_control, queued - unwritten); // the greeting leads, and was never a message
+    outgoing_control -= control;
+    metrics.sent.Add(queued - unwritten - control);
+    metrics.outgoing.Sub(queued - unwritten - control);
+    {
+        std::scoped_lock lock(mtx_outgoing_messages);
+        outgoing_unwritten = unwritten - outgoing_control; // Flush waits for these too
+    }
+    cv_outgoing_messages.notify_all();
+
+    if(!written){
         IPCReportError();
+        ipc_valid_outbox = false;
         return false;
     }
+    return ipc_stats.bytes_sent != bytes; // a full socket is retried on the next pass rather than spun on
+}
 
-    if (szNextMsg == MAILSLOT_NO_MESSAGE) return false;
+// Keep the incoming queue size and its share of the process-wide gauge in step
+void IPCController::IPCSetIncomingPending(size_t pending) {
+    Metrics().incoming.Add((int64_t)pending - (int64_t)incoming_pending.exchange(pending));
+}
 
-    while(szMsg != 0){
-        DWORD totalBytes = 0;
-        DWORD retryCount = 4;
-        bool alloc = szNextMsg > BUFSIZE;
+// Reap every available message from the inbox transport
+bool IPCController::IPCReadData() {
+    {
+        std::scoped_lock lock(mtx_inbox);
+        if(!ipc_valid_inbox) return false;
 
-        char* pCache = alloc ? new char[szNextMsg] : cacheBuf;
+        if(!inbox->Read(incoming_batch, ipc_stats)){
+            IPCReportError();
+            ipc_valid_inbox = false;
+        }
+    }
 
-        do {
-            DWORD bytes;
-            if(!ReadFile(mailslot_in, pCache, szNextMsg, &bytes, NULL)){
-                IPCReportError();
-                if(alloc) delete[] pCache;
-                return false;
+    if(incoming_batch.empty() && !deferred_pending) return false;
+
+    bool delivered;
+    {
+        CTracer& tracer = CTracer::Default();
+        bool tracing = tracer.IsTracing();
+        auto now = std::chrono::steady_clock::now();
+        std::scoped_lock lock(mtx_incoming_messages);
+
+        // Earlier deferred messages go first so each sender's order is kept.
+        delivered = IPCReleaseDeferred(now);
+        size_t reaped = 0;
+
+        for(std::string& data : incoming_batch){
+            ipc_capture.Record(IPC_CAPTURE_INCOMING, data);
+
+            IPCMessage message;
+            uint32_t bytes = (uint32_t)data.size();
+            uint64_t start = tracing ? CTracer::Now() : 0;
+            if(IPCHandleFrame(data, message.info)) continue;
+            // Frame-aware peers greet before they send anything, and plain text
+            // without a greeting comes from a peer that does not frame at all.
+            if(!message.info.sender && !peer_ready) peer_version = IPC_PROTOCOL_PLAIN;
+            CFlightRecorder::Default().Record(FLIGHT_IPC_RECEIVE, flight_source, bytes, message.info.sender);
+            reaped++;
+            if(tracing){
+                uint64_t flow = message.info.sender ? CTracer::MessageFlow(message.info.sender, message.info.sequence) : 0;
+                tracer.Complete("ipc receive", "ipc", start, CTracer::Now(), flow, TRACE_FLOW_IN);
             }
-            if(bytes == 0){
-                if(--retryCount == 0){
-                    IPCReportError();
-                    if(alloc) delete[] pCache;
-                    return false;
-                }
-                Sleep(100);
-                continue;
+
+            message.data = std::move(data);
+            if(IPCAdmit(message, now)){
+                incoming_messages.emplace(std::move(message));
+                delivered = true;
             }
+        }
+        IPCSetIncomingPending(incoming_messages.size());
+        Metrics().received.Add(reaped);
+    }
 
-            msgCache.write(pCache, bytes);
-            totalBytes += bytes;
-        } while(totalBytes < szMsg); // keep reading until message comes through
+    bool received = !incoming_batch.empty();
+    incoming_batch.clear();
+    if(delivered){
+        cv_incoming_messages.notify_all();
+        IPCNotifyReceive();
+    }
 
-        if(alloc) delete[] pCache;
+    return received || delivered;
+}
 
-        incoming_messages.emplace(msgCache.str());
-        msgCache.str("");
- 
-        if(!GetMailslotInfo( mailslot_in, (LPDWORD) NULL, &szNextMsg, &szMsg, &timeout)){
-            IPCReportError();
-            ipc_valid_inbox = false;
+// Decide whether a message may be queued now - called with mtx_incoming_messages held
+bool IPCController::IPCAdmit(IPCMessage& message, std::chrono::steady_clock::time_point now) {
+    if(rate_limit.messages_per_second <= 0 && rate_limit.bytes_per_second <= 0) return true;
+
+    if(sender_buckets.size() >= 1024 && !sender_buckets.count(message.info.sender)){
+        // forget senders idle long enough for their bucket to be full again, e.g. exited children
+        auto idle = std::chrono::duration<double>(rate_limit.burst_seconds);
+        std::erase_if(sender_buckets, [&](const auto& item){
+            return item.second.deferred.empty() && now - item.second.refilled >= idle;
+        });
+    }
+
+    auto [it, created] = sender_buckets.try_emplace(message.info.sender);
+    SenderBucket& bucket = it->second;
+    if(created){ // a new sender starts with a full bucket
+        bucket.messages = rate_limit.messages_per_second * rate_limit.burst_seconds;
+        bucket.bytes = rate_limit.bytes_per_second * rate_limit.burst_seconds;
+        bucket.refilled = now;
+    }
+
+    // A sender with deferred messages queues behind them.
+    if(bucket.deferred.empty() && IPCTakeTokens(bucket, message.data.size(), now)) return true;
+
+    switch(rate_limit.action){
+    case IPC_THROTTLE_DEFER:
+        if(bucket.deferred.size() < rate_limit.max_deferred){
+            bucket.deferred.emplace_back(std::move(message));
+            deferred_pending++;
+            ipc_stats.throttled_deferred++;
             return false;
         }
+        [[fallthrough]]; // backlog full
+    case IPC_THROTTLE_DROP:
+        ipc_stats.throttled_dropped++;
+        Metrics().dropped.Add();
+        return false;
+    case IPC_THROTTLE_FLAG:
+        message.info.throttled = true;
+        ipc_stats.throttled_flagged++;
+        return true;
+    }
+    return true;
+}
 
-        if (szNextMsg == MAILSLOT_NO_MESSAGE) break;
+// Queue deferred messages whose sender has earned the tokens for them
+bool IPCController::IPCReleaseDeferred(std::chrono::steady_clock::time_point now) {
+    if(!deferred_pending) return false;
+
+    bool released = false;
+    for(auto& [sender, bucket] : sender_buckets){
+        while(!bucket.deferred.empty() && IPCTakeTokens(bucket, bucket.deferred.front().data.size(), now)){
+            incoming_messages.emplace(std::move(bucket.deferred.front()));
+            bucket.deferred.pop_front();
+            deferred_pending--;
+            released = true;
+        }
     }
+    return released;
+}
+
+// Refill a bucket for the time elapsed and take the cost of one message from it
+bool IPCController::IPCTakeTokens(SenderBucket& bucket, size_t bytes, std::chrono::steady_clock::time_point now) {
+    double elapsed = std::chrono::duration<double>(now - bucket.refilled).count();
+    bucket.refilled = now;
+
+    double max_messages = rate_limit.messages_per_second * rate_limit.burst_seconds;
+    double max_bytes = rate_limit.bytes_per_second * rate_limit.burst_seconds;
+    bucket.messages = std::min(max_messages, bucket.messages + elapsed * rate_limit.messages_per_second);
+    bucket.bytes = std::min(max_bytes, bucket.bytes + elapsed * rate_limit.bytes_per_second);
 
+    // A message larger than the whole bucket passes once the bucket is full,
+    // leaving the sender in debt rather than blocking it forever.
+    bool has_message = rate_limit.messages_per_second <= 0 || bucket.messages >= std::min(1.0, max_messages);
+    bool has_bytes = rate_limit.bytes_per_second <= 0 || bucket.bytes >= std::min((double)bytes, max_bytes);
+    if(!has_message || !has_bytes) return false;
+
+    if(rate_limit.messages_per_second > 0) bucket.messages -= 1;
+    if(rate_limit.bytes_per_second > 0) bucket.bytes -= bytes;
     return true;
-}
\ No newline at end of file
+}
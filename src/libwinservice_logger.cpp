@@ -0,0 +1,327 @@
+#include "libwinservice.h"
+#include <charconv>
+
+static_assert((LOG_BUFFER_SIZE & (LOG_BUFFER_SIZE - 1)) == 0, "the buffer size must be a power of two");
+
+// Every Open gets a new id, so a thread never reuses a buffer of a closed log
+static std::atomic<uint64_t> s_loggerIds {0};
+
+CLogger::CLogger():
+    logging(false), min_level(LOG_INFO), logger_id(0),
+    flush_requested(0), flush_completed(0), flush_wake(false),
+    file(INVALID_HANDLE_VALUE), file_bytes(0), output_lines(0), format_second(-1) {}
+
+CLogger::~CLogger() {
+    Close();
+}
+
+bool CLogger::Open(const std::string& path, const CLogRotation& logRotation) {
+    Close();
+
+    file_path = path;
+    rotation = logRotation;
+    if(!OpenFile(false)) return false;
+
+    logger_id = ++s_loggerIds;
+    logging = true;
+    flusher_thread = std::thread(&CLogger::FlusherHandle, this);
+    return true;
+}
+
+void CLogger::Close() {
+    if(flusher_thread.joinable()){
+        {
+            std::scoped_lock lock(mtx_flush);
+            logging = false;
+        }
+        cv_flush.notify_all();
+        flusher_thread.join(); // the flusher writes out what is buffered before it exits
+    }
+
+    {
+        std::scoped_lock lock(mtx_buffers);
+        for(auto& buffer : buffers) buffer->retired = true; // threads drop them on their next log call
+        buffers.clear();
+    }
+
+    if(file != INVALID_HANDLE_VALUE){
+        CloseHandle(file);
+        file = INVALID_HANDLE_VALUE;
+    }
+}
+
+void CLogger::Flush() {
+    std::unique_lock lock(mtx_flush);
+    if(!logging) return;
+
+    uint64_t ticket = ++flush_requested;
+    cv_flush.notify_all();
+    cv_flush.wait(lock, [&](){ return flush_completed >= ticket || !logging; });
+}
+
+
+// Thread Buffers
+
+CLogger::Buffer* CLogger::ThreadBuffer() {
+    struct ThreadBuffers {
+        std::vector<std::pair<uint64_t, std::shared_ptr<Buffer>>> owned;
+        ~ThreadBuffers() {
+            for(auto& [id, buffer] : owned) buffer->retired = true;
+        }
+    };
+    thread_local ThreadBuffers cache;
+
+    for(auto& [id, buffer] : cache.owned){
+        if(id == logger_id) return buffer.get();
+    }
+
+    // First line from this thread: drop the buffers of closed logs and register a new one.
+    cache.owned.erase(std::remove_if(cache.owned.begin(), cache.owned.end(),
+        [](auto& owned){ return owned.second->retired.load(); }), cache.owned.end());
+
+    auto buffer = std::make_shared<Buffer>();
+    buffer->name = std::to_string(GetCurrentThreadId()) + " ";
+    {
+        std::scoped_lock lock(mtx_buffers);
+        buffers.push_back(buffer);
+    }
+    cache.owned.emplace_back(logger_id, buffer);
+    return buffer.get();
+}
+
+char* CLogger::Reserve(Buffer& buffer, size_t size) {
+    if(size > LOG_BUFFER_SIZE / 2) return nullptr;
+
+    size_t head = buffer.head.load(std::memory_order_relaxed);
+    size_t tail = buffer.tail.load(std::memory_order_acquire);
+    size_t offset = head & (LOG_BUFFER_SIZE - 1);
+
+    // Records never wrap: skip the end of the buffer if the record does not fit there.
+    size_t padding = LOG_BUFFER_SIZE - offset < size ? LOG_BUFFER_SIZE - offset : 0;
+    if(head + padding + size - tail > LOG_BUFFER_SIZE) return nullptr;
+
+    if(padding){
+        uint32_t marker = (uint32_t)padding | RECORD_PADDING;
+        memcpy(buffer.data.get() + offset, &marker, sizeof(marker));
+        buffer.head.store(head + padding, std::memory_order_release);
+        offset = 0;
+    }
+    return buffer.data.get() + offset;
+}
+
+void CLogger::Commit(Buffer& buffer, size_t size) {
+    size_t head = buffer.head.load(std::memory_order_relaxed) + size;
+    buffer.head.store(head, std::memory_order_release);
+
+    // Only a burst filling half the buffer within one interval wakes the flusher early.
+    if(head - buffer.tail.load(std::memory_order_relaxed) >= LOG_BUFFER_SIZE / 2 && !flush_wake.exchange(true)){
+        cv_flush.notify_one();
+    }
+}
+
+
+// Flusher Thread Handle
+void CLogger::FlusherHandle() {
+    std::unique_lock lock(mtx_flush);
+    for(;;){
+        bool running = logging; // read first, so lines logged before Close are still written
+        uint64_t requested = flush_requested;
+        flush_wake = false;
+        lock.unlock();
+
+        Collect();
+        WriteOut();
+
+        lock.lock();
+        flush_completed = requested;
+        cv_flush.notify_all();
+        if(!running) break;
+
+        cv_flush.wait_for(lock, std::chrono::milliseconds(LOG_FLUSH_INTERVAL),
+            [&](){ return flush_requested != flush_completed || flush_wake || !logging; });
+    }
+}
+
+void CLogger::Collect() {
+    struct Cursor {
+        Buffer* buffer;
+        size_t tail, head;
+    };
+    std::vector<std::shared_ptr<Buffer>> current;
+    {
+        std::scoped_lock lock(mtx_buffers);
+        current = buffers;
+    }
+
+    std::vector<Cursor> cursors;
+    for(auto& buffer : current){
+        cursors.push_back({ buffer.get(), buffer->tail.load(std::memory_order_relaxed), buffer->head.load(std::memory_order_acquire) });
+    }
+    auto next = [](Cursor& cursor) -> const Record* {
+        while(cursor.tail != cursor.head){
+            const char* data = cursor.buffer->data.get() + (cursor.tail & (LOG_BUFFER_SIZE - 1));
+            uint32_t size;
+            memcpy(&size, data, sizeof(size));
+            if(!(size & RECORD_PADDING)) return (const Record*)data;
+            cursor.tail += size & ~RECORD_PADDING;
+        }
+        return nullptr;
+    };
+
+    if(rotation.max_seconds && std::chrono::steady_clock::now() - file_opened >= std::chrono::seconds(rotation.max_seconds)){
+        Rotate();
+    }
+
+    // Each buffer is already in time order, so merging them by their next
+    // record writes the lines of every thread in time order.
+    for(;;){
+        Cursor* earliest = nullptr;
+        const Record* record = nullptr;
+        for(Cursor& cursor : cursors){
+            const Record* candidate = next(cursor);
+            if(candidate && (!record || candidate->time < record->time)){
+                record = candidate;
+                earliest = &cursor;
+            }
+        }
+        if(!record) break;
+
+        if(rotation.max_bytes && file_bytes + output.size() >= rotation.max_bytes){
+            WriteOut();
+            Rotate();
+        }
+        Format(*record, (const char*)record + sizeof(Record), *earliest->buffer, output);
+        earliest->tail += record->size;
+
+        // Hand space back to the threads as we go rather than at the end of a long pass.
+        if(++output_lines % 1024 == 0) earliest->buffer->tail.store(earliest->tail, std::memory_order_release);
+    }
+
+    for(Cursor& cursor : cursors) cursor.buffer->tail.store(cursor.tail, std::memory_order_release);
+
+    // Forget the buffers of threads that have exited once they are drained.
+    std::scoped_lock lock(mtx_buffers);
+    buffers.erase(std::remove_if(buffers.begin(), buffers.end(), [](auto& buffer){
+        return buffer->retired && buffer->head.load() == buffer->tail.load();
+    }), buffers.end());
+}
+
+void CLogger::Format(const Record& record, const char* args, const Buffer& buffer, std::string& text) {
+    using namespace std::chrono;
+    system_clock::time_point time { system_clock::duration(record.time) };
+    time_t second = system_clock::to_time_t(time);
+    unsigned micro = unsigned(duration_cast<microseconds>(time.time_since_epoch()).count() % 1000000);
+
+    if(second != format_second){ // the date only changes once a second
+        tm local {};
+        localtime_s(&local, &second);
+        strftime(format_date, sizeof(format_date), "%Y-%m-%d %H:%M:%S.", &local);
+        format_second = second;
+    }
+
+    static const char* levels[] = { "DEBUG   ", "INFO    ", "WARNING ", "ERROR   " };
+    char digits[6];
+    for(int i = 5; i >= 0; --i, micro /= 10) digits[i] = char('0' + micro % 10);
+    text += format_date;
+    text.append(digits, sizeof(digits));
+    text += ' ';
+    text += levels[std::min<size_t>(record.level, 3)];
+    text += buffer.name;
+
+    char number[32];
+    unsigned argc = record.argc;
+    for(const char* f = record.format; *f; ++f){
+        if(f[0] != '{' || f[1] != '}' || argc == 0){
+            text += *f;
+            continue;
+        }
+        ++f;
+        --argc;
+
+        uint8_t type = (uint8_t)*args++;
+        if(type == ARG_STRING){
+            uint32_t size;
+            memcpy(&size, args, sizeof(size));
+            text.append(args + sizeof(size), size);
+            args += sizeof(size) + size;
+            continue;
+        }
+
+        uint64_t value;
+        memcpy(&value, args, sizeof(value));
+        args += sizeof(value);
+
+        switch(type){
+        case ARG_INT:
+            text.append(number, std::to_chars(number, number + sizeof(number), (int64_t)value).ptr);
+            break;
+        case ARG_UINT:
+            text.append(number, std::to_chars(number, number + sizeof(number), value).ptr);
+            break;
+        case ARG_DOUBLE: {
+            double d;
+            memcpy(&d, &value, sizeof(d));
+            text.append(number, std::to_chars(number, number + sizeof(number), d).ptr);
+            break;
+        }
+        case ARG_BOOL:
+            text += value ? "true" : "false";
+            break;
+        case ARG_CHAR:
+            text += (char)value;
+            break;
+        }
+    }
+    text += "\r\n";
+}
+
+
+// Log File
+
+bool CLogger::WriteOut() {
+    if(output.empty()) return true;
+
+    bool success = false;
+    if(file != INVALID_HANDLE_VALUE){
+        DWORD written;
+        success = WriteFile(file, output.data(), (DWORD)output.size(), &written, NULL) && written == output.size();
+        file_bytes += output.size();
+        stats.bytes += output.size();
+        stats.writes++;
+    }
+    stats.written += output_lines;
+    output_lines = 0;
+    output.clear();
+    return success;
+}
+
+bool CLogger::OpenFile(bool truncate) {
+    file = CreateFile(file_path.c_str(), FILE_APPEND_DATA, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL,
+                      truncate ? CREATE_ALWAYS : OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if(file == INVALID_HANDLE_VALUE) return false;
+
+    LARGE_INTEGER size {};
+    GetFileSizeEx(file, &size);
+    file_bytes = size.QuadPart;
+    file_opened = std::chrono::steady_clock::now();
+    return true;
+}
+
+void CLogger::Rotate() {
+    if(file != INVALID_HANDLE_VALUE){
+        CloseHandle(file);
+        file = INVALID_HANDLE_VALUE;
+    }
+
+    // path.1 is the newest rotated file, path.keep the oldest
+    if(rotation.keep){
+        for(unsigned i = rotation.keep - 1; i > 0; --i){
+            MoveFileEx((file_path + "." + std::to_string(i)).c_str(),
+                       (file_path + "." + std::to_string(i + 1)).c_str(), MOVEFILE_REPLACE_EXISTING);
+        }
+        MoveFileEx(file_path.c_str(), (file_path + ".1").c_str(), MOVEFILE_REPLACE_EXISTING);
+    }
+
+    OpenFile(true);
+    stats.rotations++;
+}
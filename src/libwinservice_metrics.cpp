@@ -0,0 +1,319 @@
+#include "libwinservice.h"
+#include <charconv>
+#include <cmath>
+
+// Metrics
+
+void CMetric::Sample(std::string& out, const char* suffix, const std::string& extra, double value) const {
+    out += name;
+    out += suffix;
+    if(!labels.empty() || !extra.empty()){
+        out += '{';
+        out += labels;
+        if(!labels.empty() && !extra.empty()) out += ',';
+        out += extra;
+        out += '}';
+    }
+    out += ' ';
+
+    if(std::isinf(value)){
+        out += value > 0 ? "+Inf" : "-Inf";
+    } else if(std::isnan(value)){
+        out += "NaN";
+    } else {
+        // Whole numbers, which counts always are, are written without an exponent
+        char text[32];
+        auto result = value == std::trunc(value) && std::fabs(value) < 9007199254740992.0 ?
+            std::to_chars(text, text + sizeof(text), (int64_t)value) :
+            std::to_chars(text, text + sizeof(text), value);
+        out.append(text, result.ptr - text);
+    }
+    out += '\n';
+}
+
+void CMetricCounter::Format(std::string& out) const {
+    Sample(out, "", "", (double)Value());
+}
+
+void CMetricGauge::Format(std::string& out) const {
+    Sample(out, "", "", (double)Value());
+}
+
+CMetricHistogram::CMetricHistogram(const std::vector<double>& buckets):
+    CMetric(METRIC_HISTOGRAM), bounds(buckets), counts(new std::atomic_uint64_t[buckets.size() + 1])
+{
+    std::sort(bounds.begin(), bounds.end());
+    bounds.erase(std::unique(bounds.begin(), bounds.end()), bounds.end());
+    for(size_t i = 0; i <= bounds.size(); ++i) counts[i] = 0;
+}
+
+uint64_t CMetricHistogram::Count() const {
+    uint64_t count = 0;
+    for(size_t i = 0; i <= bounds.size(); ++i) count += counts[i].load(std::memory_order_relaxed);
+    return count;
+}
+
+void CMetricHistogram::Format(std::string& out) const {
+    // Buckets are cumulative in the exposition format
+    uint64_t cumulative = 0;
+    char bound[32];
+    for(size_t i = 0; i <= bounds.size(); ++i){
+        cumulative += counts[i].load(std::memory_order_relaxed);
+        if(i < bounds.size()){
+            auto result = std::to_chars(bound, bound + sizeof(bound), bounds[i]);
+            Sample(out, "_bucket", "le=\"" + std::string(bound, result.ptr - bound) + "\"", (double)cumulative);
+        } else {
+            Sample(out, "_bucket", "le=\"+Inf\"", (double)cumulative);
+        }
+    }
+    Sample(out, "_sum", "", sum.load(std::memory_order_relaxed));
+    Sample(out, "_count", "", (double)cumulative);
+}
+
+
+// Registry
+
+CMetrics::CMetrics(): head(nullptr), exporting(false), listener(INVALID_SOCKET) {}
+
+CMetrics::~CMetrics() {
+    StopExport();
+
+    CMetric* metric = head.load();
+    while(metric){
+        CMetric* next = metric->next;
+        delete metric;
+        metric = next;
+    }
+}
+
+CMetrics& CMetrics::Default() {
+    static CMetrics metrics;
+    return metrics;
+}
+
+CMetric* CMetrics::Find(const std::string& name, const std::string& labels, CMetricType type) {
+    for(CMetric* metric = head.load(std::memory_order_relaxed); metric; metric = metric->next){
+        if(metric->name != name) continue;
+        if(metric->type != type) throw DWORD(ERROR_ALREADY_EXISTS);
+        if(metric->labels == labels) return metric;
+    }
+    return nullptr;
+}
+
+void CMetrics::Publish(CMetric* metric, const std::string& name, const std::string& help, const std::string& labels) {
+    metric->name = name;
+    metric->help = help;
+    metric->labels = labels;
+    metric->next = head.load(std::memory_order_relaxed);
+    head.store(metric, std::memory_order_release); // a scrape sees the metric whole or not at all
+}
+
+CMetricCounter& CMetrics::Counter(const std::string& name, const std::string& help, const std::string& labels) {
+    std::scoped_lock lock(mtx_register);
+    if(CMetric* metric = Find(name, labels, METRIC_COUNTER)) return *static_cast<CMetricCounter*>(metric);
+
+    CMetricCounter* counter = new CMetricCounter();
+    Publish(counter, name, help, labels);
+    return *counter;
+}
+
+CMetricGauge& CMetrics::Gauge(const std::string& name, const std::string& help, const std::string& labels) {
+    std::scoped_lock lock(mtx_register);
+    if(CMetric* metric = Find(name, labels, METRIC_GAUGE)) return *static_cast<CMetricGauge*>(metric);
+
+    CMetricGauge* gauge = new CMetricGauge();
+    Publish(gauge, name, help, labels);
+    return *gauge;
+}
+
+CMetricHistogram& CMetrics::Histogram(const std::string& name, const std::string& help, const std::string& labels,
+                                      const std::vector<double>& buckets) {
+    std::scoped_lock lock(mtx_register);
+    if(CMetric* metric = Find(name, labels, METRIC_HISTOGRAM)) return *static_cast<CMetricHistogram*>(metric);
+
+    CMetricHistogram* histogram = new CMetricHistogram(buckets);
+    Publish(histogram, name, help, labels);
+    return *histogram;
+}
+
+std::string CMetrics::Label(const std::string& name, const std::string& value) {
+    std::string label = name + "=\"";
+    for(char c : value){
+        if(c == '\\' || c == '"'){
+            label += '\\';
+            label += c;
+        } else if(c == '\n'){
+            label += "\\n";
+        } else {
+            label += c;
+        }
+    }
+    label += '"';
+    return label;
+}
+
+void CMetrics::Format(std::string& out) const {
+    // Samples of one name are grouped under its HELP and TYPE lines, in registration order
+    std::vector<const CMetric*> metrics;
+    for(const CMetric* metric = head.load(std::memory_order_acquire); metric; metric = metric->next){
+        metrics.push_back(metric);
+    }
+    std::reverse(metrics.begin(), metrics.end());
+    std::stable_sort(metrics.begin(), metrics.end(), [](const CMetric* a, const CMetric* b){ return a->name < b->name; });
+
+    static const char* types[] = { "counter", "gauge", "histogram" };
+    for(size_t i = 0; i < metrics.size(); ++i){
+        const CMetric* metric = metrics[i];
+        if(i == 0 || metrics[i - 1]->name != metric->name){
+            out += "# HELP " + metric->name + " " + metric->help + "\n";
+            out += "# TYPE " + metric->name + " " + types[metric->type] + "\n";
+        }
+        metric->Format(out);
+    }
+}
+
+bool CMetrics::WriteFile(const std::string& path) const {
+    std::string text;
+    Format(text);
+
+    std::string temporary = path + ".tmp";
+    HANDLE file = CreateFile(temporary.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if(file == INVALID_HANDLE_VALUE) return false;
+
+    DWORD written;
+    bool success = ::WriteFile(file, text.data(), (DWORD)text.size(), &written, NULL) && written == text.size();
+    CloseHandle(file);
+
+    if(!success || !MoveFileEx(temporary.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING)){
+        DWORD error = GetLastError();
+        DeleteFile(temporary.c_str());
+        SetLastError(error);
+        return false;
+    }
+    return true;
+}
+
+
+// Export
+
+bool CMetrics::StartFileExport(const std::string& path, DWORD interval) {
+    std::scoped_lock lock(mtx_export);
+    if(file_thread.joinable()){
+        SetLastError(ERROR_ALREADY_EXISTS);
+        return false;
+    }
+    if(!WriteFile(path)) return false; // report a bad path now rather than every interval
+
+    exporting = true;
+    file_thread = std::thread(&CMetrics::FileHandle, this, path, interval);
+    return true;
+}
+
+bool CMetrics::StartServer(unsigned short port) {
+    std::scoped_lock lock(mtx_export);
+    if(server_thread.joinable()){
+        SetLastError(ERROR_ALREADY_EXISTS);
+        return false;
+    }
+
+    WSADATA data;
+    int error = WSAStartup(MAKEWORD(2, 2), &data);
+    if(error){
+        SetLastError(error);
+        return false;
+    }
+
+    sockaddr_in address {};
+    address.sin_family = AF_INET;
+    address.sin_port = htons(port);
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK); // scrapes are local, a collector on the box forwards them
+
+    listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if(listener == INVALID_SOCKET ||
+       bind(listener, (sockaddr*)&address, sizeof(address)) == SOCKET_ERROR ||
+       listen(listener, SOMAXCONN) == SOCKET_ERROR){
+        error = WSAGetLastError();
+        if(listener != INVALID_SOCKET) closesocket(listener);
+        listener = INVALID_SOCKET;
+        WSACleanup();
+        SetLastError(error);
+        return false;
+    }
+
+    exporting = true;
+    server_thread = std::thread(&CMetrics::ServerHandle, this);
+    return true;
+}
+
+void CMetrics::StopExport() {
+    {
+        std::scoped_lock lock(mtx_export);
+        exporting = false;
+    }
+    cv_export.notify_all();
+
+    if(file_thread.joinable()) file_thread.join();
+    if(server_thread.joinable()){
+        server_thread.join(); // notices within its select timeout
+        closesocket(listener);
+        listener = INVALID_SOCKET;
+        WSACleanup();
+    }
+}
+
+void CMetrics::FileHandle(std::string path, DWORD interval) {
+    std::unique_lock lock(mtx_export);
+    while(!cv_export.wait_for(lock, std::chrono::milliseconds(interval), [this](){ return !exporting; })){
+        lock.unlock();
+        WriteFile(path);
+        lock.lock();
+    }
+}
+
+void CMetrics::ServerHandle() {
+    std::string request, response, body;
+    for(;;){
+        {
+            std::scoped_lock lock(mtx_export);
+            if(!exporting) break;
+        }
+
+        fd_set ready;
+        FD_ZERO(&ready);
+        FD_SET(listener, &ready);
+        timeval timeout { 0, 200 * 1000 };
+        if(select(0, &ready, NULL, NULL, &timeout) <= 0) continue;
+
+        SOCKET client = accept(listener, NULL, NULL);
+        if(client == INVALID_SOCKET) continue;
+
+        // Read the request head; one scraper at a time is served
+        DWORD wait = 1000;
+        setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, (const char*)&wait, sizeof(wait));
+        request.clear();
+        char buffer[1024];
+        while(request.find("\r\n\r\n") == std::string::npos && request.size() < 8192){
+            int bytes = recv(client, buffer, sizeof(buffer), 0);
+            if(bytes <= 0) break;
+            request.append(buffer, bytes);
+        }
+
+        body.clear();
+        if(request.compare(0, 4, "GET ") == 0){
+            Format(body);
+            response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: " +
+                       std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n";
+        } else {
+            response = "HTTP/1.0 405 Method Not Allowed\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        }
+        response += body;
+
+        for(size_t sent = 0; sent < response.size(); ){
+            int bytes = send(client, response.data() + sent, (int)(response.size() - sent), 0);
+            if(bytes <= 0) break;
+            sent += bytes;
+        }
+        shutdown(client, SD_SEND);
+        closesocket(client);
+    }
+}
@@ -0,0 +1,128 @@
+#include "libwinservice.h"
+
+IPCReactor::IPCReactor(DWORD idleTimeout, DWORD spinMicroseconds, DWORD_PTR affinityMask):
+    controllers_version(0), poll_version(0), polling(nullptr),
+    reactor_running(true), idle_timeout(idleTimeout),
+    spin_budget(spinMicroseconds), affinity_mask(affinityMask),
+    spin_hits(0), spin_misses(0)
+{
+    // Auto-reset event used to cut the idle wait short when there is work to do.
+    wake_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if(wake_event == NULL){
+        throw GetLastError();
+    }
+
+    reactor_thread = std::thread(&IPCReactor::ReactorHandle, this);
+}
+
+IPCReactor::~IPCReactor() {
+    reactor_running = false;
+    Wake();
+
+    if(reactor_thread.joinable()){
+        reactor_thread.join(); // wait for the reactor thread to terminate
+    }
+
+    CloseHandle(wake_event);
+}
+
+IPCReactor& IPCReactor::Default() {
+    static IPCReactor reactor;
+    return reactor;
+}
+
+void IPCReactor::Register(IPCController* controller) {
+    {
+        std::scoped_lock lock(mtx_controllers);
+        auto found = std::find_if(controllers.begin(), controllers.end(), [&](auto& entry){ return entry->controller == controller; });
+        if(found == controllers.end()){
+            auto entry = std::make_shared<Entry>();
+            entry->controller = controller;
+            controllers.push_back(std::move(entry));
+            controllers_version++;
+        }
+    }
+    Wake();
+}
+
+void IPCReactor::Unregister(IPCController* controller) {
+    {
+        std::scoped_lock lock(mtx_controllers);
+        auto found = std::find_if(controllers.begin(), controllers.end(), [&](auto& entry){ return entry->controller == controller; });
+        if(found == controllers.end()) return;
+        (*found)->removed = true; // a pass working from an older snapshot skips it from now on
+        controllers.erase(found);
+        controllers_version++;
+    }
+
+    // Either the pass saw the removal before claiming the controller, or it
+    // claimed it first and is seen here; wait until it lets go. Once this
+    // returns the reactor will never touch the controller again.
+    if(std::this_thread::get_id() == reactor_thread.get_id()) return; // a pass unregistering another controller
+    while(polling.load() == controller) std::this_thread::yield();
+}
+
+void IPCReactor::Wake() {
+    SetEvent(wake_event);
+}
+
+size_t IPCReactor::Count() {
+    std::scoped_lock lock(mtx_controllers);
+    return controllers.size();
+}
+
+
+// Reactor Thread Handle
+void IPCReactor::ReactorHandle() {
+    if(affinity_mask) SetThreadAffinityMask(GetCurrentThread(), affinity_mask);
+    CTracer::Default().NameThread("ipc reactor");
+
+    bool spinning = false;
+    std::chrono::steady_clock::time_point spinStart;
+
+    while(reactor_running){
+        if(ReactorPoll()){
+            if(spinning) spin_hits++;
+            spinning = false;
+            continue; // keep servicing while messages are moving
+        }
+
+        if(spin_budget.count()){
+            auto now = std::chrono::steady_clock::now();
+            if(!spinning){
+                spinning = true;
+                spinStart = now;
+            }
+            if(now - spinStart < spin_budget){
+                YieldProcessor(); // pause between polls
+                continue;
+            }
+            spin_misses++;
+            spinning = false;
+        }
+
+        WaitForSingleObject(wake_event, idle_timeout); // idle until woken
+    }
+}
+
+bool IPCReactor::ReactorPoll() {
+    {
+        std::scoped_lock lock(mtx_controllers);
+        if(poll_version != controllers_version){
+            poll_snapshot = controllers;
+            poll_version = controllers_version;
+        }
+    }
+
+    bool busy = false;
+    ULONGLONG tick = GetTickCount64();
+
+    // The list is not locked while controllers are serviced, so a pass may
+    // register and unregister controllers without deadlocking.
+    for(auto& entry : poll_snapshot){
+        polling.store(entry->controller);
+        if(!entry->removed.load()) busy |= entry->controller->IPCPoll(tick);
+        polling.store(nullptr);
+    }
+    return busy;
+}
@@ -0,0 +1,168 @@
+#include "libwinservice.h"
+#include <exception>
+
+static_assert((FLIGHT_RECORDER_SIZE & (FLIGHT_RECORDER_SIZE - 1)) == 0, "the recorder size must be a power of two");
+static_assert(sizeof(CFlightRecord) == 24, "dumps are read by other builds, keep the record layout");
+
+CFlightRecorder::CFlightRecorder():
+    slots(new Slot[FLIGHT_RECORDER_SIZE]), next(0), recording(true), source_count(1)
+{
+    for(size_t i = 0; i < FLIGHT_RECORDER_SIZE; ++i) slots[i].sequence = 0;
+
+    memset(source_names, 0, sizeof(source_names));
+    strcpy(source_names[0], "process");
+    dump_path[0] = '\0';
+}
+
+CFlightRecorder& CFlightRecorder::Default() {
+    static CFlightRecorder recorder;
+    return recorder;
+}
+
+uint16_t CFlightRecorder::Source(const std::string& name) {
+    std::string_view kept = std::string_view(name).substr(0, FLIGHT_SOURCE_NAME - 1);
+
+    while(source_lock.test_and_set(std::memory_order_acquire)) YieldProcessor();
+
+    size_t count = source_count.load(std::memory_order_relaxed);
+    uint16_t id = 0;
+    for(size_t i = 1; i < count; ++i){
+        if(kept == source_names[i]){
+            id = (uint16_t)i;
+            break;
+        }
+    }
+    if(id == 0 && count < FLIGHT_MAX_SOURCES){
+        memcpy(source_names[count], kept.data(), kept.size());
+        source_names[count][kept.size()] = '\0';
+        source_count.store(count + 1, std::memory_order_release); // published whole to Dump
+        id = (uint16_t)count;
+    }
+
+    source_lock.clear(std::memory_order_release);
+    return id;
+}
+
+void CFlightRecorder::SetDumpPath(const std::string& path) {
+    size_t length = std::min(path.size(), sizeof(dump_path) - 1);
+    memcpy(dump_path, path.data(), length);
+    dump_path[length] = '\0';
+}
+
+
+// Crash Handler
+
+static LPTOP_LEVEL_EXCEPTION_FILTER s_previousFilter = NULL;
+static std::terminate_handler s_previousTerminate = NULL;
+
+static LONG WINAPI FlightCrashFilter(EXCEPTION_POINTERS* exception) {
+    CFlightRecorder::Default().Record(FLIGHT_ERROR, 0, exception->ExceptionRecord->ExceptionCode);
+    CFlightRecorder::Default().Dump(FLIGHT_DUMP_CRASH);
+    return s_previousFilter ? s_previousFilter(exception) : EXCEPTION_CONTINUE_SEARCH;
+}
+
+static void FlightTerminate() {
+    CFlightRecorder::Default().Dump(FLIGHT_DUMP_CRASH);
+    if(s_previousTerminate) s_previousTerminate();
+    abort();
+}
+
+void CFlightRecorder::DumpOnCrash() {
+    static std::atomic_bool installed {false};
+    if(installed.exchange(true)) return;
+
+    s_previousFilter = SetUnhandledExceptionFilter(FlightCrashFilter);
+    s_previousTerminate = std::set_terminate(FlightTerminate);
+}
+
+
+// Dump
+
+bool CFlightRecorder::Dump(CFlightDumpReason reason) {
+    if(dump_path[0] == '\0'){
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return false;
+    }
+    return Dump(dump_path, reason);
+}
+
+bool CFlightRecorder::Dump(const char* path, CFlightDumpReason reason) {
+    // One dump at a time. A crash during a dump must not wait for it.
+    if(dumping.test_and_set(std::memory_order_acquire)){
+        SetLastError(ERROR_BUSY);
+        return false;
+    }
+    Record(FLIGHT_DUMP, 0, reason);
+
+    HANDLE file = CreateFile(path, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if(file == INVALID_HANDLE_VALUE){
+        dumping.clear(std::memory_order_release);
+        return false;
+    }
+
+    // Everything is written from this stack buffer, the heap may be what crashed.
+    char buffer[8192];
+    size_t used = 0;
+    bool success = true;
+    auto flush = [&](){
+        DWORD written;
+        success &= WriteFile(file, buffer, (DWORD)used, &written, NULL) && written == used;
+        used = 0;
+    };
+    auto append = [&](const void* data, size_t size){
+        if(used + size > sizeof(buffer)) flush();
+        memcpy(buffer + used, data, size);
+        used += size;
+    };
+
+    uint64_t end = next.load(std::memory_order_acquire);
+    uint64_t begin = end > FLIGHT_RECORDER_SIZE ? end - FLIGHT_RECORDER_SIZE : 0;
+    size_t sources = source_count.load(std::memory_order_acquire);
+
+    FILETIME now;
+    GetSystemTimeAsFileTime(&now);
+    uint64_t ticks = ((uint64_t)now.dwHighDateTime << 32) | now.dwLowDateTime; // 100ns since 1601
+
+    CFlightDumpHeader header {};
+    memcpy(header.magic, FLIGHT_DUMP_MAGIC, sizeof(header.magic));
+    header.version = FLIGHT_DUMP_VERSION;
+    header.record_size = sizeof(CFlightRecord);
+    header.sources = (uint16_t)sources;
+    header.reason = reason;
+    header.process_id = GetCurrentProcessId();
+    header.recorded = end;
+    header.time = Now();
+    header.wall_time = (int64_t)(ticks / 10) - 11644473600000000LL;
+
+    // The record count is only known once torn slots are skipped, patch it in at the end.
+    append(&header, sizeof(header));
+    for(size_t i = 0; i < sources; ++i){
+        CFlightSourceName name { (uint16_t)i, (uint16_t)strlen(source_names[i]) };
+        append(&name, sizeof(name));
+        append(source_names[i], name.length);
+    }
+
+    uint32_t records = 0;
+    for(uint64_t index = begin; index < end; ++index){
+        const Slot& slot = slots[index & (FLIGHT_RECORDER_SIZE - 1)];
+        if(slot.sequence.load(std::memory_order_acquire) != index + 1) continue; // overwritten or being written
+
+        CFlightRecord record = slot.record;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if(slot.sequence.load(std::memory_order_relaxed) != index + 1) continue;
+
+        append(&record, sizeof(record));
+        records++;
+    }
+    flush();
+
+    header.records = records;
+    memcpy(buffer, &header, sizeof(header));
+    used = sizeof(header);
+    success &= SetFilePointer(file, 0, NULL, FILE_BEGIN) != INVALID_SET_FILE_POINTER;
+    flush();
+
+    CloseHandle(file);
+    dumping.clear(std::memory_order_release);
+    return success;
+}
@@ -0,0 +1,148 @@
+#include "libwinservice.h"
+#include "libwinservice_csd.h"
+
+IPCRegistry::IPCRegistry():
+    mapping(NULL), lock(NULL), table(NULL),
+    sa(CreateSecurityAttribute())
+{
+    // Services live in session 0 while their children run in the user's
+    // session, so the table is global. Creating global objects needs a
+    // privilege ordinary processes lack, in which case fall back to the
+    // session namespace.
+    for(const char* ns : {"Global\\", "Local\\"}){
+        std::string name = std::string(ns) + IPC_REGISTRY_NAME;
+
+        mapping = CreateFileMapping(INVALID_HANDLE_VALUE, &sa, PAGE_READWRITE, 0,
+                                    DWORD(sizeof(IPCRegistryEntry) * IPC_REGISTRY_SLOTS), name.c_str());
+        if(mapping == NULL) continue;
+
+        lock = CreateMutex(&sa, FALSE, (name + "_lock").c_str());
+        if(lock == NULL){
+            CloseHandle(mapping);
+            mapping = NULL;
+            continue;
+        }
+        break;
+    }
+
+    if(mapping == NULL) return;
+
+    // A newly created mapping is zero filled, which is an empty table.
+    table = (IPCRegistryEntry*)MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+}
+
+IPCRegistry::~IPCRegistry() {
+    if(table) UnmapViewOfFile(table);
+    if(lock) CloseHandle(lock);
+    if(mapping) CloseHandle(mapping);
+
+    FreeSecurityAttribute(&sa);
+}
+
+IPCRegistry& IPCRegistry::Default() {
+    static IPCRegistry registry;
+    return registry;
+}
+
+bool IPCRegistry::Register(const std::string& name, const std::string& address, DWORD lease) {
+    if(name.size() >= sizeof(IPCRegistryEntry::name) || address.size() >= sizeof(IPCRegistryEntry::address)){
+        SetLastError(ERROR_INVALID_PARAMETER);
+        return false;
+    }
+    if(!Lock()) return false;
+
+    ULONGLONG tick = GetTickCount64();
+    IPCRegistryEntry* entry = Find(name, tick);
+
+    if(entry && entry->pid != GetCurrentProcessId()){
+        Unlock();
+        SetLastError(ERROR_ALREADY_EXISTS);
+        return false;
+    }
+
+    if(!entry){ // claim the first free or lapsed slot
+        for(size_t i=0; i < IPC_REGISTRY_SLOTS; ++i){
+            if(!IsLive(table[i], tick)){
+                entry = &table[i];
+                break;
+            }
+        }
+    }
+
+    if(!entry){
+        Unlock();
+        SetLastError(ERROR_INSUFFICIENT_BUFFER);
+        return false;
+    }
+
+    ZeroMemory(entry, sizeof(IPCRegistryEntry));
+    memcpy(entry->name, name.data(), name.size());
+    memcpy(entry->address, address.data(), address.size());
+    entry->pid = GetCurrentProcessId();
+    entry->expires = tick + lease;
+
+    Unlock();
+    return true;
+}
+
+bool IPCRegistry::Unregister(const std::string& name) {
+    if(!Lock()) return false;
+
+    IPCRegistryEntry* entry = Find(name, GetTickCount64());
+    bool owned = entry && entry->pid == GetCurrentProcessId();
+    if(owned) ZeroMemory(entry, sizeof(IPCRegistryEntry));
+
+    Unlock();
+    return owned;
+}
+
+bool IPCRegistry::Lookup(const std::string& name, std::string& address) {
+    if(!Lock()) return false;
+
+    IPCRegistryEntry* entry = Find(name, GetTickCount64());
+    if(entry) address = entry->address;
+
+    Unlock();
+    if(!entry) SetLastError(ERROR_FILE_NOT_FOUND);
+    return entry != NULL;
+}
+
+
+
+// Internal Methods
+
+bool IPCRegistry::Lock() {
+    if(!IsValid()) return false;
+
+    // An abandoned mutex means the previous owner died mid-update; the table
+    // entries are still self-consistent enough to carry on with.
+    DWORD r = WaitForSingleObject(lock, 1000);
+    return r == WAIT_OBJECT_0 || r == WAIT_ABANDONED;
+}
+
+void IPCRegistry::Unlock() {
+    ReleaseMutex(lock);
+}
+
+bool IPCRegistry::IsLive(const IPCRegistryEntry& entry, ULONGLONG tick) {
+    if(entry.name[0] == '\0' || tick >= entry.expires) return false;
+    if(entry.pid == GetCurrentProcessId()) return true;
+
+    // the lease has not lapsed yet, but the owner may have exited early
+    HANDLE process = OpenProcess(SYNCHRONIZE, FALSE, entry.pid);
+    if(process == NULL) return GetLastError() == ERROR_ACCESS_DENIED; // exists, but belongs to another session
+
+    bool running = WaitForSingleObject(process, 0) == WAIT_TIMEOUT;
+    CloseHandle(process);
+    return running;
+}
+
+IPCRegistryEntry* IPCRegistry::Find(const std::string& name, ULONGLONG tick) {
+    for(size_t i=0; i < IPC_REGISTRY_SLOTS; ++i){
+        IPCRegistryEntry& entry = table[i];
+        if(strncmp(entry.name, name.c_str(), sizeof(entry.name)) == 0 && IsLive(entry, tick)){
+            return &entry;
+        }
+    }
+    return NULL;
+}
@@ -0,0 +1,77 @@
+#include "libwinservice.h"
+
+void CShutdownDrain::Add(const std::string& name, Step step, int priority) {
+    std::scoped_lock lock(m_lock);
+    m_steps.push_back({ name, std::move(step), priority });
+}
+
+bool CShutdownDrain::Empty() {
+    std::scoped_lock lock(m_lock);
+    return m_steps.empty();
+}
+
+void CShutdownDrain::Clear() {
+    std::scoped_lock lock(m_lock);
+    m_steps.clear();
+}
+
+CShutdownDrain::Result CShutdownDrain::Run(DWORD budget, const std::function<void(const Progress&)>& progress) {
+    Deadline deadline(std::chrono::steady_clock::now() + std::chrono::milliseconds(budget));
+
+    std::vector<Entry> steps;
+    {
+        std::scoped_lock lock(m_lock);
+        steps = m_steps;
+    }
+    std::stable_sort(steps.begin(), steps.end(), [](const Entry& a, const Entry& b){ return a.priority < b.priority; });
+
+    Result result;
+    for(size_t i = 0; i < steps.size(); ++i){
+        if(deadline.Expired()){
+            for(; i < steps.size(); ++i) result.abandoned.push_back(steps[i].name);
+            break;
+        }
+        progress({ i + 1, steps.size(), steps[i].name, deadline.Remaining() });
+
+        auto job = std::make_shared<Job>(steps[i].name, steps[i].step, deadline);
+        job->self = job;
+        try {
+            CThreadPool::QueueUserWorkItem(&Job::Run, job.get());
+        } catch(DWORD error) {
+            job->self.reset();
+            result.failed.push_back({ steps[i].name, error });
+            continue;
+        }
+
+        std::unique_lock lock(job->lock);
+        if(!job->finished.wait_until(lock, deadline.Until(), [&](){ return job->done; })){
+            // Abandoned: the job still holds itself and is dropped when the step returns.
+            for(; i < steps.size(); ++i) result.abandoned.push_back(steps[i].name);
+            break;
+        }
+        if(job->error != NO_ERROR) result.failed.push_back({ steps[i].name, job->error });
+        else result.completed++;
+    }
+    return result;
+}
+
+void CShutdownDrain::Job::Run() {
+    std::shared_ptr<Job> keep = std::move(self); // released once this returns
+
+    DWORD thrown = NO_ERROR;
+    try {
+        CTraceSpan span(name, "shutdown");
+        step(deadline);
+    } catch(DWORD code) {
+        thrown = code != NO_ERROR ? code : ERROR_EXCEPTION_IN_SERVICE;
+    } catch(...) {
+        thrown = ERROR_EXCEPTION_IN_SERVICE;
+    }
+
+    {
+        std::scoped_lock lock(this->lock);
+        error = thrown;
+        done = true;
+    }
+    finished.notify_all();
+}
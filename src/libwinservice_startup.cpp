@@ -0,0 +1,121 @@
+#include "libwinservice.h"
+
+size_t CStartupGraph::Add(const std::string& name, Task task, const std::vector<size_t>& after, DWORD dwEstimate) {
+    std::scoped_lock lock(m_lock);
+    if(m_running) throw DWORD(ERROR_BUSY); // Run has already scheduled the graph
+
+    size_t id = m_tasks.size();
+    for(size_t dependency : after){
+        if(dependency >= id) throw DWORD(ERROR_INVALID_PARAMETER); // only earlier tasks, so no cycles
+    }
+    for(size_t dependency : after) m_tasks[dependency].dependents.push_back(id);
+
+    m_tasks.push_back({ name, std::move(task), dwEstimate, after, {}, 0, false });
+    return id;
+}
+
+void CStartupGraph::Run(const std::function<void(const Progress&)>& progress) {
+    std::unique_lock lock(m_lock);
+
+    m_running = true;
+    m_ready.clear();
+    m_completed = 0;
+    m_error = nullptr;
+    for(Node& node : m_tasks){
+        node.waiting = node.after.size();
+        node.done = false;
+    }
+    for(size_t id = 0; id < m_tasks.size(); ++id){
+        if(m_tasks[id].waiting == 0) Schedule(id);
+    }
+
+    // Progress is reported from this thread only, so the reports stay in
+    // order whichever pool threads the tasks complete on.
+    size_t reported = 0;
+    for(;;){
+        if(m_completed != reported && m_completed < m_tasks.size() && !m_error){
+            reported = m_completed;
+            Progress status { m_completed, m_tasks.size(), Remaining(false) };
+            lock.unlock();
+            progress(status);
+            lock.lock();
+            continue;
+        }
+        if(m_scheduled == 0) break;
+        m_changed.wait(lock);
+    }
+    m_running = false;
+
+    if(m_error) std::rethrow_exception(m_error);
+}
+
+DWORD CStartupGraph::Estimate() {
+    std::scoped_lock lock(m_lock);
+    return Remaining(true);
+}
+
+void CStartupGraph::Clear() {
+    std::scoped_lock lock(m_lock);
+    m_tasks.clear();
+    m_ready.clear();
+}
+
+void CStartupGraph::Schedule(size_t id) {
+    m_ready.push_back(id);
+    m_scheduled++;
+    try {
+        CThreadPool::QueueUserWorkItem(&CStartupGraph::RunReady, this);
+    } catch(DWORD error) {
+        m_ready.pop_back();
+        m_scheduled--;
+        if(!m_error) m_error = std::make_exception_ptr(error);
+    }
+}
+
+void CStartupGraph::RunReady() {
+    std::unique_lock lock(m_lock);
+
+    size_t id = m_ready.front();
+    m_ready.pop_front();
+
+    if(!m_error){ // a failed task stops the rest from starting
+        // Copied while locked, the node is not to be touched without m_lock
+        Task task = m_tasks[id].task;
+        std::string name = m_tasks[id].name;
+        lock.unlock();
+        std::exception_ptr error;
+        try {
+            CTraceSpan span(name, "startup");
+            task();
+        } catch(...) {
+            error = std::current_exception();
+        }
+        lock.lock();
+
+        if(error){
+            if(!m_error) m_error = error;
+        } else {
+            m_tasks[id].done = true;
+            m_completed++;
+            for(size_t dependent : m_tasks[id].dependents){
+                if(--m_tasks[dependent].waiting == 0 && !m_error) Schedule(dependent);
+            }
+        }
+    }
+
+    m_scheduled--;
+    m_changed.notify_all();
+}
+
+DWORD CStartupGraph::Remaining(bool whole) {
+    // Dependencies always come first, so one pass in id order finds the longest chain.
+    std::vector<DWORD> finish(m_tasks.size());
+    DWORD longest = 0;
+    for(size_t id = 0; id < m_tasks.size(); ++id){
+        DWORD start = 0;
+        for(size_t dependency : m_tasks[id].after) start = std::max(start, finish[dependency]);
+        finish[id] = start + (m_tasks[id].done && !whole ? 0 : m_tasks[id].estimate);
+        longest = std::max(longest, finish[id]);
+    }
+    return longest;
+}
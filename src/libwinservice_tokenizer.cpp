@@ -0,0 +1,72 @@
+#include "libwinservice.h"
+
+#if defined(__GNUC__) && defined(__SSE2__)
+    #define TOKENIZER_SIMD
+    #include <immintrin.h>
+#endif
+
+// Emit a field for each set bit in a delimiter mask found at offset base
+static inline void EmitFields(uint32_t mask, size_t base, std::string_view text, size_t& start, std::vector<std::string_view>& fields) {
+    while(mask){
+        size_t at = base + __builtin_ctz(mask);
+        fields.emplace_back(text.data() + start, at - start);
+        start = at + 1;
+        mask &= mask - 1;
+    }
+}
+
+// Each scanner handles whole blocks and returns where it stopped; the tail is scanned bytewise.
+typedef size_t (*FieldScanner)(std::string_view text, char delimiter, size_t& start, std::vector<std::string_view>& fields);
+
+#ifdef TOKENIZER_SIMD
+static size_t ScanSSE2(std::string_view text, char delimiter, size_t& start, std::vector<std::string_view>& fields) {
+    const __m128i needle = _mm_set1_epi8(delimiter);
+
+    size_t pos = 0;
+    for(; pos + 16 <= text.size(); pos += 16){
+        __m128i block = _mm_loadu_si128((const __m128i*)(text.data() + pos));
+        EmitFields((uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(block, needle)), pos, text, start, fields);
+    }
+    return pos;
+}
+
+__attribute__((target("avx2")))
+static size_t ScanAVX2(std::string_view text, char delimiter, size_t& start, std::vector<std::string_view>& fields) {
+    const __m256i needle = _mm256_set1_epi8(delimiter);
+
+    size_t pos = 0;
+    for(; pos + 32 <= text.size(); pos += 32){
+        __m256i block = _mm256_loadu_si256((const __m256i*)(text.data() + pos));
+        EmitFields((uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, needle)), pos, text, start, fields);
+    }
+    return pos;
+}
+#endif
+
+static FieldScanner SelectScanner() {
+#ifdef TOKENIZER_SIMD
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2") ? ScanAVX2 : ScanSSE2;
+#else
+    return NULL;
+#endif
+}
+
+size_t SplitFields(std::string_view text, char delimiter, std::vector<std::string_view>& fields) {
+    static const FieldScanner scanner = SelectScanner();
+
+    fields.clear();
+    size_t start = 0, pos = 0;
+
+    if(scanner) pos = scanner(text, delimiter, start, fields);
+
+    for(; pos < text.size(); ++pos){
+        if(text[pos] == delimiter){
+            fields.emplace_back(text.data() + start, pos - start);
+            start = pos + 1;
+        }
+    }
+    fields.emplace_back(text.data() + start, text.size() - start);
+
+    return fields.size();
+}
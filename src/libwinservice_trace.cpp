@@ -0,0 +1,190 @@
+#include "libwinservice.h"
+#include <charconv>
+
+// The thread name is written once per trace, with the first event of the thread
+static thread_local std::string t_threadName;
+static thread_local uint32_t t_namedSession = 0;
+
+CTracer::CTracer():
+    file(INVALID_HANDLE_VALUE), tracing(false), session(0), flows(0), flushed(0) {}
+
+CTracer::~CTracer() {
+    Stop();
+}
+
+CTracer& CTracer::Default() {
+    static CTracer tracer;
+    return tracer;
+}
+
+bool CTracer::Start(const std::string& path, const std::string& process) {
+    std::scoped_lock lock(mtx_trace);
+    if(tracing){
+        SetLastError(ERROR_ALREADY_EXISTS);
+        return false;
+    }
+
+    // Other processes may append to the same file while it is open. Only the
+    // process that creates the file writes the opening bracket, so processes
+    // starting together cannot both write it.
+    bool created = false;
+    file = INVALID_HANDLE_VALUE;
+    for(int attempt = 0; attempt < 3 && file == INVALID_HANDLE_VALUE; ++attempt){
+        file = CreateFile(path.c_str(), FILE_APPEND_DATA, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, CREATE_NEW, FILE_ATTRIBUTE_NORMAL, NULL);
+        if(file != INVALID_HANDLE_VALUE){
+            created = true;
+            break;
+        }
+        if(GetLastError() != ERROR_FILE_EXISTS) return false;
+        // Deleted again before it could be opened, try to create it once more
+        file = CreateFile(path.c_str(), FILE_APPEND_DATA, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if(file == INVALID_HANDLE_VALUE && GetLastError() != ERROR_FILE_NOT_FOUND) return false;
+    }
+    if(file == INVALID_HANDLE_VALUE) return false;
+
+    buffer.clear();
+    if(created) buffer = "[\n";
+
+    if(!process.empty()){
+        std::string event = "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":";
+        event += std::to_string(GetCurrentProcessId());
+        event += ",\"tid\":0,\"args\":{\"name\":\"";
+        Escape(event, process);
+        event += "\"}}";
+        buffer += event;
+        buffer += ",\n";
+    }
+
+    // Written now, before this process can start a child tracing into the file
+    if(!Flush()){
+        DWORD error = GetLastError();
+        CloseHandle(file);
+        file = INVALID_HANDLE_VALUE;
+        SetLastError(error);
+        return false;
+    }
+
+    ++session;
+    tracing = true;
+    return true;
+}
+
+void CTracer::Stop() {
+    std::scoped_lock lock(mtx_trace);
+    if(!tracing) return;
+
+    tracing = false;
+    Flush();
+    CloseHandle(file);
+    file = INVALID_HANDLE_VALUE;
+}
+
+uint64_t CTracer::NewFlow() {
+    return ((uint64_t)GetCurrentProcessId() << 32) | 0x80000000 | ++flows;
+}
+
+void CTracer::NameThread(const std::string& name) {
+    t_threadName = name;
+    t_namedSession = 0;
+}
+
+void CTracer::Complete(std::string_view name, const char* category, uint64_t start, uint64_t end,
+                       uint64_t flow, CTraceFlow direction) {
+    if(!IsTracing()) return;
+
+    std::string event;
+    event.reserve(192);
+    Header(event, name, category, "X", start);
+
+    event += ",\"dur\":";
+    Micros(event, end > start ? end - start : 0);
+    if(flow && direction != TRACE_FLOW_NONE){
+        char id[24];
+        auto result = std::to_chars(id, id + sizeof(id), flow, 16);
+        event += ",\"bind_id\":\"0x";
+        event.append(id, result.ptr - id);
+        event += direction == TRACE_FLOW_OUT ? "\",\"flow_out\":true" : "\",\"flow_in\":true";
+    }
+    event += "}";
+    Append(event);
+}
+
+void CTracer::Instant(std::string_view name, const char* category) {
+    if(!IsTracing()) return;
+
+    std::string event;
+    event.reserve(128);
+    Header(event, name, category, "i", Now());
+    event += ",\"s\":\"t\"}";
+    Append(event);
+}
+
+void CTracer::Header(std::string& event, std::string_view name, const char* category, const char* phase, uint64_t time) {
+    event += "{\"name\":\"";
+    Escape(event, name);
+    event += "\",\"cat\":\"";
+    event += category;
+    event += "\",\"ph\":\"";
+    event += phase;
+    event += "\",\"ts\":";
+    Micros(event, time);
+    event += ",\"pid\":";
+    event += std::to_string(GetCurrentProcessId());
+    event += ",\"tid\":";
+    event += std::to_string(GetCurrentThreadId());
+}
+
+// Microseconds with three decimals, the unit of ts and dur
+void CTracer::Micros(std::string& event, uint64_t nanoseconds) {
+    char text[32];
+    snprintf(text, sizeof(text), "%llu.%03u", (unsigned long long)(nanoseconds / 1000), (unsigned)(nanoseconds % 1000));
+    event += text;
+}
+
+void CTracer::Append(const std::string& event) {
+    std::scoped_lock lock(mtx_trace);
+    if(!tracing) return;
+
+    uint32_t current = session;
+    if(t_namedSession != current && !t_threadName.empty()){
+        buffer += "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":";
+        buffer += std::to_string(GetCurrentProcessId());
+        buffer += ",\"tid\":";
+        buffer += std::to_string(GetCurrentThreadId());
+        buffer += ",\"args\":{\"name\":\"";
+        Escape(buffer, t_threadName);
+        buffer += "\"}},\n";
+    }
+    t_namedSession = current;
+
+    buffer += event;
+    buffer += ",\n";
+
+    if(buffer.size() >= TRACE_FLUSH || GetTickCount64() - flushed >= TRACE_FLUSH_INTERVAL) Flush();
+}
+
+bool CTracer::Flush() {
+    flushed = GetTickCount64();
+    if(buffer.empty()) return true;
+
+    // One write per flush keeps the lines of different processes whole
+    DWORD written;
+    bool success = WriteFile(file, buffer.data(), (DWORD)buffer.size(), &written, NULL) && written == buffer.size();
+    buffer.clear();
+    return success;
+}
+
+void CTracer::Escape(std::string& out, std::string_view text) {
+    for(char c : text){
+        if(c == '"' || c == '\\'){
+            out += '\\';
+            out += c;
+        } else if((unsigned char)c < 0x20){
+            char code[8];
+            snprintf(code, sizeof(code), "\\u%04x", (unsigned char)c);
+            out += code;
+        } else {
+            out += c;
+        }
+    }
+}
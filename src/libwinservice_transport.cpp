@@ -0,0 +1,426 @@
+#include "libwinservice.h"
+#include <climits>
+
+std::unique_ptr<IPCInboxTransport> CreateInboxTransport(const std::string& address) {
+    if(address.rfind(IPC_TCP_SCHEME, 0) == 0) return std::make_unique<TcpInbox>();
+    return std::make_unique<MailslotInbox>();
+}
+
+std::unique_ptr<IPCOutboxTransport> CreateOutboxTransport(const std::string& address) {
+    if(address.rfind(IPC_TCP_SCHEME, 0) == 0) return std::make_unique<TcpOutbox>();
+    return std::make_unique<MailslotOutbox>();
+}
+
+
+// Mailslot Inbox
+
+MailslotInbox::MailslotInbox(): mailslot(INVALID_HANDLE_VALUE), buffer(BUFSIZE) {}
+
+MailslotInbox::~MailslotInbox() {
+    Close();
+}
+
+bool MailslotInbox::Open(const std::string& address, SECURITY_ATTRIBUTES* sa) {
+    Close();
+
+    // A zero read timeout lets ReadFile report an empty mailslot immediately,
+    // so draining the slot does not need a GetMailslotInfo call per message.
+    mailslot = CreateMailslot((IPC_MAILSLOT_HEADER + address).c_str(), 0, 0, sa);
+    return mailslot != INVALID_HANDLE_VALUE;
+}
+
+void MailslotInbox::Close() {
+    if(mailslot != INVALID_HANDLE_VALUE){
+        CloseHandle(mailslot);
+        mailslot = INVALID_HANDLE_VALUE;
+    }
+}
+
+bool MailslotInbox::Read(std::vector<std::string>& messages, IPCStats& stats) {
+    if(mailslot == INVALID_HANDLE_VALUE) return false;
+
+    for(;;){
+        DWORD bytes = 0;
+        stats.read_calls++;
+        if(ReadFile(mailslot, buffer.data(), (DWORD)buffer.size(), &bytes, NULL)){
+            messages.emplace_back(buffer.data(), bytes);
+            stats.messages_received++;
+            stats.bytes_received += bytes;
+            continue;
+        }
+
+        switch(GetLastError()){
+        case ERROR_SEM_TIMEOUT: // mailslot drained
+            return true;
+        case ERROR_INSUFFICIENT_BUFFER: { // grow the buffer to fit the next message and keep it
+            DWORD szNextMsg = 0;
+            stats.read_calls++;
+            if(!GetMailslotInfo(mailslot, NULL, &szNextMsg, NULL, NULL)) return false;
+            if(szNextMsg == MAILSLOT_NO_MESSAGE) return true;
+            buffer.resize(std::max<size_t>(szNextMsg, buffer.size() * 2));
+            break;
+        }
+        default:
+            return false;
+        }
+    }
+}
+
+
+// Mailslot Outbox
+
+MailslotOutbox::MailslotOutbox(): mailslot(INVALID_HANDLE_VALUE) {}
+
+MailslotOutbox::~MailslotOutbox() {
+    Close();
+}
+
+bool MailslotOutbox::Open(const std::string& address) {
+    Close();
+
+    mailslot = CreateFile((IPC_MAILSLOT_HEADER + address).c_str(), GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    return mailslot != INVALID_HANDLE_VALUE;
+}
+
+void MailslotOutbox::Close() {
+    if(mailslot != INVALID_HANDLE_VALUE){
+        CloseHandle(mailslot);
+        mailslot = INVALID_HANDLE_VALUE;
+    }
+}
+
+bool MailslotOutbox::Write(std::deque<std::string>& batch, IPCStats& stats) {
+    if(mailslot == INVALID_HANDLE_VALUE) return false;
+
+    // Mailslot messages are datagrams, so each message is its own write.
+    while(!batch.empty()){
+        const std::string& data = batch.front();
+
+        DWORD written;
+        stats.write_calls++;
+        if(!WriteFile(mailslot, (LPCVOID)data.data(), (DWORD)data.size(), &written, NULL)){
+            return false;
+        }
+
+        stats.messages_sent++;
+        stats.bytes_sent += written;
+        batch.pop_front();
+    }
+    return true;
+}
+
+
+// TCP Helpers
+
+// Winsock is started once for the lifetime of the process
+static bool TcpStartup() {
+    static struct WinsockSession {
+        int error;
+        WinsockSession() { WSADATA data; error = WSAStartup(MAKEWORD(2, 2), &data); }
+        ~WinsockSession() { if(error == 0) WSACleanup(); }
+    } session;
+
+    if(session.error) SetLastError(session.error);
+    return session.error == 0;
+}
+
+// Resolve "tcp://host:port" - the caller frees the result with freeaddrinfo
+static bool TcpResolve(const std::string& address, bool passive, addrinfo** result) {
+    if(!TcpStartup()) return false;
+
+    std::string hostport = address.substr(sizeof(IPC_TCP_SCHEME) - 1);
+    size_t colon = hostport.rfind(':');
+    if(colon == std::string::npos){
+        SetLastError(WSAEINVAL);
+        return false;
+    }
+
+    std::string host = hostport.substr(0, colon), port = hostport.substr(colon + 1);
+    if(host == "*") host.clear();
+
+    addrinfo hints {};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_protocol = IPPROTO_TCP;
+    hints.ai_flags = passive ? AI_PASSIVE : 0;
+
+    int r = getaddrinfo(host.empty() ? NULL : host.c_str(), port.c_str(), &hints, result);
+    if(r != 0){
+        SetLastError(r);
+        return false;
+    }
+    return true;
+}
+
+static void TcpNoDelay(SOCKET socket) {
+    BOOL nodelay = TRUE;
+    setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, (const char*)&nodelay, sizeof(nodelay));
+}
+
+
+// TCP Inbox
+
+TcpInbox::TcpInbox(): listener(INVALID_SOCKET), buffer(64 * 1024), notify(NULL) {}
+
+TcpInbox::~TcpInbox() {
+    Close();
+}
+
+bool TcpInbox::Open(const std::string& address, SECURITY_ATTRIBUTES* sa) {
+    Close();
+
+    addrinfo* result;
+    if(!TcpResolve(address, true, &result)) return false;
+
+    listener = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+    if(listener == INVALID_SOCKET){
+        freeaddrinfo(result);
+        return false;
+    }
+
+    BOOL exclusive = TRUE; // a second inbox on the same port must fail like a second mailslot would
+    setsockopt(listener, SOL_SOCKET, SO_EXCLUSIVEADDRUSE, (const char*)&exclusive, sizeof(exclusive));
+
+    bool bound = bind(listener, result->ai_addr, (int)result->ai_addrlen) != SOCKET_ERROR &&
+                 listen(listener, SOMAXCONN) != SOCKET_ERROR;
+    freeaddrinfo(result);
+
+    u_long nonblocking = 1;
+    if(!bound || ioctlsocket(listener, FIONBIO, &nonblocking) == SOCKET_ERROR){
+        DWORD error = WSAGetLastError();
+        Close();
+        SetLastError(error);
+        return false;
+    }
+
+    if(notify) Notify(notify);
+    return true;
+}
+
+void TcpInbox::Close() {
+    for(Connection& connection : connections){
+        closesocket(connection.socket);
+    }
+    connections.clear();
+
+    if(listener != INVALID_SOCKET){
+        closesocket(listener);
+        listener = INVALID_SOCKET;
+    }
+}
+
+void TcpInbox::Notify(HANDLE event) {
+    notify = event;
+
+    // Accepted sockets inherit the listener's event selection.
+    if(listener != INVALID_SOCKET) WSAEventSelect(listener, notify, FD_ACCEPT | FD_READ | FD_CLOSE);
+}
+
+bool TcpInbox::Read(std::vector<std::string>& messages, IPCStats& stats) {
+    if(listener == INVALID_SOCKET) return false;
+
+    for(;;){ // accept every pending sender
+        stats.read_calls++;
+        SOCKET client = accept(listener, NULL, NULL);
+        if(client == INVALID_SOCKET){
+            if(WSAGetLastError() == WSAEWOULDBLOCK) break;
+            return false;
+        }
+
+        u_long nonblocking = 1;
+        ioctlsocket(client, FIONBIO, &nonblocking);
+        TcpNoDelay(client);
+        connections.push_back({ client, {} });
+    }
+
+    for(auto it = connections.begin(); it != connections.end();){
+        bool open = true;
+
+        for(;;){ // drain the socket
+            stats.read_calls++;
+            int bytes = recv(it->socket, buffer.data(), (int)buffer.size(), 0);
+            if(bytes > 0){
+                it->pending.append(buffer.data(), bytes);
+                stats.bytes_received += bytes;
+                continue;
+            }
+            if(bytes == SOCKET_ERROR && WSAGetLastError() == WSAEWOULDBLOCK) break;
+
+            open = false; // closed by the sender or reset
+            break;
+        }
+
+        size_t offset = 0;
+        while(it->pending.size() - offset >= sizeof(uint32_t)){
+            uint32_t length;
+            memcpy(&length, it->pending.data() + offset, sizeof(length));
+
+            if(length > IPC_TCP_MAX_FRAME){ // not one of our streams
+                open = false;
+                break;
+            }
+            if(it->pending.size() - offset - sizeof(length) < length) break; // frame incomplete
+
+            messages.emplace_back(it->pending.data() + offset + sizeof(length), length);
+            stats.messages_received++;
+            offset += sizeof(length) + length;
+        }
+        it->pending.erase(0, offset);
+
+        if(!open){
+            closesocket(it->socket);
+            it = connections.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    return true;
+}
+
+
+// TCP Outbox
+
+TcpOutbox::TcpOutbox(): connection(INVALID_SOCKET), connect_started(0), partial_sent(0) {}
+
+TcpOutbox::~TcpOutbox() {
+    Close();
+}
+
+bool TcpOutbox::Open(const std::string& address) {
+    if(connection != INVALID_SOCKET && connect_address == address){
+        // Finish the connect started by an earlier call without waiting for it
+        fd_set writable, failed;
+        FD_ZERO(&writable); FD_SET(connection, &writable);
+        FD_ZERO(&failed); FD_SET(connection, &failed);
+        timeval now { 0, 0 };
+
+        int ready = select(0, NULL, &writable, &failed, &now);
+        if(ready > 0 && FD_ISSET(connection, &writable)){
+            connect_address.clear();
+            TcpNoDelay(connection);
+            return true;
+        }
+
+        int error = WSAEWOULDBLOCK, length = sizeof(error);
+        if(ready == SOCKET_ERROR){
+            error = WSAGetLastError();
+        } else if(FD_ISSET(connection, &failed)){
+            getsockopt(connection, SOL_SOCKET, SO_ERROR, (char*)&error, &length);
+        } else if(GetTickCount64() - connect_started >= IPC_TCP_CONNECT_TIMEOUT){
+            error = WSAETIMEDOUT;
+        }
+        if(error != WSAEWOULDBLOCK) Close();
+        SetLastError(error);
+        return false;
+    }
+    Close();
+
+    addrinfo* result;
+    if(!TcpResolve(address, false, &result)) return false;
+
+    connection = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+    if(connection == INVALID_SOCKET){
+        freeaddrinfo(result);
+        return false;
+    }
+
+    // Connect in the background; the reactor calls Open again on later
+    // passes until the connect completes, so a missing peer never holds it up.
+    u_long nonblocking = 1;
+    ioctlsocket(connection, FIONBIO, &nonblocking);
+
+    bool connected = connect(connection, result->ai_addr, (int)result->ai_addrlen) != SOCKET_ERROR;
+    DWORD error = WSAGetLastError();
+    freeaddrinfo(result);
+
+    if(connected){
+        TcpNoDelay(connection);
+        return true;
+    }
+    if(error == WSAEWOULDBLOCK){
+        connect_address = address;
+        connect_started = GetTickCount64();
+    } else {
+        Close();
+    }
+    SetLastError(error);
+    return false;
+}
+
+void TcpOutbox::Close() {
+    if(connection != INVALID_SOCKET){
+        closesocket(connection);
+        connection = INVALID_SOCKET;
+    }
+    connect_address.clear();
+    partial.clear(); // a partial frame must never lead a new stream; Requeue first to keep it
+    partial_sent = 0;
+}
+
+void TcpOutbox::Requeue(std::deque<std::string>& batch) {
+    if(partial.empty()) return;
+
+    // The peer drops the incomplete frame with the connection, so it is sent again whole
+    batch.push_front(partial.substr(sizeof(uint32_t)));
+    partial.clear();
+    partial_sent = 0;
+}
+
+// Send until the socket is full, adding what it accepted to sent; false once the connection broke
+bool TcpOutbox::Send(const char* data, size_t size, size_t& sent, IPCStats& stats) {
+    for(size_t offset = 0; offset < size; ){
+        stats.write_calls++;
+        int bytes = send(connection, data + offset, (int)std::min<size_t>(size - offset, INT_MAX), 0);
+        if(bytes == SOCKET_ERROR) return WSAGetLastError() == WSAEWOULDBLOCK; // the rest goes out on a later pass
+        offset += bytes;
+        sent += bytes;
+        stats.bytes_sent += bytes;
+    }
+    return true;
+}
+
+bool TcpOutbox::Write(std::deque<std::string>& batch, IPCStats& stats) {
+    if(connection == INVALID_SOCKET || Connecting()){
+        SetLastError(WSAENOTCONN);
+        return false;
+    }
+
+    // A frame that has started going out is finished before anything else
+    if(!partial.empty()){
+        if(!Send(partial.data() + partial_sent, partial.size() - partial_sent, partial_sent, stats)) return false;
+        if(partial_sent < partial.size()) return true;
+        partial.clear();
+        partial_sent = 0;
+        stats.messages_sent++;
+    }
+
+    while(!batch.empty()){
+        // Frame as many messages as fit the buffer so they leave in as few sends as possible
+        buffer.clear();
+        for(size_t i = 0; i < batch.size() && (i == 0 || buffer.size() + batch[i].size() <= IPC_TCP_SEND_BUFFER); ++i){
+            uint32_t length = (uint32_t)batch[i].size();
+            buffer.append((const char*)&length, sizeof(length));
+            buffer += batch[i];
+        }
+
+        size_t sent = 0;
+        bool open = Send(buffer.data(), buffer.size(), sent, stats);
+
+        // Messages leave the batch once all of their bytes have gone out
+        size_t offset = 0;
+        while(!batch.empty() && sent - offset >= sizeof(uint32_t) + batch.front().size()){
+            offset += sizeof(uint32_t) + batch.front().size();
+            batch.pop_front();
+            stats.messages_sent++;
+        }
+        if(offset < sent){ // the stream cannot go on without the rest of this frame
+            partial.assign(buffer, offset, sizeof(uint32_t) + batch.front().size());
+            partial_sent = sent - offset;
+            batch.pop_front();
+        }
+
+        if(!open) return false;
+        if(sent < buffer.size()) return true; // the socket is full
+    }
+    return true;
+}
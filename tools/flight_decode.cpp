@@ -0,0 +1,136 @@
+// Flight recorder dump decoder
+//
+// Prints a dump written by CFlightRecorder as one line per event. Only the
+// standard library is used, so it builds wherever the dump is looked at:
+//
+//   g++ -std=c++17 -Iinclude tools/flight_decode.cpp -o flight_decode
+//   flight_decode example_service.flight [last N]
+
+#include "libwinservice_recorder_format.h"
+
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <ctime>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iterator>
+#include <algorithm>
+
+static_assert(sizeof(CFlightRecord) == 24 && sizeof(CFlightDumpHeader) == 48, "dump layout");
+
+// UTC time of day from microseconds since 1970
+static std::string FormatTime(int64_t micros) {
+    time_t seconds = (time_t)(micros / 1000000);
+    long fraction = (long)(micros % 1000000);
+    if(fraction < 0){
+        seconds -= 1;
+        fraction += 1000000;
+    }
+
+    char text[64];
+    size_t length = strftime(text, sizeof(text), "%Y-%m-%d %H:%M:%S", gmtime(&seconds));
+    snprintf(text + length, sizeof(text) - length, ".%06ld", fraction);
+    return text;
+}
+
+static std::string Describe(const CFlightRecord& record) {
+    char text[128];
+    switch(record.type){
+    case FLIGHT_CONTROL:
+        if(record.a >= 128 && record.a <= 255) snprintf(text, sizeof(text), "user control %u", record.a);
+        else snprintf(text, sizeof(text), "%s", FlightControlName(record.a));
+        break;
+    case FLIGHT_STATE:
+        if(record.b) snprintf(text, sizeof(text), "%s, exit code %u", FlightStateName(record.a), record.b);
+        else snprintf(text, sizeof(text), "%s", FlightStateName(record.a));
+        break;
+    case FLIGHT_IPC_SEND:
+        snprintf(text, sizeof(text), "%u bytes, %u waiting", record.a, record.b);
+        break;
+    case FLIGHT_IPC_RECEIVE:
+        snprintf(text, sizeof(text), "%u bytes from %u", record.a, record.b);
+        break;
+    case FLIGHT_IPC_OPEN:
+        if(record.a == FLIGHT_OUTBOX) snprintf(text, sizeof(text), "outbox, sent %s", FlightFrameName(record.b));
+        else snprintf(text, sizeof(text), "inbox");
+        break;
+    case FLIGHT_IPC_PEER:
+        snprintf(text, sizeof(text), "%s from %u", FlightFrameName(record.a), record.b);
+        break;
+    case FLIGHT_ERROR:
+        snprintf(text, sizeof(text), "%u (0x%08x)", record.a, record.a);
+        break;
+    case FLIGHT_DUMP:
+        snprintf(text, sizeof(text), "%s", FlightDumpReasonName(record.a));
+        break;
+    default:
+        snprintf(text, sizeof(text), "%u %u", record.a, record.b);
+        break;
+    }
+    return text;
+}
+
+int main(int argc, char** argv) {
+    if(argc < 2){
+        fprintf(stderr, "usage: %s <dump file> [last N]\n", argv[0]);
+        return 2;
+    }
+    size_t last = 0;
+    for(int i = 2; i + 1 < argc; ++i){
+        if(strcmp(argv[i], "last") == 0) last = strtoul(argv[i + 1], NULL, 10);
+    }
+
+    std::ifstream file(argv[1], std::ios::binary);
+    std::vector<char> data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    if(!file && !file.eof()){
+        fprintf(stderr, "%s: cannot read\n", argv[1]);
+        return 1;
+    }
+
+    CFlightDumpHeader header;
+    if(data.size() < sizeof(header) || memcmp(data.data(), FLIGHT_DUMP_MAGIC, sizeof(header.magic)) != 0){
+        fprintf(stderr, "%s: not a flight recorder dump\n", argv[1]);
+        return 1;
+    }
+    memcpy(&header, data.data(), sizeof(header));
+    if(header.version != FLIGHT_DUMP_VERSION || header.record_size != sizeof(CFlightRecord)){
+        fprintf(stderr, "%s: dump version %u is not supported\n", argv[1], header.version);
+        return 1;
+    }
+
+    size_t offset = sizeof(header);
+    std::vector<std::string> sources;
+    for(uint16_t i = 0; i < header.sources; ++i){
+        CFlightSourceName name;
+        if(offset + sizeof(name) > data.size()) break;
+        memcpy(&name, data.data() + offset, sizeof(name));
+        offset += sizeof(name);
+        if(offset + name.length > data.size()) break;
+
+        if(sources.size() <= name.id) sources.resize(name.id + 1);
+        sources[name.id].assign(data.data() + offset, name.length);
+        offset += name.length;
+    }
+
+    size_t available = (data.size() - std::min(offset, data.size())) / sizeof(CFlightRecord);
+    size_t records = std::min<size_t>(header.records, available);
+    size_t first = last && last < records ? records - last : 0;
+
+    printf("Process %u, dumped %s UTC (%s)\n", header.process_id, FormatTime(header.wall_time).c_str(),
+           FlightDumpReasonName(header.reason));
+    printf("%zu of %llu events recorded%s\n\n", records, (unsigned long long)header.recorded,
+           records < header.records ? ", the dump is truncated" : "");
+
+    for(size_t i = first; i < records; ++i){
+        CFlightRecord record;
+        memcpy(&record, data.data() + offset + i * sizeof(record), sizeof(record));
+
+        int64_t age = (int64_t)(header.time - record.time) / 1000; // microseconds before the dump
+        const char* source = record.source < sources.size() ? sources[record.source].c_str() : "?";
+        printf("%s %12.3fms %6u %-24s %-12s %s\n", FormatTime(header.wall_time - age).c_str(), -age / 1000.0,
+               record.thread, source, FlightEventName(record.type), Describe(record).c_str());
+    }
+    return 0;
+}